@@ -1,8 +1,35 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <memory.h>
+#include <algorithm>
 
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#endif
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#define PROFILER 1
+#include "../part3/listing_0100_bandwidth_profiler.cpp"
+#include "../part3/thread_pool.cpp"
 #include "listing_0065_haversine_formula.cpp"
 
 struct Location
@@ -15,20 +42,91 @@ struct Cluster
 {
    f64 lat;
    f64 lon;
-   f64 lat_radius;
+   f64 lat_radius; // box width, not half of it
    f64 lon_radius;
 };
 
-const int NUM_CLUSTERS = 8;
+const u32 DEFAULT_CLUSTER_COUNT = 8;
+const f64 MAX_CLUSTER_RADIUS = 180.0;
+
+enum class Distribution
+{
+   Uniform,
+   Cluster,       // uniform inside a box around each cluster center
+   Gaussian,      // normally distributed around each cluster center
+   Poles,         // latitudes bunched up near +-90
+   Antimeridian,  // longitudes bunched up near +-180
+};
+
+struct DistributionName
+{
+   const char*  name;
+   Distribution distribution;
+};
+
+static const DistributionName DISTRIBUTION_NAMES[] =
+{
+   {"uniform",      Distribution::Uniform},
+   {"cluster",      Distribution::Cluster},
+   {"gaussian",     Distribution::Gaussian},
+   {"poles",        Distribution::Poles},
+   {"antimeridian", Distribution::Antimeridian},
+};
+
+// Pairs are generated in fixed-size blocks. The block size, not the thread
+// count, decides how the distance total is grouped, so the JSON, the answers
+// and the printed average are byte-identical for any number of threads.
+const u64 PAIRS_PER_BLOCK = 16384;
+
+// blocks generated per thread before a batch is written out
+const u64 BLOCKS_PER_THREAD = 4;
+
+// upper bound on one "{x0, y0, x1, y1}," line with %.16f values
+const u64 MAX_PAIR_LINE_SIZE = 160;
+
+// every pair consumes exactly this many draws, so pair i starts at draw i*4
+const u64 DRAWS_PER_PAIR = 4;
+
+const u64 CLUSTER_STREAM = 1;
+const u64 PAIR_STREAM = 2;
+
+struct RandomStream
+{
+   u64 state;
+};
+
+const u64 SPLITMIX_GAMMA = 0x9E3779B97F4A7C15ull;
+
+static u64 MixBits(u64 Value)
+{
+   Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ull;
+   Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBull;
+   return Value ^ (Value >> 31);
+}
+
+// SplitMix64: draw n of a stream is MixBits(base + (n+1)*gamma), so a thread
+// can jump straight to the draws of the pair it is generating instead of
+// replaying everything before it the way srand/rand would need.
+RandomStream SeedRandomStream(u64 Seed, u64 Stream, u64 Position)
+{
+   RandomStream result;
+
+   result.state = MixBits(Seed ^ (Stream * 0xD1B54A32D192ED03ull)) + Position * SPLITMIX_GAMMA;
+
+   return result;
+}
 
-f64 GenerateRandomNumber()
+f64 GenerateRandomNumber(RandomStream* Stream)
 {
-   return (f64)rand() / (f64)RAND_MAX;
+   Stream->state += SPLITMIX_GAMMA;
+
+   // top 53 bits -> [0, 1)
+   return (f64)(MixBits(Stream->state) >> 11) * (1.0 / 9007199254740992.0);
 }
 
-void GeneratePoint(Location* Point, bool Latitude, Cluster* ClusterInfo = nullptr)
+void GeneratePoint(RandomStream* Stream, Location* Point, bool Latitude, Cluster* ClusterInfo = nullptr)
 {
-   f64 rand_f = GenerateRandomNumber();
+   f64 rand_f = GenerateRandomNumber(Stream);
 
    if (!ClusterInfo)
    {
@@ -46,141 +144,910 @@ void GeneratePoint(Location* Point, bool Latitude, Cluster* ClusterInfo = nullpt
    }
 }
 
-int main(int argc, char* argv[])
+// Maps [0, 1) to [-1, 1) with most of the values close to -1 or 1.
+static f64 SkewTowardEdges(f64 Value)
 {
-   int       number_of_pairs = 0;
-   int       seed = 0;
-   bool      uniform = true;
-   f64*      haversine_distances = nullptr;
-   Location* haversine_pairs = nullptr;
-   Cluster*  cluster_info = nullptr;
-   f64       total = 0;
-   FILE*     fd = nullptr;
+   f64 t = 2.0 * Value - 1.0;
+   f64 a = 1.0 - fabs(t);
+
+   return copysign(1.0 - a*a*a, t);
+}
 
-   if (argc != 4)
+// Every distribution uses exactly two draws per location, so DRAWS_PER_PAIR
+// holds for all of them.
+void GenerateLocation(RandomStream* Stream, Location* Point, Distribution Dist, Cluster* ClusterInfo)
+{
+   switch (Dist)
    {
-      printf("haversine_generator [uniform | cluster] [seed] [number of pairs]\n");
-      exit(1);
+      case Distribution::Uniform:
+      case Distribution::Cluster:
+      {
+         GeneratePoint(Stream, Point, true, ClusterInfo);
+         GeneratePoint(Stream, Point, false, ClusterInfo);
+      } break;
+
+      case Distribution::Gaussian:
+      {
+         // Box-Muller turns the two draws into two independent normals. Sigma
+         // is a quarter of the cluster radius, so ~95% of the points land in
+         // the box the uniform clusters use.
+         f64 u0 = GenerateRandomNumber(Stream);
+         f64 u1 = GenerateRandomNumber(Stream);
+         f64 r = sqrt(-2.0 * log(1.0 - u0));
+         f64 angle = 6.28318530717958647692 * u1;
+
+         Point->lat = ClusterInfo->lat + r * cos(angle) * 0.25 * ClusterInfo->lat_radius;
+         Point->lon = ClusterInfo->lon + r * sin(angle) * 0.25 * ClusterInfo->lon_radius;
+      } break;
+
+      case Distribution::Poles:
+      {
+         Point->lat = 90.0 * SkewTowardEdges(GenerateRandomNumber(Stream));
+         Point->lon = (GenerateRandomNumber(Stream) - 0.5) * 360.0;
+      } break;
+
+      case Distribution::Antimeridian:
+      {
+         Point->lat = (GenerateRandomNumber(Stream) - 0.5) * 180.0;
+         Point->lon = 180.0 * SkewTowardEdges(GenerateRandomNumber(Stream));
+      } break;
    }
 
-   if (strcmp("cluster", argv[1]) == 0)
-      uniform = false;
+   // Gaussian tails and big cluster radii can leave the globe: clamp the
+   // latitude and wrap the longitude (with fmod, since a tail can go around
+   // more than once). Points already in range are untouched.
+   if (Point->lat > 90.0)
+      Point->lat = 90.0;
+   else if (Point->lat < -90.0)
+      Point->lat = -90.0;
+
+   if (Point->lon >= 180.0 || Point->lon < -180.0)
+   {
+      f64 wrapped = fmod(Point->lon + 180.0, 360.0);
+      if (wrapped < 0.0)
+         wrapped += 360.0;
+
+      // a tiny negative remainder rounds to exactly 360 when shifted up
+      if (wrapped >= 360.0)
+         wrapped = 0.0;
+
+      Point->lon = wrapped - 180.0;
+   }
+}
 
-   seed = atoi(argv[2]);
-   number_of_pairs = atoi(argv[3]);
+// Radius > 0 gives every cluster that radius instead of a random one. The
+// "radius" is really the width of the box around the centre: points land
+// within Radius/2 of it (see GeneratePoint).
+void GenerateClusters(u64 Seed, Cluster* cluster_info, u32 ClusterCount, f64 Radius)
+{
+   RandomStream stream = SeedRandomStream(Seed, CLUSTER_STREAM, 0);
 
-   fd = fopen("haversine_points.json", "w");
-   if (!fd)
+   for (u32 i = 0; i < ClusterCount; i++)
    {
-      fprintf(stderr, "Error opening file: haversine_points.json\n");
-      exit(1);
+      // generate radius from 15.0 - 40 degrees
+      cluster_info[i].lat_radius = (GenerateRandomNumber(&stream) * 30.0) + 10.0;
+      cluster_info[i].lon_radius = (GenerateRandomNumber(&stream) * 30.0) + 10.0;
+
+      if (Radius > 0.0)
+         cluster_info[i].lat_radius = cluster_info[i].lon_radius = Radius;
+
+      // generate starting point
+      cluster_info[i].lat = (GenerateRandomNumber(&stream) - 0.5) * 180.0;
+      cluster_info[i].lon = (GenerateRandomNumber(&stream) - 0.5) * 360.0;
+
+      if (cluster_info[i].lat > 0.0 && cluster_info[i].lat < cluster_info[i].lat_radius)
+         cluster_info[i].lat += cluster_info[i].lat_radius;
+      else if (cluster_info[i].lat < 90.0 && cluster_info[i].lat > 90.0 - cluster_info[i].lat_radius)
+         cluster_info[i].lat -= cluster_info[i].lat_radius;
+      else if (cluster_info[i].lat < 0.0 && cluster_info[i].lat > -cluster_info[i].lat_radius)
+         cluster_info[i].lat -= cluster_info[i].lat_radius;
+      else if (cluster_info[i].lat > -90.0 && cluster_info[i].lat < -90.0 + cluster_info[i].lat_radius)
+         cluster_info[i].lat += cluster_info[i].lat_radius;
+
+      if (cluster_info[i].lon > 0.0 && cluster_info[i].lon < cluster_info[i].lon_radius)
+         cluster_info[i].lon += cluster_info[i].lon_radius;
+      else if (cluster_info[i].lon < 180.0 && cluster_info[i].lon > 180.0 - cluster_info[i].lon_radius)
+         cluster_info[i].lon -= cluster_info[i].lon_radius;
+      else if (cluster_info[i].lon < 0.0 && cluster_info[i].lon > -cluster_info[i].lon_radius)
+         cluster_info[i].lon -= cluster_info[i].lon_radius;
+      else if (cluster_info[i].lon > -180.0 && cluster_info[i].lon < -180.0 + cluster_info[i].lon_radius)
+         cluster_info[i].lon += cluster_info[i].lon_radius;
+
+      // the shifts above were made for 10-40 degree boxes and can push a
+      // bigger one over a pole: keep the whole box between the poles, so a
+      // 180 degree box sits on the equator and covers every latitude
+      f64 max_lat = 90.0 - 0.5 * cluster_info[i].lat_radius;
+      if (cluster_info[i].lat > max_lat)
+         cluster_info[i].lat = max_lat;
+      else if (cluster_info[i].lat < -max_lat)
+         cluster_info[i].lat = -max_lat;
    }
+}
 
-   srand(seed);
+static const char DIGIT_PAIRS[] =
+   "00010203040506070809"
+   "10111213141516171819"
+   "20212223242526272829"
+   "30313233343536373839"
+   "40414243444546474849"
+   "50515253545556575859"
+   "60616263646566676869"
+   "70717273747576777879"
+   "80818283848586878889"
+   "90919293949596979899";
 
-   printf("Generating %d pairs...\n", number_of_pairs);
+// writes exactly 8 digits, leading zeros included
+static char* WriteDigits8(char* at, u32 Value)
+{
+   u32 high = Value / 10000;
+   u32 low = Value % 10000;
+
+   memcpy(at + 0, &DIGIT_PAIRS[2*(high / 100)], 2);
+   memcpy(at + 2, &DIGIT_PAIRS[2*(high % 100)], 2);
+   memcpy(at + 4, &DIGIT_PAIRS[2*(low / 100)], 2);
+   memcpy(at + 6, &DIGIT_PAIRS[2*(low % 100)], 2);
+
+   return at + 8;
+}
+
+// Same text as printf("%.16f"), without the locale/varargs/stdio overhead.
+// A double below 999 is mantissa * 2^-shift with shift >= 43, so
+// mantissa * 10^16 fits in 128 bits and shifting it back down gives the
+// exactly rounded (ties to even, like glibc) 16-digit fixed point value.
+// Anything out of that range (never a coordinate), or a compiler without
+// 128-bit integers, falls back to snprintf.
+static char* FormatFixed16(char* at, f64 Value)
+{
+#if defined(__SIZEOF_INT128__)
+   u64 bits;
+   memcpy(&bits, &Value, sizeof(bits));
 
-   haversine_distances = new f64[number_of_pairs];
-   haversine_pairs = new Location[number_of_pairs*2];
+   u64 exponent = (bits >> 52) & 0x7FF;
+   u64 mantissa = bits & ((1ull << 52) - 1);
 
-   if (!uniform)
+   if (fabs(Value) < 999.0)
    {
-      cluster_info = new Cluster[NUM_CLUSTERS];
-      for (int i = 0; i < NUM_CLUSTERS; i++)
-      {
-         // generate radius from 15.0 - 40 degrees
-         cluster_info[i].lat_radius = (GenerateRandomNumber() * 30.0) + 10.0;
-         cluster_info[i].lon_radius = (GenerateRandomNumber() * 30.0) + 10.0;
+      if (exponent)
+         mantissa |= 1ull << 52;
+      else
+         exponent = 1;
 
-         // generate starting point
-         cluster_info[i].lat = (GenerateRandomNumber() - 0.5) * 180.0;
-         cluster_info[i].lon = (GenerateRandomNumber() - 0.5) * 360.0;
+      u64 shift = 1075 - exponent;
+      u64 scaled = 0;
 
-         if (cluster_info[i].lat > 0.0 && cluster_info[i].lat < cluster_info[i].lat_radius)
-            cluster_info[i].lat += cluster_info[i].lat_radius;
-         else if (cluster_info[i].lat < 90.0 && cluster_info[i].lat > 90.0 - cluster_info[i].lat_radius)
-            cluster_info[i].lat -= cluster_info[i].lat_radius;
-         else if (cluster_info[i].lat < 0.0 && cluster_info[i].lat > -cluster_info[i].lat_radius)
-            cluster_info[i].lat -= cluster_info[i].lat_radius;
-         else if (cluster_info[i].lat > -90.0 && cluster_info[i].lat < -90.0 + cluster_info[i].lat_radius)
-            cluster_info[i].lat += cluster_info[i].lat_radius;
+      // below 2^-128 the product can't reach half a unit of the last digit
+      if (shift < 128)
+      {
+         unsigned __int128 product = (unsigned __int128)mantissa * 10000000000000000ull;
+         unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+         unsigned __int128 rest = product & ((half << 1) - 1);
 
-         if (cluster_info[i].lon > 0.0 && cluster_info[i].lon < cluster_info[i].lon_radius)
-            cluster_info[i].lon += cluster_info[i].lon_radius;
-         else if (cluster_info[i].lon < 180.0 && cluster_info[i].lon > 180.0 - cluster_info[i].lon_radius)
-            cluster_info[i].lon -= cluster_info[i].lon_radius;
-         else if (cluster_info[i].lon < 0.0 && cluster_info[i].lon > -cluster_info[i].lon_radius)
-            cluster_info[i].lon -= cluster_info[i].lon_radius;
-         else if (cluster_info[i].lon > -180.0 && cluster_info[i].lon < -180.0 + cluster_info[i].lon_radius)
-            cluster_info[i].lon += cluster_info[i].lon_radius;
+         scaled = (u64)(product >> shift);
+         if (rest > half || (rest == half && (scaled & 1)))
+            scaled++;
       }
+
+      u64 whole = scaled / 10000000000000000ull;
+      u64 fraction = scaled % 10000000000000000ull;
+
+      if (bits >> 63)
+         *at++ = '-';
+
+      if (whole >= 100)
+         *at++ = '0' + (char)(whole / 100);
+      if (whole >= 10)
+         *at++ = '0' + (char)((whole / 10) % 10);
+      *at++ = '0' + (char)(whole % 10);
+      *at++ = '.';
+
+      at = WriteDigits8(at, (u32)(fraction / 100000000));
+      at = WriteDigits8(at, (u32)(fraction % 100000000));
+
+      return at;
    }
+#endif
+
+   // huge values would overrun the line, those get cut off
+   int size = snprintf(at, 64, "%.16f", Value);
+
+   return at + ((size < 64) ? size : 63);
+}
+
+static char* WriteLiteral(char* at, const char* Literal, u64 Size)
+{
+   memcpy(at, Literal, Size);
+   return at + Size;
+}
+
+#define WRITE_LITERAL(at, Literal) WriteLiteral(at, Literal, sizeof(Literal) - 1)
+
+static char* FormatPairLine(char* at, Location* point0, Location* point1, bool last)
+{
+   at = WRITE_LITERAL(at, "      {\"x0\":");
+   at = FormatFixed16(at, point0->lon);
+   at = WRITE_LITERAL(at, ", \"y0\":");
+   at = FormatFixed16(at, point0->lat);
+   at = WRITE_LITERAL(at, ", \"x1\":");
+   at = FormatFixed16(at, point1->lon);
+   at = WRITE_LITERAL(at, ", \"y1\":");
+   at = FormatFixed16(at, point1->lat);
+
+   if (last)
+      at = WRITE_LITERAL(at, "}\n");
+   else
+      at = WRITE_LITERAL(at, "},\n");
+
+   return at;
+}
+
+struct GeneratedPair
+{
+   f64 x0;
+   f64 y0;
+   f64 x1;
+   f64 y1;
+};
+
+// sort key for -sorted: y0 first, the rest only to make the order total
+static bool PairLess(const GeneratedPair& A, const GeneratedPair& B)
+{
+   if (A.y0 != B.y0) return A.y0 < B.y0;
+   if (A.x0 != B.x0) return A.x0 < B.x0;
+   if (A.y1 != B.y1) return A.y1 < B.y1;
+   return A.x1 < B.x1;
+}
+
+struct GeneratedBlock
+{
+   char* text;
+   u64   text_size;
+   f64*  distances;
+   f64*  pairs;  // x0, y0, x1, y1 per pair, only for -binary
+   u64   pair_count;
+   f64   total;
+};
+
+struct GeneratorJob
+{
+   Distribution    distribution;
+   bool            use_printf;
+   u64             seed;
+   u64             number_of_pairs;
+   Cluster*        cluster_info;
+   u32             cluster_count;
+   u64             first_block;  // blocks[0] is this block of the whole run
+   GeneratedBlock* blocks;
+
+   // -sorted: every pair, generated and sorted up front
+   GeneratedPair*  sorted_pairs;
+   GeneratedPair*  merge_pairs;
+   u64             merge_run_size;
+};
+
+static void GeneratePair(GeneratorJob* job, RandomStream* stream, u64 index, Location* point0, Location* point1)
+{
+   Cluster* cluster = nullptr;
+
+   if (job->distribution == Distribution::Cluster || job->distribution == Distribution::Gaussian)
+      cluster = &job->cluster_info[index % job->cluster_count];
+
+   GenerateLocation(stream, point0, job->distribution, cluster);
+   GenerateLocation(stream, point1, job->distribution, cluster);
+}
+
+static void GenerateBlock(void* Data, u32 TaskIndex)
+{
+   TimeBlock("Generate block");
+
+   GeneratorJob*   job = (GeneratorJob*)Data;
+   GeneratedBlock* block = &job->blocks[TaskIndex];
+   u64             first = (job->first_block + TaskIndex) * PAIRS_PER_BLOCK;
+   u64             end = first + PAIRS_PER_BLOCK;
+   char*           at = block->text;
+
+   if (end > job->number_of_pairs)
+      end = job->number_of_pairs;
 
-   fprintf(fd, "{\"pairs\":\n");
-   fprintf(fd, "   [\n");
+   block->pair_count = end - first;
+   block->total = 0;
 
-   for (int i = 0; i < number_of_pairs; i++)
+   RandomStream stream = SeedRandomStream(job->seed, PAIR_STREAM, first * DRAWS_PER_PAIR);
+
+   for (u64 i = first; i < end; i++)
    {
-      int idx1 = i*2;
-      int idx2 = idx1+1;
-      int idxc = i % NUM_CLUSTERS;
+      Location point0;
+      Location point1;
 
-      if (uniform)
+      if (job->sorted_pairs)
       {
-         GeneratePoint(&haversine_pairs[idx1], true);
-         GeneratePoint(&haversine_pairs[idx1], false);
-         GeneratePoint(&haversine_pairs[idx2], true);
-         GeneratePoint(&haversine_pairs[idx2], false);
+         GeneratedPair* pair = &job->sorted_pairs[i];
+
+         point0.lon = pair->x0;
+         point0.lat = pair->y0;
+         point1.lon = pair->x1;
+         point1.lat = pair->y1;
       }
       else
       {
-         GeneratePoint(&haversine_pairs[idx1], true, &cluster_info[idxc]);
-         GeneratePoint(&haversine_pairs[idx1], false, &cluster_info[idxc]);
-         GeneratePoint(&haversine_pairs[idx2], true, &cluster_info[idxc]);
-         GeneratePoint(&haversine_pairs[idx2], false, &cluster_info[idxc]);
+         GeneratePair(job, &stream, i, &point0, &point1);
+      }
+
+      f64 distance = ReferenceHaversine(point0.lon, point0.lat, point1.lon, point1.lat, 6372.8);
+
+      block->distances[i - first] = distance;
+
+      if (block->pairs)
+      {
+         f64* pair = &block->pairs[4*(i - first)];
+
+         pair[0] = point0.lon;
+         pair[1] = point0.lat;
+         pair[2] = point1.lon;
+         pair[3] = point1.lat;
       }
 
-      haversine_distances[i] = ReferenceHaversine(haversine_pairs[idx1].lon, haversine_pairs[idx1].lat,
-                                                  haversine_pairs[idx2].lon, haversine_pairs[idx2].lat,
-                                                  6372.8);
+      block->total += distance;
 
-      if (i == number_of_pairs-1)
+      bool last = (i == job->number_of_pairs-1);
+
+      if (job->use_printf)
       {
-         fprintf(fd, "      {\"x0\":%.16f, \"y0\":%.16f, \"x1\":%.16f, \"y1\":%.16f}\n",
-            haversine_pairs[idx1].lon, haversine_pairs[idx1].lat,
-            haversine_pairs[idx2].lon, haversine_pairs[idx2].lat);
+         at += snprintf(at, MAX_PAIR_LINE_SIZE, "      {\"x0\":%.16f, \"y0\":%.16f, \"x1\":%.16f, \"y1\":%.16f}%s\n",
+                        point0.lon, point0.lat, point1.lon, point1.lat, last ? "" : ",");
       }
       else
       {
-         fprintf(fd, "      {\"x0\":%.16f, \"y0\":%.16f, \"x1\":%.16f, \"y1\":%.16f},\n",
-            haversine_pairs[idx1].lon, haversine_pairs[idx1].lat,
-            haversine_pairs[idx2].lon, haversine_pairs[idx2].lat);
+         at = FormatPairLine(at, &point0, &point1, last);
       }
+   }
 
-      total += haversine_distances[i];
+   block->text_size = at - block->text;
+}
+
+static void GenerateSortedBlock(void* Data, u32 BlockIndex)
+{
+   TimeBlock("Generate and sort block");
+
+   GeneratorJob* job = (GeneratorJob*)Data;
+   u64           first = (u64)BlockIndex * PAIRS_PER_BLOCK;
+   u64           end = first + PAIRS_PER_BLOCK;
+
+   if (end > job->number_of_pairs)
+      end = job->number_of_pairs;
+
+   RandomStream stream = SeedRandomStream(job->seed, PAIR_STREAM, first * DRAWS_PER_PAIR);
+
+   for (u64 i = first; i < end; i++)
+   {
+      Location point0;
+      Location point1;
+
+      GeneratePair(job, &stream, i, &point0, &point1);
+
+      job->sorted_pairs[i] = {point0.lon, point0.lat, point1.lon, point1.lat};
+   }
+
+   std::sort(&job->sorted_pairs[first], &job->sorted_pairs[end], PairLess);
+}
+
+static void MergeSortedRuns(void* Data, u32 TaskIndex)
+{
+   TimeBlock("Merge runs");
+
+   GeneratorJob* job = (GeneratorJob*)Data;
+   u64           first = (u64)TaskIndex * 2 * job->merge_run_size;
+   u64           middle = first + job->merge_run_size;
+   u64           end = middle + job->merge_run_size;
+
+   if (middle > job->number_of_pairs)
+      middle = job->number_of_pairs;
+   if (end > job->number_of_pairs)
+      end = job->number_of_pairs;
+
+   std::merge(&job->sorted_pairs[first], &job->sorted_pairs[middle],
+              &job->sorted_pairs[middle], &job->sorted_pairs[end],
+              &job->merge_pairs[first], PairLess);
+}
+
+// Sorting needs every pair at once, so unlike the streaming path this holds
+// two copies of the whole data set. Blocks are sorted on their own and then
+// merged pairwise; the runs only depend on the block size, so the result is
+// the same for any thread count.
+static void GenerateSortedPairs(thread_pool* pool, GeneratorJob* job, u64 block_count)
+{
+   job->sorted_pairs = new GeneratedPair[job->number_of_pairs];
+   job->merge_pairs = new GeneratedPair[job->number_of_pairs];
+
+   {
+      TimeBlock("Generate and sort blocks");
+      RunTasks(pool, (u32)block_count, GenerateSortedBlock, job);
+   }
+
+   TimeBlock("Merge sorted blocks");
+
+   for (job->merge_run_size = PAIRS_PER_BLOCK;
+        job->merge_run_size < job->number_of_pairs;
+        job->merge_run_size *= 2)
+   {
+      u64 merge_count = (job->number_of_pairs + 2 * job->merge_run_size - 1) / (2 * job->merge_run_size);
+
+      RunTasks(pool, (u32)merge_count, MergeSortedRuns, job);
+      std::swap(job->sorted_pairs, job->merge_pairs);
+   }
+
+   delete [] job->merge_pairs;
+   job->merge_pairs = nullptr;
+}
+
+// Writes go straight to the OS, either as writev calls or, for files whose
+// size is known up front, as copies into a mapping of the pre-sized file.
+struct OutputFile
+{
+#if _WIN32
+   HANDLE handle;
+   HANDLE mapping;
+#else
+   int    fd;
+#endif
+   u8*    mapped;
+   u64    mapped_size;
+   u64    offset;
+};
+
+struct OutputChunk
+{
+   const void* data;
+   u64         size;
+};
+
+// MappedSize != 0 pre-sizes the file (fallocate, or ftruncate where that
+// isn't supported) and maps it for writing. If that fails the file is
+// written with plain writes instead.
+bool OpenOutputFile(const char* Filename, OutputFile* File, u64 MappedSize = 0)
+{
+   *File = {};
+
+#if _WIN32
+   File->handle = CreateFileA(Filename, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+   if (File->handle == INVALID_HANDLE_VALUE)
+      return false;
+
+   if (MappedSize)
+   {
+      File->mapping = CreateFileMappingA(File->handle, 0, PAGE_READWRITE, (DWORD)(MappedSize >> 32),
+                                         (DWORD)MappedSize, 0);
+      if (File->mapping)
+         File->mapped = (u8*)MapViewOfFile(File->mapping, FILE_MAP_WRITE, 0, 0, MappedSize);
+   }
+#else
+   File->fd = open(Filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (File->fd < 0)
+      return false;
+
+   if (MappedSize && (fallocate(File->fd, 0, 0, MappedSize) == 0 || ftruncate(File->fd, MappedSize) == 0))
+   {
+      void* data = mmap(0, MappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, File->fd, 0);
+
+      if (data != MAP_FAILED)
+         File->mapped = (u8*)data;
+      else if (ftruncate(File->fd, 0) != 0)
+         return false;
+   }
+#endif
+
+   if (File->mapped)
+      File->mapped_size = MappedSize;
+   else if (MappedSize)
+      fprintf(stderr, "Unable to map %s, using regular writes\n", Filename);
+
+   return true;
+}
+
+// Hands all the chunks to the OS in order, straight out of the block buffers.
+// On linux that is one writev per IOV_MAX chunks instead of a copy through
+// stdio's buffer.
+bool WriteOutputChunks(OutputFile* File, OutputChunk* Chunks, u64 ChunkCount)
+{
+   if (File->mapped)
+   {
+      for (u64 i = 0; i < ChunkCount; i++)
+      {
+         if (Chunks[i].size > File->mapped_size - File->offset)
+            return false;
+
+         memcpy(File->mapped + File->offset, Chunks[i].data, Chunks[i].size);
+         File->offset += Chunks[i].size;
+      }
+
+      return true;
+   }
+
+#if _WIN32
+   for (u64 i = 0; i < ChunkCount; i++)
+   {
+      const u8* data = (const u8*)Chunks[i].data;
+      u64       remaining = Chunks[i].size;
+
+      while (remaining)
+      {
+         DWORD to_write = (remaining > 0x40000000) ? 0x40000000 : (DWORD)remaining;
+         DWORD written = 0;
+
+         if (!WriteFile(File->handle, data, to_write, &written, 0) || !written)
+            return false;
+
+         data += written;
+         remaining -= written;
+         File->offset += written;
+      }
+   }
+#else
+   struct iovec vectors[IOV_MAX];
+   u64          next = 0;
+   u64          offset = 0;  // bytes of Chunks[next] already written
+
+   while (next < ChunkCount)
+   {
+      int vector_count = 0;
+
+      for (u64 i = next; i < ChunkCount && vector_count < IOV_MAX; i++)
+      {
+         u64 skip = (i == next) ? offset : 0;
+
+         vectors[vector_count].iov_base = (u8*)Chunks[i].data + skip;
+         vectors[vector_count].iov_len = Chunks[i].size - skip;
+         vector_count++;
+      }
+
+      ssize_t written = writev(File->fd, vectors, vector_count);
+      if (written <= 0)
+         return false;
+
+      File->offset += written;
+
+      // partial writes just pick up again mid-chunk
+      u64 consumed = (u64)written;
+      while (next < ChunkCount && consumed >= Chunks[next].size - offset)
+      {
+         consumed -= Chunks[next].size - offset;
+         offset = 0;
+         next++;
+      }
+      offset += consumed;
+   }
+#endif
+
+   return true;
+}
+
+bool WriteOutput(OutputFile* File, const void* Data, u64 Size)
+{
+   OutputChunk chunk = {Data, Size};
+
+   return WriteOutputChunks(File, &chunk, 1);
+}
+
+// Unmaps and trims a mapped file back to what was actually written.
+bool CloseOutputFile(OutputFile* File)
+{
+   bool result = true;
+
+#if _WIN32
+   if (File->mapped)
+   {
+      LARGE_INTEGER size;
+      size.QuadPart = File->offset;
+
+      result = UnmapViewOfFile(File->mapped) && CloseHandle(File->mapping);
+      if (File->offset != File->mapped_size)
+         result = SetFilePointerEx(File->handle, size, 0, FILE_BEGIN) && SetEndOfFile(File->handle) && result;
+   }
+
+   result = CloseHandle(File->handle) && result;
+#else
+   if (File->mapped)
+   {
+      result = munmap(File->mapped, File->mapped_size) == 0;
+      if (File->offset != File->mapped_size)
+         result = ftruncate(File->fd, File->offset) == 0 && result;
+   }
+
+   result = close(File->fd) == 0 && result;
+#endif
+
+   *File = {};
+
+   return result;
+}
+
+void PrintUsage()
+{
+   printf("haversine_generator [uniform | cluster | gaussian | poles | antimeridian] [seed] [number of pairs] [options]\n");
+   printf("   -threads N   generate on N threads (0 = one per core, the default)\n");
+   printf("   -printf      format coordinates with snprintf instead of the fast formatter\n");
+   printf("   -binary      also write haversine_pairs.bin (x0, y0, x1, y1 f64s per pair)\n");
+   printf("   -mmap        write the binary files through a pre-sized mapping\n");
+   printf("   -clusters N  number of clusters for cluster/gaussian (default %u)\n", DEFAULT_CLUSTER_COUNT);
+   printf("   -radius D    cluster box width in degrees, points land within D/2 of the centre\n");
+   printf("                (up to %.0f, default random 10-40 per cluster)\n", MAX_CLUSTER_RADIUS);
+   printf("   -sorted      sort the pairs by y0 (holds every pair in memory)\n");
+}
+
+int main(int argc, char* argv[])
+{
+   BeginProfile();
+
+   static const char header[] = "{\"pairs\":\n   [\n";
+   static const char footer[] = "   ]\n}\n";
+
+   u64             number_of_pairs = 0;
+   u64             seed = 0;
+   u32             thread_count = 0;
+   Distribution    distribution = Distribution::Uniform;
+   bool            known_distribution = false;
+   u32             cluster_count = DEFAULT_CLUSTER_COUNT;
+   f64             cluster_radius = 0.0;
+   bool            sorted = false;
+   bool            use_printf = false;
+   bool            write_pairs = false;
+   bool            use_mmap = false;
+   Cluster*        cluster_info = nullptr;
+   GeneratedBlock* blocks = nullptr;
+   OutputChunk*    chunks = nullptr;
+   OutputChunk*    binary_chunks = nullptr;
+   u64             block_count = 0;
+   u64             batch_block_count = 0;
+   u64             json_size = 0;
+   f64             total = 0;
+   bool            written = true;
+   OutputFile      json_file;
+   OutputFile      answers_file;
+   OutputFile      pairs_file;
+
+   if (argc < 4)
+   {
+      PrintUsage();
+      exit(1);
+   }
+
+   for (int i = 4; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+         thread_count = atoi(argv[++i]);
+      else if (strcmp(argv[i], "-printf") == 0)
+         use_printf = true;
+      else if (strcmp(argv[i], "-binary") == 0)
+         write_pairs = true;
+      else if (strcmp(argv[i], "-mmap") == 0)
+         use_mmap = true;
+      else if (strcmp(argv[i], "-clusters") == 0 && i + 1 < argc)
+      {
+         int count = atoi(argv[++i]);
+         if (count <= 0)
+         {
+            fprintf(stderr, "Error: -clusters needs at least one cluster\n");
+            PrintUsage();
+            exit(1);
+         }
+         cluster_count = (u32)count;
+      }
+      else if (strcmp(argv[i], "-radius") == 0 && i + 1 < argc)
+      {
+         // a box wider than 180 degrees can't fit between the poles, and the
+         // clamping would just pile the extra points up on them
+         cluster_radius = atof(argv[++i]);
+         if (!(cluster_radius > 0.0 && cluster_radius <= MAX_CLUSTER_RADIUS))
+         {
+            fprintf(stderr, "Error: -radius must be more than 0 and at most %.0f degrees\n", MAX_CLUSTER_RADIUS);
+            PrintUsage();
+            exit(1);
+         }
+      }
+      else if (strcmp(argv[i], "-sorted") == 0)
+         sorted = true;
+      else
+      {
+         PrintUsage();
+         exit(1);
+      }
+   }
+
+   for (u32 i = 0; i < ArrayCount(DISTRIBUTION_NAMES); i++)
+   {
+      if (strcmp(DISTRIBUTION_NAMES[i].name, argv[1]) == 0)
+      {
+         distribution = DISTRIBUTION_NAMES[i].distribution;
+         known_distribution = true;
+      }
+   }
+
+   seed = strtoull(argv[2], nullptr, 10);
+   number_of_pairs = strtoull(argv[3], nullptr, 10);
+
+   if (!known_distribution || number_of_pairs == 0 || cluster_count == 0)
+   {
+      PrintUsage();
+      exit(1);
+   }
+
+   if (!OpenOutputFile("haversine_points.json", &json_file))
+   {
+      fprintf(stderr, "Error opening file: haversine_points.json\n");
+      exit(1);
+   }
+
+   // the binary files have known sizes: a distance per pair plus the average,
+   // and four coordinates per pair
+   if (!OpenOutputFile("haversine_distances.bin", &answers_file,
+                       use_mmap ? (number_of_pairs + 1) * sizeof(f64) : 0))
+   {
+      fprintf(stderr, "Error opening file: haversine_distances.bin\n");
+      exit(1);
+   }
+
+   if (write_pairs && !OpenOutputFile("haversine_pairs.bin", &pairs_file,
+                                      use_mmap ? number_of_pairs * 4 * sizeof(f64) : 0))
+   {
+      fprintf(stderr, "Error opening file: haversine_pairs.bin\n");
+      exit(1);
+   }
+
+   thread_pool* pool = CreateThreadPool(thread_count);
+
+   printf("Generating %llu pairs on %u threads...\n", number_of_pairs, pool->ThreadCount);
+
+   // Only one batch of blocks is ever in memory: it is generated, written
+   // out and then reused for the next batch, so memory stays the same for
+   // any number of pairs.
+   block_count = (number_of_pairs + PAIRS_PER_BLOCK - 1) / PAIRS_PER_BLOCK;
+   batch_block_count = pool->ThreadCount * BLOCKS_PER_THREAD;
+   if (batch_block_count > block_count)
+      batch_block_count = block_count;
+
+   blocks = new GeneratedBlock[batch_block_count];
+   chunks = new OutputChunk[batch_block_count + 2];
+   binary_chunks = new OutputChunk[batch_block_count];
+
+   for (u64 i = 0; i < batch_block_count; i++)
+   {
+      blocks[i] = {};
+      blocks[i].text = new char[PAIRS_PER_BLOCK * MAX_PAIR_LINE_SIZE];
+      blocks[i].distances = new f64[PAIRS_PER_BLOCK];
+
+      if (write_pairs)
+         blocks[i].pairs = new f64[4 * PAIRS_PER_BLOCK];
+   }
+
+   if (distribution == Distribution::Cluster || distribution == Distribution::Gaussian)
+   {
+      cluster_info = new Cluster[cluster_count];
+      GenerateClusters(seed, cluster_info, cluster_count, cluster_radius);
+   }
+
+   GeneratorJob job = {};
+   job.distribution = distribution;
+   job.use_printf = use_printf;
+   job.seed = seed;
+   job.number_of_pairs = number_of_pairs;
+   job.cluster_info = cluster_info;
+   job.cluster_count = cluster_count;
+   job.blocks = blocks;
+
+   u64 emit_start = ReadOSTimer();
+
+   if (sorted)
+      GenerateSortedPairs(pool, &job, block_count);
+
+   for (u64 first_block = 0; first_block < block_count && written; first_block += batch_block_count)
+   {
+      u64 batch_count = block_count - first_block;
+      if (batch_count > batch_block_count)
+         batch_count = batch_block_count;
+
+      {
+         TimeBlock("Generate pairs");
+
+         job.first_block = first_block;
+         RunTasks(pool, (u32)batch_count, GenerateBlock, &job);
+      }
+
+      // blocks are summed in order after the fact, so the total doesn't depend
+      // on which thread finished first
+      u64 chunk_count = 0;
+      u64 batch_size = 0;
+      u64 batch_pairs = 0;
+
+      if (first_block == 0)
+         chunks[chunk_count++] = {header, sizeof(header) - 1};
+
+      for (u64 i = 0; i < batch_count; i++)
+      {
+         total += blocks[i].total;
+         batch_pairs += blocks[i].pair_count;
+         chunks[chunk_count++] = {blocks[i].text, blocks[i].text_size};
+      }
+
+      if (first_block + batch_count == block_count)
+         chunks[chunk_count++] = {footer, sizeof(footer) - 1};
+
+      for (u64 i = 0; i < chunk_count; i++)
+         batch_size += chunks[i].size;
+
+      json_size += batch_size;
+
+      {
+         TimeBandwidth("Write JSON", batch_size);
+         written = WriteOutputChunks(&json_file, chunks, chunk_count);
+      }
+
+      {
+         // write out haversine_distances to file
+         TimeBandwidth("Write answers", batch_pairs * sizeof(f64));
+
+         for (u64 i = 0; i < batch_count; i++)
+            binary_chunks[i] = {blocks[i].distances, blocks[i].pair_count * sizeof(f64)};
+
+         written = WriteOutputChunks(&answers_file, binary_chunks, batch_count) && written;
+      }
+
+      if (write_pairs)
+      {
+         TimeBandwidth("Write pairs", batch_pairs * 4 * sizeof(f64));
+
+         for (u64 i = 0; i < batch_count; i++)
+            binary_chunks[i] = {blocks[i].pairs, blocks[i].pair_count * 4 * sizeof(f64)};
+
+         written = WriteOutputChunks(&pairs_file, binary_chunks, batch_count) && written;
+      }
    }
 
    total = total / number_of_pairs;
 
-   fprintf(fd, "   ]\n");
-   fprintf(fd, "}\n");
+   written = WriteOutput(&answers_file, &total, sizeof(f64)) && written;
 
-   printf("Type: %s\n", argv[1]);
-   printf("Seed: %d\n", seed);
-   printf("Number of pairs: %d\n", number_of_pairs);
-   printf("Distance: %.5f\n", total);
+   {
+      // for mapped files this is where the dirty pages are handed back
+      TimeBlock("Close output files");
 
-   fclose(fd);
+      written = CloseOutputFile(&answers_file) && written;
+      written = CloseOutputFile(&json_file) && written;
+      if (write_pairs)
+         written = CloseOutputFile(&pairs_file) && written;
+   }
 
-   // write out haversine_distances to file
-   fd = fopen("haversine_distances.bin", "wb");
-   for (int i = 0; i < number_of_pairs; i++)
-      fwrite(&haversine_distances[i], sizeof(f64), 1, fd);
+   if (!written)
+   {
+      fprintf(stderr, "Error writing output files\n");
+      exit(1);
+   }
 
-   fwrite(&total, sizeof(f64), 1, fd);
+   u64 emit_elapsed = ReadOSTimer() - emit_start;
+   f64 emit_seconds = (f64)emit_elapsed / (f64)GetOSTimerFreq();
 
-   fclose(fd);
+   printf("Type: %s%s\n", argv[1], sorted ? " (sorted by y0)" : "");
+   printf("Seed: %llu\n", seed);
+   printf("Number of pairs: %llu\n", number_of_pairs);
+   printf("Distance: %.5f\n", total);
+   printf("JSON: %.3fmb in %.3fms (%.3fgb/s generated and written)\n",
+          (f64)json_size / (1024.0 * 1024.0), 1000.0 * emit_seconds,
+          emit_seconds > 0.0 ? (f64)json_size / (1024.0 * 1024.0 * 1024.0) / emit_seconds : 0.0);
 
-   delete [] haversine_distances;
-   delete [] haversine_pairs;
+   for (u64 i = 0; i < batch_block_count; i++)
+   {
+      delete [] blocks[i].text;
+      delete [] blocks[i].distances;
+      delete [] blocks[i].pairs;
+   }
+
+   delete [] chunks;
+   delete [] binary_chunks;
+   delete [] blocks;
+   delete [] cluster_info;
+   delete [] job.sorted_pairs;
+
+   FreeThreadPool(pool);
+
+   EndAndPrintProfile();
 }
+
+ProfilerEndOfCompilationUnit;
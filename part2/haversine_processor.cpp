@@ -1,9 +1,33 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <memory.h>
+#include <sys/stat.h>
 #include <vector>
 
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#define PROFILER 1
+#include "../part3/listing_0100_bandwidth_profiler.cpp"
 #include "listing_0065_haversine_formula.cpp"
 
 struct Pair
@@ -20,9 +44,38 @@ union PairUnion
    f64  array[4];
 };
 
+struct MappedFile
+{
+   const u8* data;
+   u64       size;
+#if _WIN32
+   HANDLE    file;
+   HANDLE    mapping;
+#endif
+};
+
+// smallest possible pair encoding, used to size the pair vector up front
+const u64 MIN_JSON_PAIR_ENCODING = 6*4;
+
+static u64 GetFileSize(const char* Filename)
+{
+#if _WIN32
+   struct __stat64 Stat;
+   if (_stat64(Filename, &Stat) != 0)
+      return 0;
+#else
+   struct stat Stat;
+   if (stat(Filename, &Stat) != 0)
+      return 0;
+#endif
+
+   return Stat.st_size;
+}
 
 bool parse_json(const char* Filename, std::vector<PairUnion>& pairs)
 {
+   TimeBandwidth(__func__, GetFileSize(Filename));
+
    FILE*     fd = fopen(Filename, "r");
    PairUnion pair;
    int       pair_idx = 0;
@@ -84,25 +137,178 @@ bool parse_json(const char* Filename, std::vector<PairUnion>& pairs)
    return true;
 }
 
-int main(int argc, char* argv[])
+bool MapFile(const char* Filename, bool Populate, bool Sequential, MappedFile* File)
 {
-   std::vector<PairUnion> pairs;
-   f64*                   haversine_distances = nullptr;
-   f64                    total = 0.0;
+   TimeFunction;
+
+   *File = {};
+
+#if _WIN32
+   // NOTE: there is no MAP_POPULATE/madvise equivalent used here, the options
+   // only apply on linux.
+   (void)Populate;
+   (void)Sequential;
+
+   File->file = CreateFileA(Filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, 0);
+   if (File->file == INVALID_HANDLE_VALUE)
+      return false;
+
+   LARGE_INTEGER size;
+   GetFileSizeEx(File->file, &size);
+   File->size = size.QuadPart;
+
+   File->mapping = CreateFileMappingA(File->file, 0, PAGE_READONLY, 0, 0, 0);
+   if (File->mapping)
+      File->data = (const u8*)MapViewOfFile(File->mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+   int fd = open(Filename, O_RDONLY);
+   if (fd < 0)
+      return false;
 
-   if (argc != 2)
+   struct stat Stat;
+   if (fstat(fd, &Stat) == 0)
+      File->size = Stat.st_size;
+
+   if (File->size)
    {
-      printf("haversine_processor [json input]\n");
-      exit(1);
+      int   flags = MAP_PRIVATE;
+      void* data = nullptr;
+
+      if (Populate)
+         flags |= MAP_POPULATE;
+
+      // MAP_POPULATE pre-faults the whole file here, so time it as bandwidth
+      TimeBandwidth("mmap", File->size);
+
+      data = mmap(0, File->size, PROT_READ, flags, fd, 0);
+      if (data != MAP_FAILED)
+      {
+         File->data = (const u8*)data;
+
+         if (Sequential)
+            madvise(data, File->size, MADV_SEQUENTIAL);
+      }
    }
 
-   if (!parse_json(argv[1], pairs))
+   // the mapping keeps the file alive on its own, so the fd is done with
+   // whether or not mmap worked
+   close(fd);
+#endif
+
+   return File->data != nullptr;
+}
+
+void UnmapFile(MappedFile* File)
+{
+#if _WIN32
+   if (File->data)
+      UnmapViewOfFile(File->data);
+   if (File->mapping)
+      CloseHandle(File->mapping);
+   if (File->file != INVALID_HANDLE_VALUE)
+      CloseHandle(File->file);
+#else
+   if (File->data)
+      munmap((void*)File->data, File->size);
+#endif
+
+   *File = {};
+}
+
+static bool IsNumberChar(u8 Char)
+{
+   return (Char >= '0' && Char <= '9') || Char == '-' || Char == '+' ||
+          Char == '.'  || Char == 'e'  || Char == 'E';
+}
+
+// Converts the number starting at data[index] in place. strtod needs a
+// terminator after the number, so only the very last bytes of a mapping (where
+// the number could run into the end of the file) ever get copied.
+static f64 ParseMappedNumber(const u8* data, u64 size, u64* index)
+{
+   u64 start = *index;
+   u64 end = start;
+   f64 value = 0.0;
+
+   while (end < size && IsNumberChar(data[end]))
+      end++;
+
+   if (end < size)
    {
-      printf("Failed to parse %s\n", argv[1]);
-      exit(1);
+      value = strtod((const char*)&data[start], nullptr);
    }
+   else
+   {
+      char value_str[64] = {};
+      u64  count = end - start;
 
-   printf("Read %ld pairs\n", pairs.size());
+      if (count >= sizeof(value_str))
+         count = sizeof(value_str) - 1;
+
+      memcpy(value_str, &data[start], count);
+      value = strtod(value_str, nullptr);
+   }
+
+   *index = end;
+
+   return value;
+}
+
+bool parse_json_mapped(const u8* data, u64 size, std::vector<PairUnion>& pairs)
+{
+   TimeBandwidth(__func__, size);
+
+   PairUnion pair;
+   int       pair_idx = 0;
+   u64       index = 0;
+   bool      in_pairs = false;
+
+   while (index < size)
+   {
+      u8 c = data[index];
+
+      if (c == '[')
+      {
+         in_pairs = true;
+         index++;
+      }
+      else if (c == ']')
+      {
+         return in_pairs;
+      }
+      else if (c == ':' && in_pairs)
+      {
+         index++;
+
+         while (index < size && (data[index] == ' ' || data[index] == '\t' ||
+                                 data[index] == '\r' || data[index] == '\n'))
+            index++;
+
+         if (index < size && IsNumberChar(data[index]))
+         {
+            pair.array[(pair_idx%4)] = ParseMappedNumber(data, size, &index);
+            pair_idx++;
+
+            if (pair_idx % 4 == 0)
+               pairs.push_back(pair);
+         }
+      }
+      else
+      {
+         index++;
+      }
+   }
+
+   return false;
+}
+
+f64 SumHaversine(std::vector<PairUnion>& pairs)
+{
+   TimeBandwidth(__func__, pairs.size() * sizeof(PairUnion));
+
+   f64* haversine_distances = nullptr;
+   f64  total = 0.0;
 
    haversine_distances = new f64[pairs.size()];
 
@@ -115,8 +321,88 @@ int main(int argc, char* argv[])
       total += haversine_distances[i];
    }
 
-   total = total / pairs.size();
+   delete [] haversine_distances;
+
+   return total / pairs.size();
+}
+
+void PrintUsage()
+{
+   printf("haversine_processor [options] [json input]\n");
+   printf("   -mmap        map the input and parse directly out of the mapping\n");
+   printf("   -populate    pre-fault the mapping (MAP_POPULATE), implies -mmap\n");
+   printf("   -sequential  madvise(MADV_SEQUENTIAL) on the mapping, implies -mmap\n");
+}
+
+int main(int argc, char* argv[])
+{
+   BeginProfile();
+
+   std::vector<PairUnion> pairs;
+   f64                    total = 0.0;
+   const char*            filename = nullptr;
+   bool                   use_mmap = false;
+   bool                   populate = false;
+   bool                   sequential = false;
+
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-mmap") == 0)
+         use_mmap = true;
+      else if (strcmp(argv[i], "-populate") == 0)
+         use_mmap = populate = true;
+      else if (strcmp(argv[i], "-sequential") == 0)
+         use_mmap = sequential = true;
+      else if (!filename && argv[i][0] != '-')
+         filename = argv[i];
+      else
+      {
+         PrintUsage();
+         exit(1);
+      }
+   }
+
+   if (!filename)
+   {
+      PrintUsage();
+      exit(1);
+   }
+
+   if (use_mmap)
+   {
+      MappedFile file;
+
+      if (!MapFile(filename, populate, sequential, &file))
+      {
+         printf("Failed to map %s\n", filename);
+         exit(1);
+      }
+
+      pairs.reserve(file.size / MIN_JSON_PAIR_ENCODING);
+
+      bool parsed = parse_json_mapped(file.data, file.size, pairs);
+
+      UnmapFile(&file);
+
+      if (!parsed)
+      {
+         printf("Failed to parse %s\n", filename);
+         exit(1);
+      }
+   }
+   else if (!parse_json(filename, pairs))
+   {
+      printf("Failed to parse %s\n", filename);
+      exit(1);
+   }
+
+   printf("Read %ld pairs\n", pairs.size());
+
+   total = SumHaversine(pairs);
 
    printf("Distance: %.5f\n", total);
 
+   EndAndPrintProfile();
 }
+
+ProfilerEndOfCompilationUnit;
@@ -0,0 +1,87 @@
+/* ========================================================================
+   Runtime CPU feature detection, so SIMD paths can be picked per machine
+   instead of per build.
+
+   Functions that use a wider instruction set than the build targets are
+   marked with TARGET_AVX2/TARGET_AVX512 so GCC/clang will emit them without
+   -mavx2 on the command line. MSVC allows the intrinsics everywhere, so
+   the macros are empty there.
+   ======================================================================== */
+
+// NOTE: Several modules depend on this one, so it is the one file here with an include guard
+#ifndef CPU_FEATURES_CPP
+#define CPU_FEATURES_CPP
+
+#if _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx2,fma")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+struct cpu_features
+{
+    b32 Initialized;
+    b32 SSE2;
+    b32 AVX2;
+    b32 FMA;
+    b32 AVX512;
+};
+static cpu_features GlobalCPUFeatures;
+
+inline cpu_features GetCPUFeatures(void)
+{
+    if(!GlobalCPUFeatures.Initialized)
+    {
+        cpu_features Features = {};
+        Features.Initialized = true;
+
+#if !defined(__GNUC__) && !defined(__clang__)
+        int Regs[4];
+        __cpuid(Regs, 1);
+        Features.SSE2 = (Regs[3] >> 26) & 1;
+        Features.FMA = (Regs[2] >> 12) & 1;
+        b32 OSXSave = (Regs[2] >> 27) & 1;
+
+        u64 XCR0 = OSXSave ? _xgetbv(0) : 0;
+        b32 OSSavesYMM = ((XCR0 & 0x6) == 0x6);
+        b32 OSSavesZMM = ((XCR0 & 0xe6) == 0xe6);
+
+        __cpuidex(Regs, 7, 0);
+        Features.AVX2 = OSSavesYMM && ((Regs[1] >> 5) & 1);
+        Features.AVX512 = OSSavesZMM && ((Regs[1] >> 16) & 1) && ((Regs[1] >> 17) & 1); // NOTE: F + DQ
+        Features.FMA = Features.FMA && OSSavesYMM;
+#else
+        // NOTE: __builtin_cpu_supports already checks that the OS saves the wider registers
+        __builtin_cpu_init();
+        Features.SSE2 = __builtin_cpu_supports("sse2");
+        Features.AVX2 = __builtin_cpu_supports("avx2");
+        Features.FMA = __builtin_cpu_supports("fma");
+        Features.AVX512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#endif
+
+        GlobalCPUFeatures = Features;
+    }
+
+    return GlobalCPUFeatures;
+}
+
+inline u32 CountTrailingZeros64(u64 Value)
+{
+#if !defined(__GNUC__) && !defined(__clang__)
+    unsigned long Index;
+    _BitScanForward64(&Index, Value);
+    return Index;
+#else
+    return __builtin_ctzll(Value);
+#endif
+}
+
+#endif
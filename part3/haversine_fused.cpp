@@ -0,0 +1,93 @@
+/* ========================================================================
+   Fused parse-and-sum
+
+   Pulls pairs off the streaming extractor into a small batch that stays
+   in L1, sums the batch's distances, and reuses the batch for the next
+   pairs. Nothing the size of the input is ever allocated, so the big
+   pair buffer and the page faults that come with touching it go away.
+
+   NOTE: The pair count isn't known until the end, so this adds up plain
+   distances and divides once, instead of adding SumCoef*Dist per pair
+   like SumHaversineDistances. Expect the last few bits to differ.
+   ======================================================================== */
+
+#define FusedBatchPairCount 256
+
+struct fused_haversine_result
+{
+    u64 PairCount;
+    f64 Sum;
+};
+
+// NOTE: ISA HaversineISA_None uses ReferenceHaversine, anything else runs the SoA kernel on each batch
+static fused_haversine_result ParseAndSumHaversinePairs(buffer InputJSON, haversine_kernel_isa ISA,
+                                                        json_structural_indexer *Indexer = 0)
+{
+    TimeBandwidth(__func__, InputJSON.Count);
+
+    alignas(HAVERSINE_SOA_ALIGNMENT) f64 X0[FusedBatchPairCount];
+    alignas(HAVERSINE_SOA_ALIGNMENT) f64 Y0[FusedBatchPairCount];
+    alignas(HAVERSINE_SOA_ALIGNMENT) f64 X1[FusedBatchPairCount];
+    alignas(HAVERSINE_SOA_ALIGNMENT) f64 Y1[FusedBatchPairCount];
+    f64 Distances[FusedBatchPairCount];
+
+    haversine_pair_soa Batch = {};
+    Batch.X0 = X0;
+    Batch.Y0 = Y0;
+    Batch.X1 = X1;
+    Batch.Y1 = Y1;
+
+    f64 EarthRadius = 6372.8;
+    f64 DistanceSum = 0;
+    u64 PairCount = 0;
+
+    haversine_pair_stream Stream = BeginHaversinePairStream(InputJSON, Indexer);
+
+    b32 MorePairs = true;
+    while(MorePairs)
+    {
+        u32 BatchCount = 0;
+        haversine_pair Pair;
+        while((BatchCount < FusedBatchPairCount) && NextHaversinePair(&Stream, &Pair))
+        {
+            X0[BatchCount] = Pair.X0;
+            Y0[BatchCount] = Pair.Y0;
+            X1[BatchCount] = Pair.X1;
+            Y1[BatchCount] = Pair.Y1;
+            ++BatchCount;
+        }
+        MorePairs = (BatchCount == FusedBatchPairCount);
+
+        if(ISA == HaversineISA_None)
+        {
+            for(u32 PairIndex = 0; PairIndex < BatchCount; ++PairIndex)
+            {
+                DistanceSum += ReferenceHaversine(X0[PairIndex], Y0[PairIndex], X1[PairIndex], Y1[PairIndex], EarthRadius);
+            }
+        }
+        else if(BatchCount)
+        {
+            // NOTE: The kernels run to PaddedCount, so the unused lanes of a short batch must be zero
+            Batch.Count = BatchCount;
+            Batch.PaddedCount = (BatchCount + HAVERSINE_SOA_LANES - 1) & ~(u64)(HAVERSINE_SOA_LANES - 1);
+            for(u64 PadIndex = BatchCount; PadIndex < Batch.PaddedCount; ++PadIndex)
+            {
+                X0[PadIndex] = Y0[PadIndex] = X1[PadIndex] = Y1[PadIndex] = 0;
+            }
+
+            SumHaversineKernel(&Batch, ISA, Distances);
+            for(u32 PairIndex = 0; PairIndex < BatchCount; ++PairIndex)
+            {
+                DistanceSum += Distances[PairIndex];
+            }
+        }
+
+        PairCount += BatchCount;
+    }
+
+    fused_haversine_result Result = {};
+    Result.PairCount = PairCount;
+    Result.Sum = PairCount ? (DistanceSum / (f64)PairCount) : 0;
+
+    return Result;
+}
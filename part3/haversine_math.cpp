@@ -0,0 +1,460 @@
+/* ========================================================================
+   In-tree sin/cos/asin/sqrt for the haversine kernels
+
+   There is no vector libm to call into, so these are Cephes-style
+   range-reduced minimax polynomials, good to about 1ulp over the whole
+   range haversine feeds them. The coefficients are shared by every
+   implementation below so the scalar and SIMD versions agree.
+
+   The scalar section at the bottom trades accuracy for speed in tiers.
+   Those only cover the inputs haversine actually produces, which lets
+   them skip the general quadrant reduction entirely.
+   ======================================================================== */
+
+#include "cpu_features.cpp"
+
+#include <immintrin.h>
+
+// NOTE: sin(x) = x + x*z*P(z) and cos(x) = 1 - z/2 + z*z*Q(z), z = x*x, on [-pi/4, pi/4]
+static f64 const SinCoefficients[] =
+{
+     1.58962301576546568060E-10,
+    -2.50507477628578072866E-8,
+     2.75573136213857245213E-6,
+    -1.98412698295895385996E-4,
+     8.33333333332211858878E-3,
+    -1.66666666666666307295E-1,
+};
+
+static f64 const CosCoefficients[] =
+{
+    -1.13585365213876817300E-11,
+     2.08757008419747316778E-9,
+    -2.75573141792967388112E-7,
+     2.48015872888517045348E-5,
+    -1.38888888888730564116E-3,
+     4.16666666666665929218E-2,
+};
+
+// NOTE: pi/2 split into three parts so the reduction x - q*pi/2 stays exact for the q's we see
+#define PiOver2Part1 1.57079625129699707031E0
+#define PiOver2Part2 7.54978941586159635335E-8
+#define PiOver2Part3 5.39030285815811905290E-15
+#define TwoOverPi 6.36619772367581343076E-1
+
+// NOTE: asin(x) = x + x*z*P(z)/Q(z), z = x*x, for |x| <= 0.625
+static f64 const ASinSmallP[] =
+{
+     4.253011369004428248960E-3,
+    -6.019598008014123785661E-1,
+     5.444622390564711410273E0,
+    -1.626247967210700244449E1,
+     1.956261983317594739197E1,
+    -8.198089802484824371615E0,
+};
+
+static f64 const ASinSmallQ[] = // NOTE: Leading 1 is implied
+{
+    -1.474091372988853791896E1,
+     7.049610280856842141659E1,
+    -1.471791292232726029859E2,
+     1.395105614657485689735E2,
+    -4.918853881490881290097E1,
+};
+
+// NOTE: asin(x) = pi/2 - 2*asin(sqrt((1 - x)/2)), expanded in z = 1 - x, for |x| > 0.625
+static f64 const ASinLargeR[] =
+{
+     2.967721961301243206100E-3,
+    -5.634242780008963776856E-1,
+     6.968710824104713396794E0,
+    -2.556901049652824852289E1,
+     2.853665548261061424989E1,
+};
+
+static f64 const ASinLargeS[] = // NOTE: Leading 1 is implied
+{
+    -2.194779531642920639778E1,
+     1.470656354026814941758E2,
+    -3.838770957603691357202E2,
+     3.424398657913078477438E2,
+};
+
+#define PiOver4 7.85398163397448309616E-1
+#define PiOver4LowBits 6.123233995736765886130E-17
+#define ASinSplit 0.625
+
+/* ========================================================================
+   AVX2 (4 lanes)
+   ======================================================================== */
+
+TARGET_AVX2 inline __m256d PolynomialAVX2(__m256d X, f64 const *C, u32 Count)
+{
+    __m256d Result = _mm256_set1_pd(C[0]);
+    for(u32 Index = 1; Index < Count; ++Index)
+    {
+        Result = _mm256_fmadd_pd(Result, X, _mm256_set1_pd(C[Index]));
+    }
+    return Result;
+}
+
+TARGET_AVX2 inline __m256d Polynomial1AVX2(__m256d X, f64 const *C, u32 Count)
+{
+    __m256d Result = _mm256_add_pd(X, _mm256_set1_pd(C[0]));
+    for(u32 Index = 1; Index < Count; ++Index)
+    {
+        Result = _mm256_fmadd_pd(Result, X, _mm256_set1_pd(C[Index]));
+    }
+    return Result;
+}
+
+// NOTE: QuadrantOffset 0 gives sin, 1 gives cos
+TARGET_AVX2 inline __m256d SinCosAVX2(__m256d X, u32 QuadrantOffset)
+{
+    __m256d Q = _mm256_round_pd(_mm256_mul_pd(X, _mm256_set1_pd(TwoOverPi)), _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+
+    __m256d R = _mm256_fnmadd_pd(Q, _mm256_set1_pd(PiOver2Part1), X);
+    R = _mm256_fnmadd_pd(Q, _mm256_set1_pd(PiOver2Part2), R);
+    R = _mm256_fnmadd_pd(Q, _mm256_set1_pd(PiOver2Part3), R);
+
+    __m256d Z = _mm256_mul_pd(R, R);
+    __m256d Sin = _mm256_fmadd_pd(_mm256_mul_pd(R, Z), PolynomialAVX2(Z, SinCoefficients, ArrayCount(SinCoefficients)), R);
+    __m256d Cos = _mm256_fmadd_pd(_mm256_mul_pd(Z, Z), PolynomialAVX2(Z, CosCoefficients, ArrayCount(CosCoefficients)),
+                                  _mm256_fnmadd_pd(_mm256_set1_pd(0.5), Z, _mm256_set1_pd(1.0)));
+
+    __m256i Quadrant = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(Q)), _mm256_set1_epi64x(QuadrantOffset));
+    __m256d UseCos = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(Quadrant, _mm256_set1_epi64x(1)), _mm256_set1_epi64x(1)));
+    __m256d Negate = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(Quadrant, _mm256_set1_epi64x(2)), 62));
+
+    __m256d Result = _mm256_xor_pd(_mm256_blendv_pd(Sin, Cos, UseCos), Negate);
+    return Result;
+}
+
+TARGET_AVX2 inline __m256d SinAVX2(__m256d X)
+{
+    return SinCosAVX2(X, 0);
+}
+
+TARGET_AVX2 inline __m256d CosAVX2(__m256d X)
+{
+    return SinCosAVX2(X, 1);
+}
+
+TARGET_AVX2 inline __m256d ASinAVX2(__m256d X)
+{
+    __m256d SignBit = _mm256_set1_pd(-0.0);
+    __m256d Sign = _mm256_and_pd(X, SignBit);
+    __m256d A = _mm256_andnot_pd(SignBit, X);
+
+    __m256d ZSmall = _mm256_mul_pd(A, A);
+    __m256d Small = _mm256_div_pd(_mm256_mul_pd(ZSmall, PolynomialAVX2(ZSmall, ASinSmallP, ArrayCount(ASinSmallP))),
+                                  Polynomial1AVX2(ZSmall, ASinSmallQ, ArrayCount(ASinSmallQ)));
+    Small = _mm256_fmadd_pd(A, Small, A);
+
+    __m256d ZLarge = _mm256_sub_pd(_mm256_set1_pd(1.0), A);
+    __m256d P = _mm256_div_pd(_mm256_mul_pd(ZLarge, PolynomialAVX2(ZLarge, ASinLargeR, ArrayCount(ASinLargeR))),
+                              Polynomial1AVX2(ZLarge, ASinLargeS, ArrayCount(ASinLargeS)));
+    __m256d Root = _mm256_sqrt_pd(_mm256_add_pd(ZLarge, ZLarge));
+    __m256d Large = _mm256_sub_pd(_mm256_set1_pd(PiOver4), Root);
+    Large = _mm256_sub_pd(Large, _mm256_fmsub_pd(Root, P, _mm256_set1_pd(PiOver4LowBits)));
+    Large = _mm256_add_pd(Large, _mm256_set1_pd(PiOver4));
+
+    __m256d UseLarge = _mm256_cmp_pd(A, _mm256_set1_pd(ASinSplit), _CMP_GT_OQ);
+    __m256d Result = _mm256_or_pd(_mm256_blendv_pd(Small, Large, UseLarge), Sign);
+    return Result;
+}
+
+/* ========================================================================
+   AVX-512 (8 lanes)
+   ======================================================================== */
+
+#if defined(__GNUC__) && !defined(__clang__)
+// NOTE: GCC 12 warns about the deliberately undefined registers inside its own
+// AVX-512 intrinsic headers once they are inlined, so just for this section
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+TARGET_AVX512 inline __m512d PolynomialAVX512(__m512d X, f64 const *C, u32 Count)
+{
+    __m512d Result = _mm512_set1_pd(C[0]);
+    for(u32 Index = 1; Index < Count; ++Index)
+    {
+        Result = _mm512_fmadd_pd(Result, X, _mm512_set1_pd(C[Index]));
+    }
+    return Result;
+}
+
+TARGET_AVX512 inline __m512d Polynomial1AVX512(__m512d X, f64 const *C, u32 Count)
+{
+    __m512d Result = _mm512_add_pd(X, _mm512_set1_pd(C[0]));
+    for(u32 Index = 1; Index < Count; ++Index)
+    {
+        Result = _mm512_fmadd_pd(Result, X, _mm512_set1_pd(C[Index]));
+    }
+    return Result;
+}
+
+TARGET_AVX512 inline __m512d SinCosAVX512(__m512d X, u32 QuadrantOffset)
+{
+    __m512d Q = _mm512_roundscale_pd(_mm512_mul_pd(X, _mm512_set1_pd(TwoOverPi)), _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+
+    __m512d R = _mm512_fnmadd_pd(Q, _mm512_set1_pd(PiOver2Part1), X);
+    R = _mm512_fnmadd_pd(Q, _mm512_set1_pd(PiOver2Part2), R);
+    R = _mm512_fnmadd_pd(Q, _mm512_set1_pd(PiOver2Part3), R);
+
+    __m512d Z = _mm512_mul_pd(R, R);
+    __m512d Sin = _mm512_fmadd_pd(_mm512_mul_pd(R, Z), PolynomialAVX512(Z, SinCoefficients, ArrayCount(SinCoefficients)), R);
+    __m512d Cos = _mm512_fmadd_pd(_mm512_mul_pd(Z, Z), PolynomialAVX512(Z, CosCoefficients, ArrayCount(CosCoefficients)),
+                                  _mm512_fnmadd_pd(_mm512_set1_pd(0.5), Z, _mm512_set1_pd(1.0)));
+
+    __m512i Quadrant = _mm512_add_epi64(_mm512_cvtepi32_epi64(_mm512_cvtpd_epi32(Q)), _mm512_set1_epi64(QuadrantOffset));
+    __mmask8 UseCos = _mm512_test_epi64_mask(Quadrant, _mm512_set1_epi64(1));
+    __m512i Negate = _mm512_slli_epi64(_mm512_and_si512(Quadrant, _mm512_set1_epi64(2)), 62);
+
+    __m512d Result = _mm512_mask_blend_pd(UseCos, Sin, Cos);
+    Result = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(Result), Negate));
+    return Result;
+}
+
+TARGET_AVX512 inline __m512d SinAVX512(__m512d X)
+{
+    return SinCosAVX512(X, 0);
+}
+
+TARGET_AVX512 inline __m512d CosAVX512(__m512d X)
+{
+    return SinCosAVX512(X, 1);
+}
+
+TARGET_AVX512 inline __m512d ASinAVX512(__m512d X)
+{
+    __m512i SignBit = _mm512_set1_epi64(0x8000000000000000ull);
+    __m512i Sign = _mm512_and_si512(_mm512_castpd_si512(X), SignBit);
+    __m512d A = _mm512_castsi512_pd(_mm512_andnot_si512(SignBit, _mm512_castpd_si512(X)));
+
+    __m512d ZSmall = _mm512_mul_pd(A, A);
+    __m512d Small = _mm512_div_pd(_mm512_mul_pd(ZSmall, PolynomialAVX512(ZSmall, ASinSmallP, ArrayCount(ASinSmallP))),
+                                  Polynomial1AVX512(ZSmall, ASinSmallQ, ArrayCount(ASinSmallQ)));
+    Small = _mm512_fmadd_pd(A, Small, A);
+
+    __m512d ZLarge = _mm512_sub_pd(_mm512_set1_pd(1.0), A);
+    __m512d P = _mm512_div_pd(_mm512_mul_pd(ZLarge, PolynomialAVX512(ZLarge, ASinLargeR, ArrayCount(ASinLargeR))),
+                              Polynomial1AVX512(ZLarge, ASinLargeS, ArrayCount(ASinLargeS)));
+    __m512d Root = _mm512_sqrt_pd(_mm512_add_pd(ZLarge, ZLarge));
+    __m512d Large = _mm512_sub_pd(_mm512_set1_pd(PiOver4), Root);
+    Large = _mm512_sub_pd(Large, _mm512_fmsub_pd(Root, P, _mm512_set1_pd(PiOver4LowBits)));
+    Large = _mm512_add_pd(Large, _mm512_set1_pd(PiOver4));
+
+    __mmask8 UseLarge = _mm512_cmp_pd_mask(A, _mm512_set1_pd(ASinSplit), _CMP_GT_OQ);
+    __m512d Result = _mm512_mask_blend_pd(UseLarge, Small, Large);
+    Result = _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(Result), Sign));
+    return Result;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+/* ========================================================================
+   Scalar accuracy tiers
+
+   Domains are the ones ReferenceHaversine feeds its libm calls:
+     sin:  [-pi, pi]      (half of a longitude/latitude difference)
+     cos:  [-pi/2, pi/2]  (a latitude)
+     asin: [0, 1]
+     sqrt: [0, 1]
+   Nothing outside those ranges is handled.
+   ======================================================================== */
+
+enum math_tier
+{
+    MathTier_Full, // NOTE: Within a few ulp
+    MathTier_1e7, // NOTE: Absolute error below ~1e-7 per function, but ~2km in HaversineTier (see there)
+
+    MathTier_Count,
+};
+
+// NOTE: sin(x) = x + x*z*P(z), z = x*x, fitted on [-pi/2, pi/2] (Chebyshev-economized)
+static f64 const SinFullCoefficients[] =
+{
+     2.64399658272854621E-15,
+    -7.63586246573414346E-13,
+     1.60586837152521185E-10,
+    -2.50521023360981184E-08,
+     2.75573191690777737E-06,
+    -1.98412698410040789E-04,
+     8.33333333333267402E-03,
+    -1.66666666666666602E-01,
+};
+
+static f64 const Sin1e7Coefficients[] =
+{
+     2.63481537988747723E-06,
+    -1.98227613314419255E-04,
+     8.33324233736862027E-03,
+    -1.66666659665984346E-01,
+};
+
+// NOTE: asin(x) = x + x*z*P(z), z = x*x, fitted on [0, 0.5]. Above that we use
+// asin(x) = pi/2 - 2*asin(sqrt((1 - x)/2)), which lands back in [0, 0.5].
+static f64 const ASin1e7Coefficients[] =
+{
+     3.82064520638431895E-02,
+     2.64942767872852029E-02,
+     4.50107000556386611E-02,
+     7.49880917577014916E-02,
+     1.66666727646983703E-01,
+};
+
+// NOTE: pi and pi/2 as a double plus the bits the double lost, so folding near the ends stays accurate
+#define PiHigh 3.14159265358979311600E0
+#define PiLowBits 1.22464679914735317723E-16
+#define PiOver2High 1.57079632679489655800E0
+#define PiOver2LowBits 6.12323399573676588613E-17
+
+inline f64 Polynomial(f64 X, f64 const *C, u32 Count)
+{
+    f64 Result = C[0];
+    for(u32 Index = 1; Index < Count; ++Index)
+    {
+        Result = Result*X + C[Index];
+    }
+    return Result;
+}
+
+inline f64 Polynomial1(f64 X, f64 const *C, u32 Count)
+{
+    f64 Result = X + C[0];
+    for(u32 Index = 1; Index < Count; ++Index)
+    {
+        Result = Result*X + C[Index];
+    }
+    return Result;
+}
+
+inline f64 OddPolynomial(f64 X, f64 const *C, u32 Count)
+{
+    f64 Z = X*X;
+    f64 Result = X + X*Z*Polynomial(Z, C, Count);
+    return Result;
+}
+
+inline f64 SqrtFull(f64 X)
+{
+    // NOTE: Straight to sqrtsd, so the compiler doesn't add the errno check libm's sqrt needs
+    f64 Result = _mm_cvtsd_f64(_mm_sqrt_sd(_mm_setzero_pd(), _mm_set_sd(X)));
+    return Result;
+}
+
+inline f64 SinPolynomialTier(f64 X, math_tier Tier)
+{
+    f64 Result;
+    switch(Tier)
+    {
+        case MathTier_1e7: {Result = OddPolynomial(X, Sin1e7Coefficients, ArrayCount(Sin1e7Coefficients));} break;
+        default: {Result = OddPolynomial(X, SinFullCoefficients, ArrayCount(SinFullCoefficients));} break;
+    }
+
+    return Result;
+}
+
+inline f64 SinTier(f64 X, math_tier Tier)
+{
+    // NOTE: sin(x) = sin(pi - x) folds [pi/2, pi] onto [0, pi/2]. pi - |x| is only
+    // smaller than |x| on that half, so a min picks the fold without a branch.
+    f64 A = fabs(X);
+    f64 Folded = (PiHigh - A) + PiLowBits;
+    A = (Folded < A) ? Folded : A;
+
+    f64 Result = copysign(SinPolynomialTier(A, Tier), X);
+    return Result;
+}
+
+inline f64 CosTier(f64 X, math_tier Tier)
+{
+    // NOTE: cos(x) = sin(pi/2 - |x|)
+    f64 A = (PiOver2High - fabs(X)) + PiOver2LowBits;
+    f64 Result = SinPolynomialTier(A, Tier);
+    return Result;
+}
+
+inline f64 ASinFull(f64 X)
+{
+    f64 A = fabs(X);
+
+    f64 Result;
+    if(A > ASinSplit)
+    {
+        f64 Z = 1.0 - A;
+        f64 P = Z*Polynomial(Z, ASinLargeR, ArrayCount(ASinLargeR)) / Polynomial1(Z, ASinLargeS, ArrayCount(ASinLargeS));
+        f64 Root = SqrtFull(Z + Z);
+        Result = PiOver4 - Root;
+        Result -= Root*P - PiOver4LowBits;
+        Result += PiOver4;
+    }
+    else
+    {
+        f64 Z = A*A;
+        Result = A + A*(Z*Polynomial(Z, ASinSmallP, ArrayCount(ASinSmallP)) / Polynomial1(Z, ASinSmallQ, ArrayCount(ASinSmallQ)));
+    }
+
+    Result = copysign(Result, X);
+    return Result;
+}
+
+inline f64 ASinTier(f64 X, math_tier Tier)
+{
+    f64 Result;
+    if(Tier == MathTier_Full)
+    {
+        Result = ASinFull(X);
+    }
+    else
+    {
+        // NOTE: Both halves share one polynomial, so pick the argument and the
+        // fixup with selects rather than branching on the half (inputs are random).
+        b32 Upper = (X > 0.5);
+        f64 Root = SqrtFull(0.5*(1.0 - X));
+        f64 P = OddPolynomial(Upper ? Root : X, ASin1e7Coefficients, ArrayCount(ASin1e7Coefficients));
+        f64 Reflected = (PiOver2High - 2.0*P) + PiOver2LowBits;
+        Result = Upper ? Reflected : P;
+    }
+
+    return Result;
+}
+
+// NOTE: Same formula as ReferenceHaversine, with the libm calls swapped for a tier.
+// Tier is expected to be a constant at the call site so the switches fold away.
+//
+// The per-function error doesn't carry over to the distance. For near-antipodal pairs
+// asin(sqrt(a)) turns an error e in a into up to 2*sqrt(e) radians, so the 1e-7 tier's
+// sin/cos error alone allows R*2*sqrt(1e-7) = ~4km. Measured worst case is ~2.2km
+// (haversine_math_test_main), against ~1e-8km for the full tier. An exact sqrt doesn't
+// change that, the single-step Newton sqrt this used to have made it ~3.3km.
+inline f64 HaversineTier(f64 X0, f64 Y0, f64 X1, f64 Y1, f64 EarthRadius, math_tier Tier)
+{
+    f64 DegreesToRadians = 0.01745329251994329577;
+
+    f64 dLat = DegreesToRadians*(Y1 - Y0);
+    f64 dLon = DegreesToRadians*(X1 - X0);
+    f64 Lat0 = DegreesToRadians*Y0;
+    f64 Lat1 = DegreesToRadians*Y1;
+
+    f64 SinLat = SinTier(0.5*dLat, Tier);
+    f64 SinLon = SinTier(0.5*dLon, Tier);
+    f64 A = SinLat*SinLat + CosTier(Lat0, Tier)*CosTier(Lat1, Tier)*SinLon*SinLon;
+    if(A > 1.0)
+    {
+        // NOTE: The lower tiers can overshoot slightly for near-antipodal pairs
+        A = 1.0;
+    }
+
+    // NOTE: Always the exact sqrt - a Newton-refined rsqrt is no faster than sqrtsd, and this
+    // feeds asin right where it is worst conditioned
+    f64 C = 2.0*ASinTier(SqrtFull(A), Tier);
+
+    f64 Result = EarthRadius*C;
+    return Result;
+}
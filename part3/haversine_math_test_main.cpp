@@ -0,0 +1,305 @@
+/* ========================================================================
+   Haversine math tier harness
+
+   For every function haversine calls, and every accuracy tier, this sweeps
+   the function's whole input domain against libm to find the worst error,
+   then uses the repetition tester to time it in cycles per call. The full
+   haversine formula gets the same treatment, against ReferenceHaversine.
+
+   Expect the haversine errors to be much larger than the per-function ones:
+   asin(sqrt(a)) is badly conditioned as a approaches 1 (antipodal pairs),
+   so every tier's error is amplified there, including libm's own.
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+#include "listing_0065_haversine_formula.cpp"
+#include "listing_0125_buffer.cpp"
+#include "listing_0137_os_platform.cpp"
+#include "listing_0109_pagefault_repetition_tester.cpp"
+#include "haversine_math.cpp"
+
+typedef f64 math_function(f64 X);
+typedef f64 haversine_function(f64 X0, f64 Y0, f64 X1, f64 Y1, f64 EarthRadius);
+
+struct math_function_test
+{
+    char const *Name;
+    math_function *Function;
+    math_function *Reference;
+    f64 Min;
+    f64 Max;
+};
+
+struct haversine_function_test
+{
+    char const *Name;
+    haversine_function *Function;
+};
+
+struct error_stats
+{
+    f64 MaxAbsError;
+    f64 MaxULPError;
+    f64 WorstX;
+};
+
+// NOTE: Out-of-line wrappers so libm and the tiers are called the same way
+static f64 LibmSin(f64 X) {return sin(X);}
+static f64 LibmCos(f64 X) {return cos(X);}
+static f64 LibmASin(f64 X) {return asin(X);}
+static f64 LibmSqrt(f64 X) {return sqrt(X);}
+
+static f64 SinFull(f64 X) {return SinTier(X, MathTier_Full);}
+static f64 Sin1e7(f64 X) {return SinTier(X, MathTier_1e7);}
+static f64 CosFull(f64 X) {return CosTier(X, MathTier_Full);}
+static f64 Cos1e7(f64 X) {return CosTier(X, MathTier_1e7);}
+static f64 ASinTierFull(f64 X) {return ASinTier(X, MathTier_Full);}
+static f64 ASin1e7(f64 X) {return ASinTier(X, MathTier_1e7);}
+static f64 SqrtTierFull(f64 X) {return SqrtFull(X);}
+
+static f64 HaversineFull(f64 X0, f64 Y0, f64 X1, f64 Y1, f64 R) {return HaversineTier(X0, Y0, X1, Y1, R, MathTier_Full);}
+static f64 Haversine1e7(f64 X0, f64 Y0, f64 X1, f64 Y1, f64 R) {return HaversineTier(X0, Y0, X1, Y1, R, MathTier_1e7);}
+
+#define Pi64 3.14159265358979323846
+
+static math_function_test MathTests[] =
+{
+    {"sin libm", LibmSin, LibmSin, -Pi64, Pi64},
+    {"sin full", SinFull, LibmSin, -Pi64, Pi64},
+    {"sin 1e-7", Sin1e7, LibmSin, -Pi64, Pi64},
+
+    {"cos libm", LibmCos, LibmCos, -0.5*Pi64, 0.5*Pi64},
+    {"cos full", CosFull, LibmCos, -0.5*Pi64, 0.5*Pi64},
+    {"cos 1e-7", Cos1e7, LibmCos, -0.5*Pi64, 0.5*Pi64},
+
+    {"asin libm", LibmASin, LibmASin, 0.0, 1.0},
+    {"asin full", ASinTierFull, LibmASin, 0.0, 1.0},
+    {"asin 1e-7", ASin1e7, LibmASin, 0.0, 1.0},
+
+    {"sqrt libm", LibmSqrt, LibmSqrt, 0.0, 1.0},
+    {"sqrt full", SqrtTierFull, LibmSqrt, 0.0, 1.0},
+};
+
+static haversine_function_test HaversineTests[] =
+{
+    {"haversine libm", ReferenceHaversine},
+    {"haversine full", HaversineFull},
+    {"haversine 1e-7", Haversine1e7},
+};
+
+// NOTE: Plenty for a worst case on these small domains; an exhaustive f64 sweep isn't practical
+#define ErrorSampleCount (1ull << 24)
+#define TimingInputCount 4096
+#define EarthRadius 6372.8
+
+static f64 volatile GlobalResultSink;
+
+static u64 RandomU64(u64 *State)
+{
+    // NOTE: xorshift64*
+    u64 X = *State;
+    X ^= X >> 12;
+    X ^= X << 25;
+    X ^= X >> 27;
+    *State = X;
+    return X*0x2545F4914F6CDD1Dull;
+}
+
+static f64 RandomF64(u64 *State, f64 Min, f64 Max)
+{
+    f64 T = (f64)(RandomU64(State) >> 11) * (1.0 / (f64)(1ull << 53));
+    f64 Result = Min + T*(Max - Min);
+    return Result;
+}
+
+static f64 ULPDistance(f64 Value, f64 Reference)
+{
+    f64 A = fabs(Reference);
+    f64 ULP = nextafter(A, INFINITY) - A;
+    f64 Result = fabs(Value - Reference) / ULP;
+    return Result;
+}
+
+static void AccumulateError(error_stats *Stats, f64 X, f64 Value, f64 Reference)
+{
+    f64 AbsError = fabs(Value - Reference);
+    f64 ULPError = ULPDistance(Value, Reference);
+    if((AbsError != AbsError) || (ULPError > Stats->MaxULPError))
+    {
+        Stats->WorstX = X;
+    }
+
+    // NOTE: NaNs are forced to infinity so they can't hide behind a failed compare
+    if(AbsError != AbsError) {AbsError = INFINITY; ULPError = INFINITY;}
+    if(AbsError > Stats->MaxAbsError) {Stats->MaxAbsError = AbsError;}
+    if(ULPError > Stats->MaxULPError) {Stats->MaxULPError = ULPError;}
+}
+
+static error_stats MeasureError(math_function_test *Test)
+{
+    error_stats Stats = {};
+
+    f64 Step = (Test->Max - Test->Min) / (f64)(ErrorSampleCount - 1);
+    for(u64 Index = 0; Index < ErrorSampleCount; ++Index)
+    {
+        f64 X = (Index == (ErrorSampleCount - 1)) ? Test->Max : (Test->Min + Step*(f64)Index);
+        AccumulateError(&Stats, X, Test->Function(X), Test->Reference(X));
+    }
+
+    return Stats;
+}
+
+static error_stats MeasureHaversineError(haversine_function_test *Test)
+{
+    error_stats Stats = {};
+
+    u64 State = 0x9E3779B97F4A7C15ull;
+    for(u64 Index = 0; Index < ErrorSampleCount; ++Index)
+    {
+        f64 X0 = RandomF64(&State, -180.0, 180.0);
+        f64 Y0 = RandomF64(&State, -90.0, 90.0);
+        f64 X1 = RandomF64(&State, -180.0, 180.0);
+        f64 Y1 = RandomF64(&State, -90.0, 90.0);
+
+        AccumulateError(&Stats, (f64)Index, Test->Function(X0, Y0, X1, Y1, EarthRadius),
+                        ReferenceHaversine(X0, Y0, X1, Y1, EarthRadius));
+    }
+
+    return Stats;
+}
+
+static void PrintCyclesPerCall(repetition_tester *Tester, u64 CallCount)
+{
+    f64 MinCycles = (f64)Tester->Results.Min.E[RepValue_CPUTimer];
+    printf("%.2f cycles/call\n", MinCycles / (f64)CallCount);
+}
+
+static void TimeMathFunction(repetition_tester *Tester, math_function *Function, f64 *Inputs, f64 *Outputs)
+{
+    while(IsTesting(Tester))
+    {
+        BeginTime(Tester);
+        for(u32 Index = 0; Index < TimingInputCount; ++Index)
+        {
+            Outputs[Index] = Function(Inputs[Index]);
+        }
+        EndTime(Tester);
+
+        CountBytes(Tester, TimingInputCount*sizeof(f64));
+    }
+
+    GlobalResultSink = Outputs[0];
+}
+
+static void TimeHaversineFunction(repetition_tester *Tester, haversine_function *Function, f64 *Inputs, f64 *Outputs)
+{
+    while(IsTesting(Tester))
+    {
+        BeginTime(Tester);
+        for(u32 Index = 0; Index < TimingInputCount; ++Index)
+        {
+            f64 *Pair = Inputs + 4*Index;
+            Outputs[Index] = Function(Pair[0], Pair[1], Pair[2], Pair[3], EarthRadius);
+        }
+        EndTime(Tester);
+
+        CountBytes(Tester, TimingInputCount*4*sizeof(f64));
+    }
+
+    GlobalResultSink = Outputs[0];
+}
+
+int main(int ArgCount, char **Args)
+{
+    InitializeOSPlatform();
+
+    u32 SecondsToTry = 2;
+    if(ArgCount == 2)
+    {
+        SecondsToTry = atoi(Args[1]);
+    }
+
+    if((ArgCount > 2) || (SecondsToTry == 0))
+    {
+        fprintf(stderr, "Usage: %s [seconds to try per test]\n", Args[0]);
+        return 1;
+    }
+
+    buffer InputBuffer = AllocateBuffer(TimingInputCount*4*sizeof(f64));
+    buffer OutputBuffer = AllocateBuffer(TimingInputCount*sizeof(f64));
+    if(IsValid(InputBuffer) && IsValid(OutputBuffer))
+    {
+        f64 *Inputs = (f64 *)InputBuffer.Data;
+        f64 *Outputs = (f64 *)OutputBuffer.Data;
+        u64 State = 0x2545F4914F6CDD1Dull;
+
+        for(u32 TestIndex = 0; TestIndex < ArrayCount(MathTests); ++TestIndex)
+        {
+            math_function_test *Test = MathTests + TestIndex;
+
+            error_stats Stats = MeasureError(Test);
+            printf("\n--- %s on [%f, %f] ---\n", Test->Name, Test->Min, Test->Max);
+            printf("Max error: %e (%.1f ulp at x = %.17g)\n", Stats.MaxAbsError, Stats.MaxULPError, Stats.WorstX);
+
+            for(u32 Index = 0; Index < TimingInputCount; ++Index)
+            {
+                Inputs[Index] = RandomF64(&State, Test->Min, Test->Max);
+            }
+
+            repetition_tester Tester = {};
+            NewTestWave(&Tester, TimingInputCount*sizeof(f64), GetCPUTimerFreq(), SecondsToTry);
+            TimeMathFunction(&Tester, Test->Function, Inputs, Outputs);
+            PrintCyclesPerCall(&Tester, TimingInputCount);
+        }
+
+        for(u32 TestIndex = 0; TestIndex < ArrayCount(HaversineTests); ++TestIndex)
+        {
+            haversine_function_test *Test = HaversineTests + TestIndex;
+
+            error_stats Stats = MeasureHaversineError(Test);
+            printf("\n--- %s ---\n", Test->Name);
+            printf("Max error: %e km (%.1f ulp)\n", Stats.MaxAbsError, Stats.MaxULPError);
+
+            for(u32 Index = 0; Index < TimingInputCount; ++Index)
+            {
+                f64 *Pair = Inputs + 4*Index;
+                Pair[0] = RandomF64(&State, -180.0, 180.0);
+                Pair[1] = RandomF64(&State, -90.0, 90.0);
+                Pair[2] = RandomF64(&State, -180.0, 180.0);
+                Pair[3] = RandomF64(&State, -90.0, 90.0);
+            }
+
+            repetition_tester Tester = {};
+            NewTestWave(&Tester, TimingInputCount*4*sizeof(f64), GetCPUTimerFreq(), SecondsToTry);
+            TimeHaversineFunction(&Tester, Test->Function, Inputs, Outputs);
+            PrintCyclesPerCall(&Tester, TimingInputCount);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unable to allocate test buffers\n");
+    }
+
+    FreeBuffer(&InputBuffer);
+    FreeBuffer(&OutputBuffer);
+
+    return 0;
+}
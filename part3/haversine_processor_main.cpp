@@ -0,0 +1,572 @@
+/* ========================================================================
+   Haversine processor
+
+   Same pipeline as listing 101 (read, parse, sum, validate), with switches
+   for the alternative parsing/allocation strategies so they can be compared
+   against each other with the bandwidth profiler.
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+struct haversine_pair
+{
+    f64 X0, Y0;
+    f64 X1, Y1;
+};
+
+#define PROFILER 1
+#include "listing_0100_bandwidth_profiler.cpp"
+#include "listing_0065_haversine_formula.cpp"
+#include "listing_0068_buffer.cpp"
+#include "listing_0094_profiled_lookup_json_parser.cpp"
+#include "json_pair_stream.cpp"
+#include "json_lazy.cpp"
+#include "json_tape.cpp"
+#include "json_parallel_pairs.cpp"
+#include "haversine_math.cpp"
+#include "haversine_soa.cpp"
+#include "haversine_fused.cpp"
+#include "haversine_reduction.cpp"
+#include "pair_cache.cpp"
+
+enum pair_parse_mode
+{
+    ParseMode_Tree,
+    ParseMode_Stream,
+    ParseMode_Parallel,
+    ParseMode_Fused, // NOTE: Sums while parsing, no pair buffer
+    ParseMode_Lazy,
+    ParseMode_Tape,
+
+    ParseMode_Count,
+};
+
+struct processor_options
+{
+    char *InputFileName;
+    char *AnswersFileName;
+
+    pair_parse_mode ParseMode;
+    json_allocation_type AllocType;
+    json_index_isa IndexISA; // NOTE: IndexISA_None tokenizes byte by byte
+    haversine_kernel_isa KernelISA; // NOTE: HaversineISA_None sums the AoS pairs with ReferenceHaversine
+    b32 ValidateKernel;
+    u32 ThreadCount; // NOTE: 0 means one per logical processor
+    sum_mode SumMode;
+    char *CacheFileName; // NOTE: Set by -cache, "<input>.pairs"
+    char *TraceFileName;
+    b32 CountEvents;
+};
+
+static buffer ReadEntireFile(char *FileName)
+{
+    TimeFunction;
+
+    buffer Result = {};
+
+    FILE *File = fopen(FileName, "rb");
+    if(File)
+    {
+#if _WIN32
+        struct __stat64 Stat;
+        _stat64(FileName, &Stat);
+#else
+        struct stat Stat;
+        stat(FileName, &Stat);
+#endif
+
+        Result = AllocateBuffer(Stat.st_size);
+        if(Result.Data)
+        {
+            TimeBandwidth("fread", Result.Count);
+            if(fread(Result.Data, Result.Count, 1, File) != 1)
+            {
+                fprintf(stderr, "ERROR: Unable to read \"%s\".\n", FileName);
+                FreeBuffer(&Result);
+            }
+        }
+
+        fclose(File);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unable to open \"%s\".\n", FileName);
+    }
+
+    return Result;
+}
+
+static f64 SumHaversineDistances(u64 PairCount, haversine_pair *Pairs)
+{
+    TimeBandwidth(__func__, PairCount*sizeof(haversine_pair));
+
+    f64 Sum = 0;
+
+    f64 SumCoef = 1 / (f64)PairCount;
+    for(u64 PairIndex = 0; PairIndex < PairCount; ++PairIndex)
+    {
+        haversine_pair Pair = Pairs[PairIndex];
+        f64 EarthRadius = 6372.8;
+        f64 Dist = ReferenceHaversine(Pair.X0, Pair.Y0, Pair.X1, Pair.Y1, EarthRadius);
+        Sum += SumCoef*Dist;
+    }
+
+    return Sum;
+}
+
+static void ValidateSum(char *AnswersFileName, u64 PairCount, f64 Sum, thread_pool *Pool, sum_mode SumMode)
+{
+    buffer AnswersF64 = ReadEntireFile(AnswersFileName);
+    if(AnswersF64.Count >= sizeof(f64))
+    {
+        f64 *AnswerValues = (f64 *)AnswersF64.Data;
+
+        fprintf(stdout, "\nValidation:\n");
+
+        u64 RefAnswerCount = (AnswersF64.Count - sizeof(f64)) / sizeof(f64);
+        if(PairCount != RefAnswerCount)
+        {
+            fprintf(stdout, "FAILED - pair count doesn't match %llu.\n", RefAnswerCount);
+        }
+
+        f64 RefSum = AnswerValues[RefAnswerCount];
+        fprintf(stdout, "Reference sum: %.16f\n", RefSum);
+        fprintf(stdout, "Difference: %.16f\n", Sum - RefSum);
+
+        if((SumMode != SumMode_Serial) && (PairCount == RefAnswerCount))
+        {
+            // NOTE: The stored sum is a serial one, so also reduce the stored distances the way we did
+            f64 RefTreeSum = SumDistancesTree(Pool, RefAnswerCount, AnswerValues, SumMode);
+            fprintf(stdout, "Reference sum (%s): %.16f\n", DescribeSumMode(SumMode), RefTreeSum);
+            fprintf(stdout, "Difference: %.16f\n", Sum - RefTreeSum);
+        }
+
+        fprintf(stdout, "\n");
+    }
+
+    FreeBuffer(&AnswersF64);
+}
+
+static b32 ParseOptions(int ArgCount, char **Args, processor_options *Options)
+{
+    b32 Result = true;
+    b32 UseCache = false;
+
+    for(int ArgIndex = 1; ArgIndex < ArgCount; ++ArgIndex)
+    {
+        char *Arg = Args[ArgIndex];
+        if(strcmp(Arg, "-arena") == 0)
+        {
+            Options->AllocType = JSONAlloc_Arena;
+        }
+        else if(strcmp(Arg, "-largepages") == 0)
+        {
+            Options->AllocType = JSONAlloc_ArenaLargePages;
+        }
+        else if(strcmp(Arg, "-stream") == 0)
+        {
+            Options->ParseMode = ParseMode_Stream;
+        }
+        else if(strcmp(Arg, "-lazy") == 0)
+        {
+            Options->ParseMode = ParseMode_Lazy;
+        }
+        else if(strcmp(Arg, "-tape") == 0)
+        {
+            Options->ParseMode = ParseMode_Tape;
+        }
+        else if(strcmp(Arg, "-fused") == 0)
+        {
+            Options->ParseMode = ParseMode_Fused;
+        }
+        else if(strcmp(Arg, "-threads") == 0)
+        {
+            Options->ParseMode = ParseMode_Parallel;
+            if((ArgIndex + 1) < ArgCount)
+            {
+                Options->ThreadCount = atoi(Args[++ArgIndex]);
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: -threads needs a thread count.\n");
+                Result = false;
+            }
+        }
+        else if(strcmp(Arg, "-cache") == 0)
+        {
+            UseCache = true;
+        }
+        else if(strcmp(Arg, "-tree-sum") == 0)
+        {
+            Options->SumMode = SumMode_Tree;
+        }
+        else if(strcmp(Arg, "-compensated") == 0)
+        {
+            Options->SumMode = SumMode_TreeCompensated;
+        }
+        else if(strcmp(Arg, "-index") == 0)
+        {
+            Options->IndexISA = IndexISA_Count;
+        }
+        else if(strcmp(Arg, "-index-sse2") == 0)
+        {
+            Options->IndexISA = IndexISA_SSE2;
+        }
+        else if(strcmp(Arg, "-simd") == 0)
+        {
+            Options->KernelISA = HaversineISA_Count;
+        }
+        else if(strcmp(Arg, "-simd-scalar") == 0)
+        {
+            Options->KernelISA = HaversineISA_Scalar;
+        }
+        else if(strcmp(Arg, "-simd-avx2") == 0)
+        {
+            Options->KernelISA = HaversineISA_AVX2;
+        }
+        else if(strcmp(Arg, "-simd-avx512") == 0)
+        {
+            Options->KernelISA = HaversineISA_AVX512;
+        }
+        else if(strcmp(Arg, "-validate") == 0)
+        {
+            Options->ValidateKernel = true;
+        }
+        else if(strcmp(Arg, "-counters") == 0)
+        {
+            Options->CountEvents = true;
+        }
+        else if(strcmp(Arg, "-trace") == 0)
+        {
+            if((ArgIndex + 1) < ArgCount)
+            {
+                Options->TraceFileName = Args[++ArgIndex];
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: -trace needs a file name.\n");
+                Result = false;
+            }
+        }
+        else if(Arg[0] == '-')
+        {
+            fprintf(stderr, "ERROR: Unrecognized option \"%s\".\n", Arg);
+            Result = false;
+        }
+        else if(!Options->InputFileName)
+        {
+            Options->InputFileName = Arg;
+        }
+        else if(!Options->AnswersFileName)
+        {
+            Options->AnswersFileName = Arg;
+        }
+        else
+        {
+            Result = false;
+        }
+    }
+
+    if(!Options->InputFileName)
+    {
+        Result = false;
+    }
+    else if(UseCache)
+    {
+        size_t NameSize = strlen(Options->InputFileName) + sizeof(".pairs");
+        Options->CacheFileName = (char *)malloc(NameSize);
+        snprintf(Options->CacheFileName, NameSize, "%s.pairs", Options->InputFileName);
+    }
+
+    return Result;
+}
+
+int main(int ArgCount, char **Args)
+{
+    BeginProfile();
+
+    int Result = 1;
+
+    processor_options Options = {};
+    if(ParseOptions(ArgCount, Args, &Options))
+    {
+        if(Options.TraceFileName)
+        {
+            EnableProfileTrace(Options.TraceFileName);
+        }
+
+        if(Options.CountEvents)
+        {
+            EnableProfileCounters();
+        }
+
+        pair_cache Cache = {};
+        if(Options.CacheFileName)
+        {
+            Cache = LoadPairCache(Options.CacheFileName, Options.InputFileName);
+        }
+        b32 FromCache = (Cache.Pairs.X0 != 0);
+
+        // NOTE: A cache hit never touches the JSON
+        buffer InputJSON = {};
+        if(!FromCache)
+        {
+            InputJSON = ReadEntireFile(Options.InputFileName);
+        }
+
+        u32 MinimumJSONPairEncoding = 6*4;
+        u64 MaxPairCount = InputJSON.Count / MinimumJSONPairEncoding;
+        if(MaxPairCount || FromCache)
+        {
+            b32 Fused = (Options.ParseMode == ParseMode_Fused) && !FromCache;
+            if(Fused && ((Options.SumMode != SumMode_Serial) || Options.ValidateKernel || Options.CacheFileName))
+            {
+                fprintf(stdout, "Fused: -tree-sum, -compensated, -validate and -cache need the pair buffer, ignoring them\n");
+                Options.SumMode = SumMode_Serial;
+                Options.ValidateKernel = false;
+                Options.CacheFileName = 0;
+            }
+
+            buffer ParsedValues = {};
+            if(Fused)
+            {
+                fprintf(stdout, "Pair buffer: none (%u-pair batches, saves %.3fmb)\n", FusedBatchPairCount,
+                        (f64)(MaxPairCount*sizeof(haversine_pair)) / (1024.0*1024.0));
+            }
+            else if(!FromCache)
+            {
+                ParsedValues = AllocateBuffer(MaxPairCount * sizeof(haversine_pair));
+            }
+
+            if(ParsedValues.Count || Fused || FromCache)
+            {
+                haversine_pair *Pairs = (haversine_pair *)ParsedValues.Data;
+
+                thread_pool *Pool = 0;
+                b32 ParallelParse = (Options.ParseMode == ParseMode_Parallel) && !FromCache;
+                if(ParallelParse || (Options.SumMode != SumMode_Serial))
+                {
+                    Pool = CreateThreadPool(Options.ThreadCount);
+                    if(Pool)
+                    {
+                        fprintf(stdout, "Threads: %u\n", Pool->ThreadCount);
+                    }
+                    else
+                    {
+                        fprintf(stderr, "ERROR: Unable to create thread pool, running serially\n");
+                        Options.ParseMode = ParseMode_Stream;
+                        Options.SumMode = SumMode_Serial;
+                    }
+                }
+
+                if((Options.ParseMode == ParseMode_Lazy) && (Options.IndexISA != IndexISA_None))
+                {
+                    // NOTE: The lazy document scans the raw bytes on demand, there are no tokens to index
+                    fprintf(stdout, "Structural index: ignored with -lazy\n");
+                    Options.IndexISA = IndexISA_None;
+                }
+
+                json_structural_indexer IndexerStorage = {};
+                json_structural_indexer *Indexer = 0;
+                if((Options.IndexISA != IndexISA_None) && !FromCache)
+                {
+                    IndexerStorage = CreateStructuralIndexer(InputJSON, Options.IndexISA);
+                    if(IndexerStorage.Positions)
+                    {
+                        Indexer = &IndexerStorage;
+                        fprintf(stdout, "Structural index: %s\n", DescribeIndexISA(Indexer->ISA));
+                    }
+                }
+
+                haversine_kernel_isa KernelISA = HaversineISA_None;
+                if(Options.KernelISA != HaversineISA_None)
+                {
+                    KernelISA = ResolveHaversineISA(Options.KernelISA);
+                    fprintf(stdout, "Haversine kernel: %s\n", DescribeHaversineISA(KernelISA));
+                }
+
+                u64 PairCount = 0;
+                f64 Sum = 0;
+                haversine_pair_soa SoAPairs = {};
+                if(FromCache)
+                {
+                    SoAPairs = Cache.Pairs;
+                    PairCount = SoAPairs.Count;
+                }
+                else
+                {
+                    switch(Options.ParseMode)
+                    {
+                        case ParseMode_Tree:
+                        {
+                            PairCount = ParseHaversinePairs(InputJSON, MaxPairCount, Pairs, Options.AllocType, Indexer);
+                        } break;
+
+                        case ParseMode_Stream:
+                        {
+                            PairCount = ParseHaversinePairsStreaming(InputJSON, MaxPairCount, Pairs, Indexer);
+                        } break;
+
+                        case ParseMode_Lazy:
+                        {
+                            PairCount = ParseHaversinePairsLazy(InputJSON, MaxPairCount, Pairs);
+                        } break;
+
+                        case ParseMode_Tape:
+                        {
+                            PairCount = ParseHaversinePairsTape(InputJSON, MaxPairCount, Pairs, Indexer);
+                        } break;
+
+                        case ParseMode_Parallel:
+                        {
+                            // NOTE: Each chunk gets its own indexer, this one only settled which ISA they use
+                            PairCount = ParseHaversinePairsParallel(Pool, InputJSON, MaxPairCount, Pairs,
+                                                                    Indexer ? Indexer->ISA : IndexISA_None);
+                        } break;
+
+                        case ParseMode_Fused:
+                        {
+                            fused_haversine_result Fused = ParseAndSumHaversinePairs(InputJSON, KernelISA, Indexer);
+                            PairCount = Fused.PairCount;
+                            Sum = Fused.Sum;
+                        } break;
+
+                        default: break;
+                    }
+
+                    if(Options.CacheFileName)
+                    {
+                        SoAPairs = ConvertPairsToSoA(PairCount, Pairs);
+                        WritePairCache(Options.CacheFileName, Options.InputFileName, &SoAPairs);
+                    }
+                }
+
+                FreeStructuralIndexer(&IndexerStorage);
+
+                if(Fused)
+                {
+                    // NOTE: Already summed while parsing
+                }
+                else if(KernelISA == HaversineISA_None)
+                {
+                    if(Options.SumMode != SumMode_Serial)
+                    {
+                        fprintf(stdout, "Sum: %s, %u-pair blocks\n", DescribeSumMode(Options.SumMode), SumBlockPairCount);
+                        Sum = FromCache ?
+                            SumHaversineDistancesTreeSoA(Pool, &SoAPairs, Options.SumMode) :
+                            SumHaversineDistancesTree(Pool, PairCount, Pairs, Options.SumMode);
+                    }
+                    else if(FromCache)
+                    {
+                        // NOTE: The scalar SoA kernel is the serial reference loop, just reading columns
+                        Sum = SumHaversineDistancesSoA(&SoAPairs, HaversineISA_Scalar);
+                    }
+                    else
+                    {
+                        Sum = SumHaversineDistances(PairCount, Pairs);
+                    }
+                }
+                else
+                {
+                    if(Options.SumMode != SumMode_Serial)
+                    {
+                        // NOTE: The SoA kernels keep their own accumulation order
+                        fprintf(stdout, "Sum: %s ignored with the SoA kernels\n", DescribeSumMode(Options.SumMode));
+                        Options.SumMode = SumMode_Serial;
+                    }
+
+                    if(!SoAPairs.X0)
+                    {
+                        SoAPairs = ConvertPairsToSoA(PairCount, Pairs);
+                    }
+                    Sum = SumHaversineDistancesSoA(&SoAPairs, KernelISA);
+
+                    if(Options.ValidateKernel)
+                    {
+                        ValidateHaversineKernel(&SoAPairs, KernelISA);
+                    }
+                }
+
+                if(!FromCache)
+                {
+                    FreeHaversineSoA(&SoAPairs);
+                }
+
+                Result = 0;
+
+                fprintf(stdout, "Input size: %llu\n", FromCache ? Cache.SourceSize : InputJSON.Count);
+                fprintf(stdout, "Pair count: %llu\n", PairCount);
+                fprintf(stdout, "Haversine sum: %.16f\n", Sum);
+
+                if(Options.AnswersFileName)
+                {
+                    ValidateSum(Options.AnswersFileName, PairCount, Sum, Pool, Options.SumMode);
+                }
+
+                FreeThreadPool(Pool);
+            }
+
+            FreeBuffer(&ParsedValues);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Malformed input JSON\n");
+        }
+
+        UnmapPairCache(&Cache);
+        FreeBuffer(&InputJSON);
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s [options] [haversine_input.json]\n", Args[0]);
+        fprintf(stderr, "       %s [options] [haversine_input.json] [answers.f64]\n", Args[0]);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "  -arena       allocate JSON elements from a linear arena\n");
+        fprintf(stderr, "  -largepages  same as -arena, backed by large pages when available\n");
+        fprintf(stderr, "  -stream      extract pairs straight from the token stream, no element tree\n");
+        fprintf(stderr, "  -lazy        look pairs up on demand in the raw JSON, skipping what isn't read\n");
+        fprintf(stderr, "  -tape        parse into a flat tape of u64 entries instead of an element tree (honors -index)\n");
+        fprintf(stderr, "  -fused       sum each batch of pairs as it is parsed, no pair buffer (honors -index and -simd*)\n");
+        fprintf(stderr, "  -cache       load pairs from <input>.pairs when it matches the JSON, else write it after parsing\n");
+        fprintf(stderr, "  -threads N   split the input at pair boundaries and parse on N threads (0 = all cores, honors -index)\n");
+        fprintf(stderr, "  -tree-sum    deterministic multithreaded sum over fixed blocks (same result for any -threads, honors -index)\n");
+        fprintf(stderr, "  -compensated same as -tree-sum, with Neumaier compensation\n");
+        fprintf(stderr, "  -index       tokenize from a SIMD structural index (AVX2 if available)\n");
+        fprintf(stderr, "  -index-sse2  same as -index, forcing the SSE2 classifier\n");
+        fprintf(stderr, "  -simd        sum with the best SoA kernel this CPU supports\n");
+        fprintf(stderr, "  -simd-scalar, -simd-avx2, -simd-avx512  pick the SoA kernel explicitly\n");
+        fprintf(stderr, "  -validate    report the SoA kernel's max per-pair error vs. ReferenceHaversine\n");
+        fprintf(stderr, "  -counters    attribute hardware counters to each profile block (Linux perf events)\n");
+        fprintf(stderr, "  -trace F     also write every profile block to F as Chrome trace JSON (open in ui.perfetto.dev)\n");
+    }
+
+    if(Result == 0)
+    {
+        EndAndPrintProfile();
+    }
+
+    return Result;
+}
+
+ProfilerEndOfCompilationUnit;
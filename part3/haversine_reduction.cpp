@@ -0,0 +1,217 @@
+/* ========================================================================
+   Deterministic parallel haversine sum
+
+   The pairs are cut into fixed-size blocks no matter how many threads
+   there are. Each block is summed serially in input order, then the block
+   sums are combined with a pairwise tree whose shape only depends on the
+   block count. Which thread ran which block never enters into it, so the
+   result is bit-identical for any thread count. It is not the same
+   number the serial loop produces, since the additions are grouped
+   differently, but it is usually closer to the exact sum.
+
+   The compensated mode carries a Neumaier (improved Kahan) correction
+   term through both the blocks and the tree.
+   ======================================================================== */
+
+#include "thread_pool.cpp"
+
+#define SumBlockPairCount 4096
+
+enum sum_mode
+{
+    SumMode_Serial, // NOTE: SumHaversineDistances, one accumulator in input order
+    SumMode_Tree,
+    SumMode_TreeCompensated,
+
+    SumMode_Count,
+};
+
+struct compensated_sum
+{
+    f64 Sum;
+    f64 Compensation;
+};
+
+struct sum_reduction
+{
+    sum_mode Mode;
+    u64 Count;
+    f64 SumCoef;
+
+    // NOTE: One of these is set. Distances lets the answers file go through the same reduction.
+    haversine_pair *Pairs;
+    haversine_pair_soa *SoAPairs;
+    f64 *Distances;
+
+    compensated_sum *BlockSums;
+};
+
+static char const *DescribeSumMode(sum_mode Mode)
+{
+    char const *Result;
+    switch(Mode)
+    {
+        case SumMode_Serial: {Result = "serial";} break;
+        case SumMode_Tree: {Result = "pairwise tree";} break;
+        case SumMode_TreeCompensated: {Result = "pairwise tree, Neumaier compensated";} break;
+        default : {Result = "UNKNOWN";} break;
+    }
+
+    return Result;
+}
+
+inline void NeumaierAdd(compensated_sum *Acc, f64 Value)
+{
+    f64 Sum = Acc->Sum + Value;
+    if(fabs(Acc->Sum) >= fabs(Value))
+    {
+        Acc->Compensation += (Acc->Sum - Sum) + Value;
+    }
+    else
+    {
+        Acc->Compensation += (Value - Sum) + Acc->Sum;
+    }
+    Acc->Sum = Sum;
+}
+
+inline compensated_sum CombineSums(compensated_sum A, compensated_sum B, sum_mode Mode)
+{
+    compensated_sum Result = A;
+    if(Mode == SumMode_TreeCompensated)
+    {
+        NeumaierAdd(&Result, B.Sum);
+        Result.Compensation += B.Compensation;
+    }
+    else
+    {
+        Result.Sum += B.Sum;
+    }
+
+    return Result;
+}
+
+static void SumHaversineBlock(void *Data, u32 BlockIndex)
+{
+    sum_reduction *Reduction = (sum_reduction *)Data;
+
+    u64 First = (u64)BlockIndex*SumBlockPairCount;
+    u64 OnePastLast = First + SumBlockPairCount;
+    if(OnePastLast > Reduction->Count)
+    {
+        OnePastLast = Reduction->Count;
+    }
+
+    TimeBlock("Sum block");
+
+    f64 EarthRadius = 6372.8;
+    f64 SumCoef = Reduction->SumCoef;
+    b32 Compensated = (Reduction->Mode == SumMode_TreeCompensated);
+
+    compensated_sum Acc = {};
+    for(u64 Index = First; Index < OnePastLast; ++Index)
+    {
+        f64 Dist;
+        if(Reduction->Distances)
+        {
+            Dist = Reduction->Distances[Index];
+        }
+        else if(Reduction->SoAPairs)
+        {
+            haversine_pair_soa *SoA = Reduction->SoAPairs;
+            Dist = ReferenceHaversine(SoA->X0[Index], SoA->Y0[Index], SoA->X1[Index], SoA->Y1[Index], EarthRadius);
+        }
+        else
+        {
+            haversine_pair Pair = Reduction->Pairs[Index];
+            Dist = ReferenceHaversine(Pair.X0, Pair.Y0, Pair.X1, Pair.Y1, EarthRadius);
+        }
+
+        if(Compensated)
+        {
+            NeumaierAdd(&Acc, SumCoef*Dist);
+        }
+        else
+        {
+            Acc.Sum += SumCoef*Dist;
+        }
+    }
+
+    Reduction->BlockSums[BlockIndex] = Acc;
+}
+
+static f64 ReduceHaversineSum(thread_pool *Pool, sum_reduction *Reduction)
+{
+    f64 Result = 0;
+
+    u64 BlockCount = (Reduction->Count + SumBlockPairCount - 1) / SumBlockPairCount;
+    if(BlockCount)
+    {
+        Reduction->SumCoef = 1 / (f64)Reduction->Count;
+        Reduction->BlockSums = (compensated_sum *)calloc(BlockCount, sizeof(compensated_sum));
+        if(Reduction->BlockSums && (BlockCount <= 0xffffffff))
+        {
+            RunTasks(Pool, (u32)BlockCount, SumHaversineBlock, Reduction);
+
+            TimeBlock("Combine block sums");
+
+            // NOTE: Fixed-shape pairwise tree: at each level, block i absorbs block i + Stride
+            compensated_sum *Sums = Reduction->BlockSums;
+            for(u64 Stride = 1; Stride < BlockCount; Stride *= 2)
+            {
+                for(u64 Index = 0; (Index + Stride) < BlockCount; Index += 2*Stride)
+                {
+                    Sums[Index] = CombineSums(Sums[Index], Sums[Index + Stride], Reduction->Mode);
+                }
+            }
+
+            Result = Sums[0].Sum + Sums[0].Compensation;
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Unable to allocate %llu block sums.\n", BlockCount);
+        }
+
+        free(Reduction->BlockSums);
+        Reduction->BlockSums = 0;
+    }
+
+    return Result;
+}
+
+static f64 SumHaversineDistancesTree(thread_pool *Pool, u64 PairCount, haversine_pair *Pairs, sum_mode Mode)
+{
+    TimeBandwidth(__func__, PairCount*sizeof(haversine_pair));
+
+    sum_reduction Reduction = {};
+    Reduction.Mode = Mode;
+    Reduction.Count = PairCount;
+    Reduction.Pairs = Pairs;
+
+    f64 Result = ReduceHaversineSum(Pool, &Reduction);
+    return Result;
+}
+
+static f64 SumHaversineDistancesTreeSoA(thread_pool *Pool, haversine_pair_soa *Pairs, sum_mode Mode)
+{
+    TimeBandwidth(__func__, Pairs->Count*sizeof(haversine_pair));
+
+    sum_reduction Reduction = {};
+    Reduction.Mode = Mode;
+    Reduction.Count = Pairs->Count;
+    Reduction.SoAPairs = Pairs;
+
+    f64 Result = ReduceHaversineSum(Pool, &Reduction);
+    return Result;
+}
+
+// NOTE: Same reduction over distances that were already computed (e.g. the answers file)
+static f64 SumDistancesTree(thread_pool *Pool, u64 Count, f64 *Distances, sum_mode Mode)
+{
+    sum_reduction Reduction = {};
+    Reduction.Mode = Mode;
+    Reduction.Count = Count;
+    Reduction.Distances = Distances;
+
+    f64 Result = ReduceHaversineSum(Pool, &Reduction);
+    return Result;
+}
@@ -0,0 +1,311 @@
+/* ========================================================================
+   Structure-of-arrays haversine pairs and the SIMD kernels that sum them
+
+   Each column is 64-byte aligned and padded out to a whole number of
+   AVX-512 registers. The padding pairs are all zero, which makes their
+   distance exactly zero, so the kernels never need a remainder loop.
+   ======================================================================== */
+
+#define HAVERSINE_SOA_LANES 8
+#define HAVERSINE_SOA_ALIGNMENT 64
+
+enum haversine_kernel_isa
+{
+    HaversineISA_None, // NOTE: Array-of-structs reference path, no SoA conversion
+    HaversineISA_Scalar,
+    HaversineISA_AVX2,
+    HaversineISA_AVX512,
+
+    HaversineISA_Count,
+};
+
+struct haversine_pair_soa
+{
+    u64 Count;
+    u64 PaddedCount;
+
+    f64 *X0;
+    f64 *Y0;
+    f64 *X1;
+    f64 *Y1;
+
+    void *Memory;
+};
+
+static char const *DescribeHaversineISA(haversine_kernel_isa ISA)
+{
+    char const *Result;
+    switch(ISA)
+    {
+        case HaversineISA_None: {Result = "reference";} break;
+        case HaversineISA_Scalar: {Result = "scalar SoA";} break;
+        case HaversineISA_AVX2: {Result = "AVX2";} break;
+        case HaversineISA_AVX512: {Result = "AVX-512";} break;
+        default : {Result = "UNKNOWN";} break;
+    }
+
+    return Result;
+}
+
+static haversine_kernel_isa GetBestHaversineISA(void)
+{
+    cpu_features Features = GetCPUFeatures();
+
+    haversine_kernel_isa Result = HaversineISA_Scalar;
+    if(Features.AVX512)
+    {
+        Result = HaversineISA_AVX512;
+    }
+    else if(Features.AVX2 && Features.FMA)
+    {
+        Result = HaversineISA_AVX2;
+    }
+
+    return Result;
+}
+
+// NOTE: Falls back to the best supported ISA if the requested one isn't available
+static haversine_kernel_isa ResolveHaversineISA(haversine_kernel_isa ISA)
+{
+    haversine_kernel_isa Best = GetBestHaversineISA();
+
+    haversine_kernel_isa Result = ISA;
+    if((ISA == HaversineISA_Count) || (ISA > Best))
+    {
+        Result = Best;
+    }
+
+    return Result;
+}
+
+static haversine_pair_soa AllocateHaversineSoA(u64 Count)
+{
+    haversine_pair_soa Result = {};
+
+    u64 PaddedCount = (Count + HAVERSINE_SOA_LANES - 1) & ~(u64)(HAVERSINE_SOA_LANES - 1);
+    u64 ColumnSize = PaddedCount*sizeof(f64);
+
+    Result.Memory = calloc(4*ColumnSize + HAVERSINE_SOA_ALIGNMENT, 1);
+    if(Result.Memory)
+    {
+        u8 *Base = (u8 *)(((u64)Result.Memory + HAVERSINE_SOA_ALIGNMENT - 1) & ~(u64)(HAVERSINE_SOA_ALIGNMENT - 1));
+
+        Result.Count = Count;
+        Result.PaddedCount = PaddedCount;
+        Result.X0 = (f64 *)(Base + 0*ColumnSize);
+        Result.Y0 = (f64 *)(Base + 1*ColumnSize);
+        Result.X1 = (f64 *)(Base + 2*ColumnSize);
+        Result.Y1 = (f64 *)(Base + 3*ColumnSize);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unable to allocate SoA storage for %llu pairs.\n", Count);
+    }
+
+    return Result;
+}
+
+static void FreeHaversineSoA(haversine_pair_soa *Pairs)
+{
+    free(Pairs->Memory);
+    *Pairs = {};
+}
+
+static haversine_pair_soa ConvertPairsToSoA(u64 PairCount, haversine_pair *Pairs)
+{
+    TimeBandwidth(__func__, PairCount*sizeof(haversine_pair));
+
+    haversine_pair_soa Result = AllocateHaversineSoA(PairCount);
+    if(Result.Memory)
+    {
+        for(u64 PairIndex = 0; PairIndex < PairCount; ++PairIndex)
+        {
+            haversine_pair Pair = Pairs[PairIndex];
+            Result.X0[PairIndex] = Pair.X0;
+            Result.Y0[PairIndex] = Pair.Y0;
+            Result.X1[PairIndex] = Pair.X1;
+            Result.Y1[PairIndex] = Pair.Y1;
+        }
+    }
+
+    return Result;
+}
+
+/* NOTE: Every kernel returns the same thing SumHaversineDistances does
+   (the average distance), and if Distances is non-null, also stores each
+   pair's distance there so it can be validated. */
+
+static f64 SumHaversineSoAScalar(haversine_pair_soa *Pairs, f64 EarthRadius, f64 *Distances)
+{
+    f64 Sum = 0;
+
+    f64 SumCoef = 1 / (f64)Pairs->Count;
+    for(u64 PairIndex = 0; PairIndex < Pairs->Count; ++PairIndex)
+    {
+        f64 Dist = ReferenceHaversine(Pairs->X0[PairIndex], Pairs->Y0[PairIndex],
+                                      Pairs->X1[PairIndex], Pairs->Y1[PairIndex], EarthRadius);
+        if(Distances)
+        {
+            Distances[PairIndex] = Dist;
+        }
+        Sum += SumCoef*Dist;
+    }
+
+    return Sum;
+}
+
+TARGET_AVX2 static f64 SumHaversineSoAAVX2(haversine_pair_soa *Pairs, f64 EarthRadius, f64 *Distances)
+{
+    __m256d DegToRad = _mm256_set1_pd(0.01745329251994329577);
+    __m256d Half = _mm256_set1_pd(0.5);
+    __m256d Radius2 = _mm256_set1_pd(2.0*EarthRadius);
+    __m256d Sum = _mm256_setzero_pd();
+
+    for(u64 PairIndex = 0; PairIndex < Pairs->PaddedCount; PairIndex += 4)
+    {
+        __m256d X0 = _mm256_load_pd(Pairs->X0 + PairIndex);
+        __m256d Y0 = _mm256_load_pd(Pairs->Y0 + PairIndex);
+        __m256d X1 = _mm256_load_pd(Pairs->X1 + PairIndex);
+        __m256d Y1 = _mm256_load_pd(Pairs->Y1 + PairIndex);
+
+        __m256d HalfDLat = _mm256_mul_pd(_mm256_mul_pd(_mm256_sub_pd(Y1, Y0), DegToRad), Half);
+        __m256d HalfDLon = _mm256_mul_pd(_mm256_mul_pd(_mm256_sub_pd(X1, X0), DegToRad), Half);
+        __m256d Lat1 = _mm256_mul_pd(Y0, DegToRad);
+        __m256d Lat2 = _mm256_mul_pd(Y1, DegToRad);
+
+        __m256d SinDLat = SinAVX2(HalfDLat);
+        __m256d SinDLon = SinAVX2(HalfDLon);
+        __m256d CosLat = _mm256_mul_pd(CosAVX2(Lat1), CosAVX2(Lat2));
+
+        __m256d A = _mm256_fmadd_pd(_mm256_mul_pd(CosLat, SinDLon), SinDLon, _mm256_mul_pd(SinDLat, SinDLat));
+        __m256d Dist = _mm256_mul_pd(Radius2, ASinAVX2(_mm256_sqrt_pd(A)));
+
+        if(Distances)
+        {
+            _mm256_storeu_pd(Distances + PairIndex, Dist);
+        }
+        Sum = _mm256_add_pd(Sum, Dist);
+    }
+
+    f64 Lanes[4];
+    _mm256_storeu_pd(Lanes, Sum);
+    f64 Result = ((Lanes[0] + Lanes[1]) + (Lanes[2] + Lanes[3])) / (f64)Pairs->Count;
+    return Result;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+// NOTE: Same GCC 12 AVX-512 header warnings as the helpers in haversine_math.cpp
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+TARGET_AVX512 static f64 SumHaversineSoAAVX512(haversine_pair_soa *Pairs, f64 EarthRadius, f64 *Distances)
+{
+    __m512d DegToRad = _mm512_set1_pd(0.01745329251994329577);
+    __m512d Half = _mm512_set1_pd(0.5);
+    __m512d Radius2 = _mm512_set1_pd(2.0*EarthRadius);
+    __m512d Sum = _mm512_setzero_pd();
+
+    for(u64 PairIndex = 0; PairIndex < Pairs->PaddedCount; PairIndex += 8)
+    {
+        __m512d X0 = _mm512_load_pd(Pairs->X0 + PairIndex);
+        __m512d Y0 = _mm512_load_pd(Pairs->Y0 + PairIndex);
+        __m512d X1 = _mm512_load_pd(Pairs->X1 + PairIndex);
+        __m512d Y1 = _mm512_load_pd(Pairs->Y1 + PairIndex);
+
+        __m512d HalfDLat = _mm512_mul_pd(_mm512_mul_pd(_mm512_sub_pd(Y1, Y0), DegToRad), Half);
+        __m512d HalfDLon = _mm512_mul_pd(_mm512_mul_pd(_mm512_sub_pd(X1, X0), DegToRad), Half);
+        __m512d Lat1 = _mm512_mul_pd(Y0, DegToRad);
+        __m512d Lat2 = _mm512_mul_pd(Y1, DegToRad);
+
+        __m512d SinDLat = SinAVX512(HalfDLat);
+        __m512d SinDLon = SinAVX512(HalfDLon);
+        __m512d CosLat = _mm512_mul_pd(CosAVX512(Lat1), CosAVX512(Lat2));
+
+        __m512d A = _mm512_fmadd_pd(_mm512_mul_pd(CosLat, SinDLon), SinDLon, _mm512_mul_pd(SinDLat, SinDLat));
+        __m512d Dist = _mm512_mul_pd(Radius2, ASinAVX512(_mm512_sqrt_pd(A)));
+
+        if(Distances)
+        {
+            _mm512_storeu_pd(Distances + PairIndex, Dist);
+        }
+        Sum = _mm512_add_pd(Sum, Dist);
+    }
+
+    f64 Result = _mm512_reduce_add_pd(Sum) / (f64)Pairs->Count;
+    return Result;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+static f64 SumHaversineKernel(haversine_pair_soa *Pairs, haversine_kernel_isa ISA, f64 *Distances = 0)
+{
+    f64 EarthRadius = 6372.8;
+
+    f64 Result = 0;
+    switch(ISA)
+    {
+        case HaversineISA_AVX2: {Result = SumHaversineSoAAVX2(Pairs, EarthRadius, Distances);} break;
+        case HaversineISA_AVX512: {Result = SumHaversineSoAAVX512(Pairs, EarthRadius, Distances);} break;
+        default: {Result = SumHaversineSoAScalar(Pairs, EarthRadius, Distances);} break;
+    }
+
+    return Result;
+}
+
+static f64 SumHaversineDistancesSoA(haversine_pair_soa *Pairs, haversine_kernel_isa ISA)
+{
+    TimeBandwidth(__func__, Pairs->Count*sizeof(haversine_pair));
+
+    f64 Result = 0;
+    if(Pairs->Count)
+    {
+        Result = SumHaversineKernel(Pairs, ISA);
+    }
+
+    return Result;
+}
+
+// NOTE: Runs the kernel once more, keeping every distance, and compares each one against ReferenceHaversine
+static void ValidateHaversineKernel(haversine_pair_soa *Pairs, haversine_kernel_isa ISA)
+{
+    f64 *Distances = (f64 *)calloc(Pairs->PaddedCount ? Pairs->PaddedCount : 1, sizeof(f64));
+    if(Distances)
+    {
+        SumHaversineKernel(Pairs, ISA, Distances);
+
+        f64 MaxAbsError = 0;
+        f64 MaxRelError = 0;
+        u64 MaxAbsIndex = 0;
+        u64 MaxRelIndex = 0;
+        for(u64 PairIndex = 0; PairIndex < Pairs->Count; ++PairIndex)
+        {
+            f64 Reference = ReferenceHaversine(Pairs->X0[PairIndex], Pairs->Y0[PairIndex],
+                                               Pairs->X1[PairIndex], Pairs->Y1[PairIndex], 6372.8);
+            f64 AbsError = fabs(Distances[PairIndex] - Reference);
+            f64 RelError = (Reference != 0) ? (AbsError / fabs(Reference)) : AbsError;
+
+            // NOTE: Written so that a NaN always registers as the worst error
+            if(!(AbsError <= MaxAbsError))
+            {
+                MaxAbsError = AbsError;
+                MaxAbsIndex = PairIndex;
+            }
+
+            if(!(RelError <= MaxRelError))
+            {
+                MaxRelError = RelError;
+                MaxRelIndex = PairIndex;
+            }
+        }
+
+        fprintf(stdout, "\nKernel validation (%s vs. ReferenceHaversine, %llu pairs):\n", DescribeHaversineISA(ISA), Pairs->Count);
+        fprintf(stdout, "Max abs error: %e (pair %llu)\n", MaxAbsError, MaxAbsIndex);
+        fprintf(stdout, "Max rel error: %e (pair %llu)\n", MaxRelError, MaxRelIndex);
+
+        free(Distances);
+    }
+}
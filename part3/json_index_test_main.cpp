@@ -0,0 +1,136 @@
+/* ========================================================================
+   Structural index parity harness
+
+   Parses a fixed list of small documents with the byte tokenizer and
+   again through the structural index (SSE2 and AVX2), and checks that
+   all of them agree on which documents are valid. The index only marks
+   where a number starts, so malformed numbers are the interesting case.
+
+   NOTE: The invalid documents print the parser's ERROR line, that's expected.
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+struct haversine_pair
+{
+    f64 X0, Y0;
+    f64 X1, Y1;
+};
+
+#define TimeFunction
+#define TimeBlock(...)
+#define TimeBandwidth(...)
+
+#include "listing_0125_buffer.cpp"
+#include "listing_0094_profiled_lookup_json_parser.cpp"
+
+struct index_parity_test
+{
+    char const *JSON;
+    b32 Valid;
+};
+
+static index_parity_test ParityTests[] =
+{
+    {"[1, -2.5e+3, 0, 0.125, -0, 1E5, 2e-3]", true},
+    {"{\"a\" : -0.0 , \"b\":[ 7 ,8 ]}", true},
+    {"[true, false, null, \"1abc\"]", true},
+    {"[1abc]", false},
+    {"[1 2]", false},
+    {"[--5]", false},
+    {"[-]", false},
+    {"[1.]", false},
+    {"[1.e5]", false},
+    {"[1e]", false},
+    {"[1e+]", false},
+    {"[01]", false},
+    {"{\"a\":1x}", false},
+    {"[truex]", false},
+};
+
+static b32 ParsesCleanly(buffer Source, json_structural_indexer *Indexer)
+{
+    json_parser Parser = {};
+    Parser.Source = Source;
+    Parser.Indexer = Indexer;
+
+    json_element *Root = ParseJSONElement(&Parser, {}, GetJSONToken(&Parser));
+    b32 Result = (Root != 0) && !Parser.HadError;
+
+    FreeJSON(Root);
+
+    return Result;
+}
+
+static b32 RunParityTest(index_parity_test *Test)
+{
+    b32 Result = true;
+
+    buffer Source = {};
+    Source.Data = (u8 *)Test->JSON;
+    Source.Count = strlen(Test->JSON);
+
+    if(ParsesCleanly(Source, 0) != Test->Valid)
+    {
+        fprintf(stderr, "FAILED: %s with the byte tokenizer, expected %s\n", Test->JSON, Test->Valid ? "valid" : "invalid");
+        Result = false;
+    }
+
+    json_index_isa ISAs[] = {IndexISA_SSE2, IndexISA_AVX2};
+    for(u32 ISAIndex = 0; ISAIndex < ArrayCount(ISAs); ++ISAIndex)
+    {
+        json_structural_indexer Indexer = CreateStructuralIndexer(Source, ISAs[ISAIndex]);
+        if(Indexer.Positions)
+        {
+            if(ParsesCleanly(Source, &Indexer) != Test->Valid)
+            {
+                fprintf(stderr, "FAILED: %s with the %s index, expected %s\n", Test->JSON,
+                        DescribeIndexISA(Indexer.ISA), Test->Valid ? "valid" : "invalid");
+                Result = false;
+            }
+        }
+
+        FreeStructuralIndexer(&Indexer);
+    }
+
+    return Result;
+}
+
+int main(void)
+{
+    // NOTE: Only the tokenizers are under test, the rest of the parser comes along with the include
+    (void)&ParseHaversinePairs;
+
+    u32 FailedCount = 0;
+    for(u32 TestIndex = 0; TestIndex < ArrayCount(ParityTests); ++TestIndex)
+    {
+        if(!RunParityTest(ParityTests + TestIndex))
+        {
+            ++FailedCount;
+        }
+    }
+
+    printf("Index parity tests: %u of %u passed\n", (u32)ArrayCount(ParityTests) - FailedCount, (u32)ArrayCount(ParityTests));
+
+    return FailedCount ? 1 : 0;
+}
@@ -0,0 +1,445 @@
+/* ========================================================================
+   On-demand JSON document
+
+   Nothing is tokenized up front. A json_lazy_value is just the position
+   of a value's first byte, and lookups walk forward from there one member
+   at a time. Values that aren't asked for are skipped by matching
+   brackets (quotes and escapes aside, no token is ever produced for
+   them), so reading one field costs roughly the bytes in front of it.
+
+   Objects remember where the last lookup stopped, and the next lookup
+   starts there and wraps around, so reading fields in document order
+   (x0, y0, x1, y1) is a single pass over the object. Moving to the next
+   array element carries on from that point too.
+
+   Labels on the way to a lookup are scanned like the tokenizer scans
+   strings, so escaped ones match their decoded text. Skipped values are
+   not validated: a stray '}' inside an unvisited subtree isn't noticed
+   until the bracket count goes wrong.
+   ======================================================================== */
+
+struct json_lazy_document
+{
+    buffer Source;
+    b32 HadError;
+};
+
+struct json_lazy_value
+{
+    json_lazy_document *Document;
+    json_token_type Type; // NOTE: Token_end_of_stream when there is no value (missing member, end of array)
+    u64 At;
+    u64 Resume; // NOTE: Objects only - where the last lookup's member value starts, 0 if none yet
+};
+
+static void LazyError(json_lazy_document *Document, u64 At, char const *Message)
+{
+    // NOTE: One message is enough, everything after the first error is noise
+    if(!Document->HadError)
+    {
+        buffer Source = Document->Source;
+        u64 Count = (At < Source.Count) ? (Source.Count - At) : 0;
+        if(Count > 16)
+        {
+            Count = 16;
+        }
+
+        fprintf(stderr, "ERROR: \"%.*s\" - %s\n", (u32)Count, (char *)Source.Data + At, Message);
+    }
+
+    Document->HadError = true;
+}
+
+inline b32 IsValid(json_lazy_value Value)
+{
+    b32 Result = (Value.Type != Token_end_of_stream) && !Value.Document->HadError;
+    return Result;
+}
+
+static u64 SkipLazyWhitespace(buffer Source, u64 At)
+{
+    while(IsJSONWhitespace(Source, At))
+    {
+        ++At;
+    }
+
+    return At;
+}
+
+// NOTE: At is just past the opening quote. Returns the position of the closing quote, or Source.Count.
+static u64 FindLazyStringEnd(buffer Source, u64 At)
+{
+    u64 Result = Source.Count;
+
+    while(At < Source.Count)
+    {
+        u8 *Quote = (u8 *)memchr(Source.Data + At, '"', Source.Count - At);
+        if(!Quote)
+        {
+            break;
+        }
+
+        // NOTE: The quote is escaped only if an odd number of backslashes run up to it
+        u64 QuoteAt = Quote - Source.Data;
+        u64 BackslashCount = 0;
+        while(((QuoteAt - BackslashCount) > At) && (Source.Data[QuoteAt - BackslashCount - 1] == '\\'))
+        {
+            ++BackslashCount;
+        }
+
+        if((BackslashCount & 1) == 0)
+        {
+            Result = QuoteAt;
+            break;
+        }
+
+        At = QuoteAt + 1;
+    }
+
+    return Result;
+}
+
+// NOTE: Scans from somewhere inside an object or array (not inside a string) that is Depth levels
+// deep, and returns the position just past the bracket that closes the outermost one.
+static u64 SkipLazyContainer(json_lazy_document *Document, u64 At, u32 Depth)
+{
+    buffer Source = Document->Source;
+
+    while(Depth && (At < Source.Count))
+    {
+        switch(Source.Data[At])
+        {
+            case '"': {At = FindLazyStringEnd(Source, At + 1);} break;
+            case '{':
+            case '[': {++Depth;} break;
+            case '}':
+            case ']': {--Depth;} break;
+            default: {} break;
+        }
+
+        ++At;
+    }
+
+    if(Depth)
+    {
+        LazyError(Document, At, "Unterminated object or array");
+        At = Source.Count;
+    }
+
+    return At;
+}
+
+// NOTE: Returns the position just past the value starting at At
+static u64 SkipLazyValue(json_lazy_document *Document, u64 At)
+{
+    buffer Source = Document->Source;
+
+    if(IsInBounds(Source, At))
+    {
+        u8 Val = Source.Data[At];
+        if(Val == '"')
+        {
+            At = FindLazyStringEnd(Source, At + 1);
+            if(IsInBounds(Source, At))
+            {
+                ++At;
+            }
+        }
+        else if((Val == '{') || (Val == '['))
+        {
+            At = SkipLazyContainer(Document, At + 1, 1);
+        }
+        else
+        {
+            // NOTE: Numbers and keywords run until the next separator
+            while(IsInBounds(Source, At))
+            {
+                Val = Source.Data[At];
+                if((Val == ',') || (Val == '}') || (Val == ']') || IsJSONWhitespace(Source, At))
+                {
+                    break;
+                }
+                ++At;
+            }
+        }
+    }
+
+    return At;
+}
+
+static json_lazy_value MakeLazyValue(json_lazy_document *Document, u64 At)
+{
+    json_lazy_value Result = {};
+    Result.Document = Document;
+    Result.At = At;
+    Result.Type = Token_error;
+
+    buffer Source = Document->Source;
+    if(IsInBounds(Source, At))
+    {
+        u8 Val = Source.Data[At];
+        switch(Val)
+        {
+            case '{': {Result.Type = Token_open_brace;} break;
+            case '[': {Result.Type = Token_open_bracket;} break;
+            case '"': {Result.Type = Token_string_literal;} break;
+            case 't': {Result.Type = Token_true;} break;
+            case 'f': {Result.Type = Token_false;} break;
+            case 'n': {Result.Type = Token_null;} break;
+
+            default:
+            {
+                if((Val == '-') || ((Val >= '0') && (Val <= '9')))
+                {
+                    Result.Type = Token_number;
+                }
+            } break;
+        }
+    }
+
+    if(Result.Type == Token_error)
+    {
+        LazyError(Document, At, "Expected a JSON value");
+    }
+
+    return Result;
+}
+
+// NOTE: From a member value at At, moves past it and its comma. Returns the position of the next
+// member, or of the closing brace.
+static u64 FindNextLazyMember(json_lazy_document *Document, u64 At)
+{
+    buffer Source = Document->Source;
+
+    At = SkipLazyWhitespace(Source, SkipLazyValue(Document, At));
+    if(IsInBounds(Source, At) && (Source.Data[At] == ','))
+    {
+        ++At;
+    }
+    else if(!IsInBounds(Source, At) || (Source.Data[At] != '}'))
+    {
+        LazyError(Document, At, "Expected comma or closing brace after member");
+        At = Source.Count;
+    }
+
+    return At;
+}
+
+static json_lazy_document OpenLazyJSON(buffer InputJSON)
+{
+    json_lazy_document Result = {};
+    Result.Source = InputJSON;
+    return Result;
+}
+
+static json_lazy_value GetLazyRoot(json_lazy_document *Document)
+{
+    json_lazy_value Result = MakeLazyValue(Document, SkipLazyWhitespace(Document->Source, 0));
+    return Result;
+}
+
+static json_lazy_value LookupLazyElement(json_lazy_value *Object, json_label_key *Key)
+{
+    json_lazy_value Result = {};
+    Result.Document = Object->Document;
+
+    if(IsValid(*Object) && (Object->Type == Token_open_brace))
+    {
+        json_lazy_document *Document = Object->Document;
+        buffer Source = Document->Source;
+
+        // NOTE: Start after the member the last lookup found, and wrap around to the members before it
+        u64 Resume = Object->Resume;
+        b32 Wrapped = (Resume == 0);
+        u64 At = Wrapped ? (Object->At + 1) : FindNextLazyMember(Document, Resume);
+
+        while(!Document->HadError)
+        {
+            At = SkipLazyWhitespace(Source, At);
+            if(IsInBounds(Source, At) && (Source.Data[At] == '}'))
+            {
+                if(Wrapped)
+                {
+                    break;
+                }
+
+                Wrapped = true;
+                At = Object->At + 1;
+                continue;
+            }
+
+            if(!IsInBounds(Source, At) || (Source.Data[At] != '"'))
+            {
+                LazyError(Document, At, "Expected field name in JSON");
+                break;
+            }
+
+            // NOTE: Labels get the full scan, so they are validated and escaped ones can be compared decoded
+            b32 Escaped;
+            char const *StringError;
+            buffer Label = {};
+            Label.Data = Source.Data + At + 1;
+            At = ScanJSONString(Source, At + 1, &Escaped, &StringError);
+            Label.Count = (Source.Data + At) - Label.Data;
+            if(StringError)
+            {
+                LazyError(Document, At, StringError);
+                break;
+            }
+
+            At = SkipLazyWhitespace(Source, At + 1);
+            if(!IsInBounds(Source, At) || (Source.Data[At] != ':'))
+            {
+                LazyError(Document, At, "Expected colon after field name");
+                break;
+            }
+            At = SkipLazyWhitespace(Source, At + 1);
+
+            b32 Match = Escaped ? IsJSONStringEqual(Label, Escaped, Key->Name) :
+                ((Label.Count == Key->Name.Count) && (GetLabelPrefix(Label) == Key->Prefix) && AreEqual(Label, Key->Name));
+            if(Match)
+            {
+                Result = MakeLazyValue(Document, At);
+                Object->Resume = At;
+                break;
+            }
+
+            if(Wrapped && Resume && (At >= Resume))
+            {
+                // NOTE: Back where this lookup started, and the member there has now been checked too
+                break;
+            }
+
+            At = FindNextLazyMember(Document, At);
+        }
+    }
+
+    return Result;
+}
+
+static json_lazy_value LookupLazyElement(json_lazy_value *Object, buffer ElementName)
+{
+    json_label_key Key = MakeLabelKey(ElementName);
+    json_lazy_value Result = LookupLazyElement(Object, &Key);
+    return Result;
+}
+
+static json_lazy_value GetFirstLazyArrayElement(json_lazy_value Array)
+{
+    json_lazy_value Result = {};
+    Result.Document = Array.Document;
+
+    if(IsValid(Array) && (Array.Type == Token_open_bracket))
+    {
+        buffer Source = Array.Document->Source;
+        u64 At = SkipLazyWhitespace(Source, Array.At + 1);
+        if(!IsInBounds(Source, At) || (Source.Data[At] != ']'))
+        {
+            Result = MakeLazyValue(Array.Document, At);
+        }
+    }
+
+    return Result;
+}
+
+static json_lazy_value GetNextLazyArrayElement(json_lazy_value Element)
+{
+    json_lazy_value Result = {};
+    Result.Document = Element.Document;
+
+    if(IsValid(Element))
+    {
+        json_lazy_document *Document = Element.Document;
+        buffer Source = Document->Source;
+
+        // NOTE: An object that has been looked into only needs skipping from where the lookups got to
+        u64 At = ((Element.Type == Token_open_brace) && Element.Resume) ?
+            SkipLazyContainer(Document, Element.Resume, 1) :
+            SkipLazyValue(Document, Element.At);
+
+        At = SkipLazyWhitespace(Source, At);
+        if(IsInBounds(Source, At) && (Source.Data[At] == ','))
+        {
+            Result = MakeLazyValue(Document, SkipLazyWhitespace(Source, At + 1));
+        }
+        else if(!IsInBounds(Source, At) || (Source.Data[At] != ']'))
+        {
+            LazyError(Document, At, "Expected comma or closing bracket after array element");
+        }
+    }
+
+    return Result;
+}
+
+// NOTE: The text of a scalar - string contents without the quotes (escapes left as they are, see DecodeJSONString),
+// or the number/keyword itself. Empty for objects and arrays.
+static buffer GetLazyValueText(json_lazy_value Value)
+{
+    buffer Result = {};
+
+    if(IsValid(Value) && (Value.Type != Token_open_brace) && (Value.Type != Token_open_bracket))
+    {
+        buffer Source = Value.Document->Source;
+        u64 End = SkipLazyValue(Value.Document, Value.At);
+
+        Result.Data = Source.Data + Value.At;
+        Result.Count = End - Value.At;
+        if(Value.Type == Token_string_literal)
+        {
+            ++Result.Data;
+            Result.Count = (Result.Count >= 2) ? (Result.Count - 2) : 0;
+        }
+    }
+
+    return Result;
+}
+
+static f64 ConvertLazyElementToF64(json_lazy_value *Object, json_label_key *Key)
+{
+    f64 Result = 0.0;
+
+    json_lazy_value Element = LookupLazyElement(Object, Key);
+    if(Element.Type == Token_number)
+    {
+        Result = ConvertJSONValueToF64(GetLazyValueText(Element));
+    }
+
+    return Result;
+}
+
+inline f64 ConvertLazyElementToF64(json_lazy_value *Object, buffer ElementName)
+{
+    json_label_key Key = MakeLabelKey(ElementName);
+    f64 Result = ConvertLazyElementToF64(Object, &Key);
+    return Result;
+}
+
+static u64 ParseHaversinePairsLazy(buffer InputJSON, u64 MaxPairCount, haversine_pair *Pairs)
+{
+    TimeBandwidth(__func__, InputJSON.Count);
+
+    u64 PairCount = 0;
+
+    json_lazy_document Document = OpenLazyJSON(InputJSON);
+    json_lazy_value Root = GetLazyRoot(&Document);
+    json_lazy_value PairsArray = LookupLazyElement(&Root, CONSTANT_STRING("pairs"));
+
+    json_label_key X0 = MakeLabelKey(CONSTANT_STRING("x0"));
+    json_label_key Y0 = MakeLabelKey(CONSTANT_STRING("y0"));
+    json_label_key X1 = MakeLabelKey(CONSTANT_STRING("x1"));
+    json_label_key Y1 = MakeLabelKey(CONSTANT_STRING("y1"));
+
+    for(json_lazy_value Element = GetFirstLazyArrayElement(PairsArray);
+        IsValid(Element) && (PairCount < MaxPairCount);
+        Element = GetNextLazyArrayElement(Element))
+    {
+        haversine_pair *Pair = Pairs + PairCount++;
+
+        Pair->X0 = ConvertLazyElementToF64(&Element, &X0);
+        Pair->Y0 = ConvertLazyElementToF64(&Element, &Y0);
+        Pair->X1 = ConvertLazyElementToF64(&Element, &X1);
+        Pair->Y1 = ConvertLazyElementToF64(&Element, &Y1);
+    }
+
+    return PairCount;
+}
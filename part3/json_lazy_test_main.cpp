@@ -0,0 +1,128 @@
+/* ========================================================================
+   On-demand JSON lookup harness
+
+   Runs a fixed list of lookups against small documents through
+   json_lazy.cpp and checks every result. The haversine input only ever
+   reads fields in order, so these lookups deliberately repeat fields, go
+   out of document order, ask for members that aren't there, and match
+   escaped labels against their decoded text.
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+struct haversine_pair
+{
+    f64 X0, Y0;
+    f64 X1, Y1;
+};
+
+#define TimeFunction
+#define TimeBlock(...)
+#define TimeBandwidth(...)
+
+#include "listing_0125_buffer.cpp"
+#include "listing_0094_profiled_lookup_json_parser.cpp"
+#include "json_lazy.cpp"
+
+struct lazy_lookup_test
+{
+    char const *JSON;
+    char const *Labels[8]; // NOTE: Looked up in this order on the root object, 0-terminated
+    f64 Expected[8]; // NOTE: NAN where the member must come back missing
+};
+
+static lazy_lookup_test LookupTests[] =
+{
+    {"{\"a\":1,\"b\":2,\"c\":3}", {"a", "a", "c", "b", "zz", "b"}, {1, 1, 3, 2, NAN, 2}},
+    {"{\"only\":5}", {"only", "only", "zz", "only"}, {5, 5, NAN, 5}},
+    {"{\"x0\":1,\"y0\":2,\"x1\":3,\"y1\":4}", {"x0", "y0", "x1", "y1", "y1", "x0"}, {1, 2, 3, 4, 4, 1}},
+    {"{\"x0\":1,\"y0\":2,\"x1\":3,\"y1\":4}", {"y1", "x1", "y0", "x0", "zz", "zz"}, {4, 3, 2, 1, NAN, NAN}},
+    {"{ \"a\" : [1, {\"b\":2}] , \"b\" : 7 }", {"b", "b", "zz", "b"}, {7, 7, NAN, 7}},
+    {"{}", {"a", "a"}, {NAN, NAN}},
+    {"{\"x\\u0030\":1,\"\\u0079\\u0030\":2,\"x\\n\":3}", {"x0", "y0", "x0", "x\n", "x"}, {1, 2, 1, 3, NAN}},
+};
+
+static b32 RunLookupTest(lazy_lookup_test *Test)
+{
+    b32 Result = true;
+
+    buffer Source = {};
+    Source.Data = (u8 *)Test->JSON;
+    Source.Count = strlen(Test->JSON);
+
+    json_lazy_document Document = OpenLazyJSON(Source);
+    json_lazy_value Root = GetLazyRoot(&Document);
+
+    for(u32 Index = 0; (Index < ArrayCount(Test->Labels)) && Test->Labels[Index]; ++Index)
+    {
+        char const *Label = Test->Labels[Index];
+        buffer Name = {};
+        Name.Data = (u8 *)Label;
+        Name.Count = strlen(Label);
+
+        json_lazy_value Element = LookupLazyElement(&Root, Name);
+
+        f64 Expected = Test->Expected[Index];
+        b32 Passed;
+        f64 Value = NAN;
+        if(isnan(Expected))
+        {
+            // NOTE: Containers count as found, so missing means no value at all
+            Passed = !IsValid(Element) && !Document.HadError;
+        }
+        else
+        {
+            Value = (Element.Type == Token_number) ? ConvertJSONValueToF64(GetLazyValueText(Element)) : NAN;
+            Passed = (Value == Expected);
+        }
+
+        if(!Passed)
+        {
+            fprintf(stderr, "FAILED: %s lookup %u (\"%s\"): got %f, expected %f\n",
+                    Test->JSON, Index, Label, Value, Expected);
+            Result = false;
+        }
+    }
+
+    return Result;
+}
+
+int main(void)
+{
+    // NOTE: Only the lookups are under test, the rest of the parser comes along with the include
+    (void)&ParseHaversinePairs;
+    (void)&ParseHaversinePairsLazy;
+
+    u32 FailedCount = 0;
+    for(u32 TestIndex = 0; TestIndex < ArrayCount(LookupTests); ++TestIndex)
+    {
+        if(!RunLookupTest(LookupTests + TestIndex))
+        {
+            ++FailedCount;
+        }
+    }
+
+    printf("Lazy lookup tests: %u of %u passed\n", (u32)ArrayCount(LookupTests) - FailedCount, (u32)ArrayCount(LookupTests));
+
+    return FailedCount ? 1 : 0;
+}
@@ -0,0 +1,343 @@
+/* ========================================================================
+   Exact JSON number conversion
+
+   Digits are gathered into a u64 mantissa (eight at a time with SWAR when
+   eight digits are available) plus a decimal exponent, and the pair is
+   turned into the correctly rounded f64:
+
+   - mantissa <= 2^53 and |exponent| <= 22: both are exact doubles, so one
+     multiply or divide rounds correctly (Clinger's fast path).
+   - otherwise, Eisel-Lemire: multiply by a 128-bit power of five and read
+     the rounded mantissa off the top bits.
+   - anything those can't settle (more than 19 significant digits,
+     subnormal or overflowing results, malformed text) goes to strtod.
+
+   The old digit-by-digit f64 accumulation in listing 94 is kept as
+   ConvertJSONValueToF64Naive so json_number_test_main can compare them.
+   ======================================================================== */
+
+#if _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "json_number_pow5.cpp"
+
+struct json_u128
+{
+    u64 Low;
+    u64 High;
+};
+
+// NOTE: What the digit scan found. Exponent is the decimal exponent of Mantissa's last digit.
+struct json_decimal
+{
+    u64 Mantissa;
+    int64_t Exponent;
+    b32 Negative;
+    b32 TooManyDigits; // NOTE: More than 19 significant digits, Mantissa is not usable
+    b32 Malformed;
+};
+
+inline json_u128 Multiply64To128(u64 A, u64 B)
+{
+    json_u128 Result;
+#if _MSC_VER
+    Result.Low = _umul128(A, B, &Result.High);
+#else
+    unsigned __int128 Product = (unsigned __int128)A*B;
+    Result.Low = (u64)Product;
+    Result.High = (u64)(Product >> 64);
+#endif
+    return Result;
+}
+
+inline u32 CountLeadingZeros64(u64 Value)
+{
+    // NOTE: Value is never 0 here
+#if _MSC_VER
+    unsigned long Index;
+    _BitScanReverse64(&Index, Value);
+    u32 Result = 63 - Index;
+#else
+    u32 Result = __builtin_clzll(Value);
+#endif
+    return Result;
+}
+
+inline b32 IsEightDigits(u64 Chunk)
+{
+    // NOTE: Every byte must be 0x30-0x39: high nibble 3, and adding 6 must not carry into the high nibble
+    b32 Result = ((((Chunk & 0xF0F0F0F0F0F0F0F0ull) |
+                    (((Chunk + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4))) == 0x3333333333333333ull);
+    return Result;
+}
+
+inline u32 ParseEightDigits(u64 Chunk)
+{
+    // NOTE: Little-endian, so the first digit is the low byte. Pairs, then quads, then the whole eight.
+    Chunk -= 0x3030303030303030ull;
+    Chunk = (Chunk*10) + (Chunk >> 8);
+    Chunk = (((Chunk & 0x000000FF000000FFull)*(100 + (1000000ull << 32))) +
+             (((Chunk >> 16) & 0x000000FF000000FFull)*(1 + (10000ull << 32)))) >> 32;
+
+    u32 Result = (u32)Chunk;
+    return Result;
+}
+
+static u64 ScanJSONDigits(buffer Source, u64 *AtResult, u64 Mantissa)
+{
+    u64 At = *AtResult;
+
+    while((At + 8) <= Source.Count)
+    {
+        u64 Chunk;
+        memcpy(&Chunk, Source.Data + At, sizeof(Chunk));
+        if(!IsEightDigits(Chunk))
+        {
+            break;
+        }
+
+        // NOTE: Wraps past 19 digits, but then TooManyDigits throws the mantissa away anyway
+        Mantissa = Mantissa*100000000 + ParseEightDigits(Chunk);
+        At += 8;
+    }
+
+    while(At < Source.Count)
+    {
+        u8 Digit = Source.Data[At] - (u8)'0';
+        if(Digit >= 10)
+        {
+            break;
+        }
+
+        Mantissa = Mantissa*10 + Digit;
+        ++At;
+    }
+
+    *AtResult = At;
+
+    return Mantissa;
+}
+
+static json_decimal ScanJSONDecimal(buffer Source)
+{
+    json_decimal Result = {};
+
+    u64 At = 0;
+    if((At < Source.Count) && (Source.Data[At] == '-'))
+    {
+        Result.Negative = true;
+        ++At;
+    }
+
+    u64 IntegerStart = At;
+    Result.Mantissa = ScanJSONDigits(Source, &At, 0);
+    u64 DigitCount = At - IntegerStart;
+
+    if((At < Source.Count) && (Source.Data[At] == '.'))
+    {
+        ++At;
+        u64 FractionStart = At;
+        Result.Mantissa = ScanJSONDigits(Source, &At, Result.Mantissa);
+        Result.Exponent = -(int64_t)(At - FractionStart);
+        DigitCount += At - FractionStart;
+    }
+
+    Result.Malformed = (DigitCount == 0);
+
+    if((At < Source.Count) && ((Source.Data[At] == 'e') || (Source.Data[At] == 'E')))
+    {
+        ++At;
+
+        b32 NegativeExponent = false;
+        if((At < Source.Count) && ((Source.Data[At] == '+') || (Source.Data[At] == '-')))
+        {
+            NegativeExponent = (Source.Data[At] == '-');
+            ++At;
+        }
+
+        u64 ExponentStart = At;
+        int64_t Exponent = 0;
+        while((At < Source.Count) && ((u8)(Source.Data[At] - '0') < 10))
+        {
+            // NOTE: Far past any f64 either way, so stop growing before it could overflow
+            if(Exponent < 100000)
+            {
+                Exponent = Exponent*10 + (Source.Data[At] - '0');
+            }
+            ++At;
+        }
+
+        Result.Malformed |= (At == ExponentStart);
+        Result.Exponent += NegativeExponent ? -Exponent : Exponent;
+    }
+
+    // NOTE: Trailing junk means the token wasn't a plain number; strtod decides what it's worth
+    Result.Malformed |= (At != Source.Count);
+
+    if(DigitCount > 19)
+    {
+        // NOTE: Leading zeros (0.000...) don't count against the 19 digits a u64 can hold
+        u64 Significant = DigitCount;
+        for(u64 Index = IntegerStart; Index < Source.Count; ++Index)
+        {
+            u8 Char = Source.Data[Index];
+            if(Char == '0')
+            {
+                --Significant;
+            }
+            else if(Char != '.')
+            {
+                break;
+            }
+        }
+
+        Result.TooManyDigits = (Significant > 19);
+    }
+
+    return Result;
+}
+
+// NOTE: Returns false if the result would be subnormal or infinite, which the caller leaves to strtod
+static b32 ComputeF64EiselLemire(u64 Mantissa, int64_t Exponent10, f64 *Result)
+{
+    b32 Handled = false;
+
+    if(Exponent10 < JSON_POW5_MIN_EXPONENT)
+    {
+        // NOTE: Even 19 nines times 10^-343 is far below the smallest subnormal
+        *Result = 0.0;
+        Handled = true;
+    }
+    else if(Exponent10 <= JSON_POW5_MAX_EXPONENT)
+    {
+        u32 LeadingZeros = CountLeadingZeros64(Mantissa);
+        Mantissa <<= LeadingZeros;
+
+        // NOTE: The second word is only needed when the bits below the 55 we keep are all ones
+        // and a carry could still ripple up. Mushtak and Lemire show this is always enough.
+        u64 const *Pow5 = JSONPow5Table[Exponent10 - JSON_POW5_MIN_EXPONENT];
+        json_u128 Product = Multiply64To128(Mantissa, Pow5[0]);
+        u64 const PrecisionMask = 0xFFFFFFFFFFFFFFFFull >> 55;
+        if((Product.High & PrecisionMask) == PrecisionMask)
+        {
+            json_u128 Second = Multiply64To128(Mantissa, Pow5[1]);
+            Product.Low += Second.High;
+            if(Second.High > Product.Low)
+            {
+                ++Product.High;
+            }
+        }
+
+        u32 UpperBit = (u32)(Product.High >> 63);
+        u32 Shift = UpperBit + 64 - 52 - 3;
+        u64 Bits = Product.High >> Shift;
+
+        // NOTE: floor(log2(10^q)) + 63, then rebias for the f64 exponent field
+        int64_t Power2 = (((152170 + 65536)*Exponent10) >> 16) + 63 + UpperBit - LeadingZeros + 1023;
+        if(Power2 > 0)
+        {
+            // NOTE: An exact halfway case can only come from a power of five that fits in 64 bits;
+            // round it to even instead of up
+            if((Product.Low <= 1) && (Exponent10 >= -4) && (Exponent10 <= 23) && ((Bits & 3) == 1) &&
+               ((Bits << Shift) == Product.High))
+            {
+                Bits &= ~1ull;
+            }
+
+            Bits += (Bits & 1);
+            Bits >>= 1;
+            if(Bits >= (2ull << 52))
+            {
+                Bits = (1ull << 52);
+                ++Power2;
+            }
+            Bits &= ~(1ull << 52);
+
+            if(Power2 < 0x7FF)
+            {
+                u64 F64Bits = Bits | ((u64)Power2 << 52);
+                memcpy(Result, &F64Bits, sizeof(*Result));
+                Handled = true;
+            }
+        }
+    }
+
+    return Handled;
+}
+
+static f64 ConvertJSONValueWithStrtod(buffer Source)
+{
+    char Local[128];
+    char *Text = Local;
+    if(Source.Count >= sizeof(Local))
+    {
+        Text = (char *)malloc(Source.Count + 1);
+    }
+
+    f64 Result = 0.0;
+    if(Text)
+    {
+        memcpy(Text, Source.Data, Source.Count);
+        Text[Source.Count] = 0;
+        Result = strtod(Text, 0);
+
+        if(Text != Local)
+        {
+            free(Text);
+        }
+    }
+
+    return Result;
+}
+
+static f64 ConvertJSONValueToF64(buffer Source)
+{
+    // NOTE: 10^0 through 10^22 are exact in an f64
+    static f64 const ExactPowersOf10[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    json_decimal Decimal = ScanJSONDecimal(Source);
+
+    f64 Result = 0.0;
+    b32 Handled = false;
+    if(!Decimal.Malformed && !Decimal.TooManyDigits)
+    {
+        if(Decimal.Mantissa == 0)
+        {
+            Handled = true;
+        }
+        else if((Decimal.Mantissa <= (1ull << 53)) && (Decimal.Exponent >= -22) && (Decimal.Exponent <= 22))
+        {
+            Result = (f64)Decimal.Mantissa;
+            if(Decimal.Exponent < 0)
+            {
+                Result /= ExactPowersOf10[-Decimal.Exponent];
+            }
+            else
+            {
+                Result *= ExactPowersOf10[Decimal.Exponent];
+            }
+            Handled = true;
+        }
+        else
+        {
+            Handled = ComputeF64EiselLemire(Decimal.Mantissa, Decimal.Exponent, &Result);
+        }
+
+        if(Decimal.Negative)
+        {
+            Result = -Result;
+        }
+    }
+
+    if(!Handled)
+    {
+        Result = ConvertJSONValueWithStrtod(Source);
+    }
+
+    return Result;
+}
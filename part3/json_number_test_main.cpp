@@ -0,0 +1,306 @@
+/* ========================================================================
+   JSON number conversion harness
+
+   Converts several sets of number strings with the original listing 94
+   routine, the exact converter from json_number.cpp, and strtod. Every
+   result is checked bit for bit against strtod (which glibc and the MSVC
+   CRT both round correctly), then each converter is timed with the
+   repetition tester in cycles per number.
+   ======================================================================== */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef int32_t b32;
+
+typedef float f32;
+typedef double f64;
+
+#define ArrayCount(Array) (sizeof(Array)/sizeof((Array)[0]))
+
+struct haversine_pair
+{
+    f64 X0, Y0;
+    f64 X1, Y1;
+};
+
+// NOTE: The parser's profile blocks compile away here, the repetition tester does the timing
+#define TimeFunction
+#define TimeBlock(...)
+#define TimeBandwidth(...)
+
+#include "listing_0125_buffer.cpp"
+#include "listing_0137_os_platform.cpp"
+#include "listing_0109_pagefault_repetition_tester.cpp"
+#include "listing_0094_profiled_lookup_json_parser.cpp"
+
+typedef f64 number_converter(buffer Source);
+
+enum number_set_type
+{
+    NumberSet_Coordinates,
+    NumberSet_RandomDoubles,
+    NumberSet_ShortDecimals,
+    NumberSet_LongMantissas,
+
+    NumberSet_Count,
+};
+
+struct number_converter_test
+{
+    char const *Name;
+    number_converter *Converter;
+};
+
+struct number_set
+{
+    buffer Text; // NOTE: Every number is 0-terminated so strtod can run on it in place
+    buffer *Numbers;
+    f64 *Expected;
+    u64 TextByteCount;
+};
+
+// NOTE: strtod straight on the 0-terminated text, no copy
+static f64 ConvertWithStrtod(buffer Source) {return strtod((char *)Source.Data, 0);}
+
+static number_converter_test ConverterTests[] =
+{
+    {"listing 94", ConvertJSONValueToF64Naive},
+    {"exact", ConvertJSONValueToF64},
+    {"strtod", ConvertWithStrtod},
+};
+
+#define ErrorNumberCount (1ull << 20)
+#define TimingNumberCount 4096
+#define MaxNumberTextSize 64
+
+static f64 volatile GlobalResultSink;
+
+static u64 RandomU64(u64 *State)
+{
+    // NOTE: xorshift64*
+    u64 X = *State;
+    X ^= X >> 12;
+    X ^= X << 25;
+    X ^= X >> 27;
+    *State = X;
+    return X*0x2545F4914F6CDD1Dull;
+}
+
+static f64 RandomF64(u64 *State, f64 Min, f64 Max)
+{
+    f64 T = (f64)(RandomU64(State) >> 11) * (1.0 / (f64)(1ull << 53));
+    f64 Result = Min + T*(Max - Min);
+    return Result;
+}
+
+static char const *DescribeNumberSet(number_set_type Type)
+{
+    char const *Result;
+    switch(Type)
+    {
+        case NumberSet_Coordinates: {Result = "generator coordinates (%.16f)";} break;
+        case NumberSet_RandomDoubles: {Result = "random f64 bit patterns (%.17g)";} break;
+        case NumberSet_ShortDecimals: {Result = "short decimals (0-6 fraction digits)";} break;
+        case NumberSet_LongMantissas: {Result = "long mantissas (%.25e, > 19 digits)";} break;
+        default : {Result = "UNKNOWN";} break;
+    }
+
+    return Result;
+}
+
+static u32 FormatNumber(number_set_type Type, u64 *State, char *Dest)
+{
+    int Count = 0;
+    switch(Type)
+    {
+        case NumberSet_Coordinates:
+        {
+            Count = snprintf(Dest, MaxNumberTextSize, "%.16f", RandomF64(State, -180.0, 180.0));
+        } break;
+
+        case NumberSet_RandomDoubles:
+        {
+            f64 Value;
+            do
+            {
+                u64 Bits = RandomU64(State);
+                memcpy(&Value, &Bits, sizeof(Value));
+            } while(!isfinite(Value));
+
+            Count = snprintf(Dest, MaxNumberTextSize, "%.17g", Value);
+        } break;
+
+        case NumberSet_ShortDecimals:
+        {
+            u32 FractionDigits = (u32)(RandomU64(State) % 7);
+            f64 Value = (f64)(RandomU64(State) % 10000000) / pow(10.0, FractionDigits);
+            Count = snprintf(Dest, MaxNumberTextSize, "%.*f", FractionDigits, Value);
+        } break;
+
+        case NumberSet_LongMantissas:
+        {
+            Count = snprintf(Dest, MaxNumberTextSize, "%.25e", RandomF64(State, -1e6, 1e6));
+        } break;
+
+        default: break;
+    }
+
+    u32 Result = (Count > 0) ? (u32)Count : 0;
+    return Result;
+}
+
+static number_set MakeNumberSet(number_set_type Type, u64 Count)
+{
+    number_set Result = {};
+    Result.Text = AllocateBuffer(Count*MaxNumberTextSize);
+    Result.Numbers = (buffer *)malloc(Count*sizeof(buffer));
+    Result.Expected = (f64 *)malloc(Count*sizeof(f64));
+
+    if(IsValid(Result.Text) && Result.Numbers && Result.Expected)
+    {
+        u64 State = 0x9E3779B97F4A7C15ull + Type;
+        char *At = (char *)Result.Text.Data;
+        for(u64 Index = 0; Index < Count; ++Index)
+        {
+            u32 Size = FormatNumber(Type, &State, At);
+
+            Result.Numbers[Index].Data = (u8 *)At;
+            Result.Numbers[Index].Count = Size;
+            Result.Expected[Index] = strtod(At, 0);
+            Result.TextByteCount += Size;
+
+            At += Size + 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unable to allocate number set\n");
+        FreeBuffer(&Result.Text);
+    }
+
+    return Result;
+}
+
+static void FreeNumberSet(number_set *Set)
+{
+    FreeBuffer(&Set->Text);
+    free(Set->Numbers);
+    free(Set->Expected);
+    *Set = {};
+}
+
+static void MeasureExactness(number_converter *Converter, number_set *Set, u64 Count)
+{
+    u64 MismatchCount = 0;
+    f64 MaxULPError = 0;
+    char const *Worst = "";
+
+    for(u64 Index = 0; Index < Count; ++Index)
+    {
+        f64 Value = Converter(Set->Numbers[Index]);
+        f64 Expected = Set->Expected[Index];
+        if(memcmp(&Value, &Expected, sizeof(Value)) != 0)
+        {
+            ++MismatchCount;
+
+            f64 A = fabs(Expected);
+            f64 ULP = nextafter(A, INFINITY) - A;
+            f64 ULPError = fabs(Value - Expected) / ULP;
+            if(!(ULPError <= MaxULPError))
+            {
+                MaxULPError = ULPError;
+                Worst = (char *)Set->Numbers[Index].Data;
+            }
+        }
+    }
+
+    printf("Mismatches vs. strtod: %llu of %llu", MismatchCount, Count);
+    if(MismatchCount)
+    {
+        printf(" (worst %.3g ulp on %s)", MaxULPError, Worst);
+    }
+    printf("\n");
+}
+
+static void TimeConverter(repetition_tester *Tester, number_converter *Converter, number_set *Set, u64 ByteCount)
+{
+    f64 Sum = 0;
+    while(IsTesting(Tester))
+    {
+        BeginTime(Tester);
+        for(u32 Index = 0; Index < TimingNumberCount; ++Index)
+        {
+            Sum += Converter(Set->Numbers[Index]);
+        }
+        EndTime(Tester);
+
+        CountBytes(Tester, ByteCount);
+    }
+
+    GlobalResultSink = Sum;
+}
+
+int main(int ArgCount, char **Args)
+{
+    // NOTE: Only the number converters are under test, the rest of the parser comes along with the include
+    (void)&ParseHaversinePairs;
+
+    InitializeOSPlatform();
+
+    u32 SecondsToTry = 2;
+    if(ArgCount == 2)
+    {
+        SecondsToTry = atoi(Args[1]);
+    }
+
+    if((ArgCount > 2) || (SecondsToTry == 0))
+    {
+        fprintf(stderr, "Usage: %s [seconds to try per test]\n", Args[0]);
+        return 1;
+    }
+
+    for(u32 SetType = 0; SetType < NumberSet_Count; ++SetType)
+    {
+        number_set Set = MakeNumberSet((number_set_type)SetType, ErrorNumberCount);
+        if(IsValid(Set.Text))
+        {
+            u64 TimingByteCount = 0;
+            for(u32 Index = 0; Index < TimingNumberCount; ++Index)
+            {
+                TimingByteCount += Set.Numbers[Index].Count;
+            }
+
+            for(u32 TestIndex = 0; TestIndex < ArrayCount(ConverterTests); ++TestIndex)
+            {
+                number_converter_test *Test = ConverterTests + TestIndex;
+
+                printf("\n--- %s: %s ---\n", Test->Name, DescribeNumberSet((number_set_type)SetType));
+                MeasureExactness(Test->Converter, &Set, ErrorNumberCount);
+
+                repetition_tester Tester = {};
+                NewTestWave(&Tester, TimingByteCount, GetCPUTimerFreq(), SecondsToTry);
+                TimeConverter(&Tester, Test->Converter, &Set, TimingByteCount);
+
+                f64 MinCycles = (f64)Tester.Results.Min.E[RepValue_CPUTimer];
+                printf("%.2f cycles/number\n", MinCycles / (f64)TimingNumberCount);
+            }
+        }
+
+        FreeNumberSet(&Set);
+    }
+
+    return 0;
+}
@@ -0,0 +1,224 @@
+/* ========================================================================
+   Streaming haversine pair extractor
+
+   Walks the token stream from GetJSONToken directly and hands back one
+   haversine_pair per closed object in the "pairs" array. No json_element
+   tree is built and no labels are looked up afterwards, so memory use does
+   not depend on the input size.
+   ======================================================================== */
+
+struct haversine_pair_stream
+{
+    json_parser Parser;
+    b32 InPairsArray;
+    b32 Finished;
+    b32 IsChunk; // NOTE: A chunk of the pairs array just runs out, there's no closing bracket
+};
+
+static b32 IsJSONLabel(json_token Token, char const *Label)
+{
+    buffer LabelBuffer = {strlen(Label), (u8 *)Label};
+    b32 Result = (Token.Type == Token_string_literal) && IsJSONStringEqual(Token.Value, Token.Escaped, LabelBuffer);
+    return Result;
+}
+
+// NOTE: Consumes the rest of a value whose first token has already been read,
+// including any nested objects/arrays.
+static void SkipJSONValue(json_parser *Parser, json_token First)
+{
+    if((First.Type == Token_open_brace) || (First.Type == Token_open_bracket))
+    {
+        u32 Depth = 1;
+        while(Depth && IsParsing(Parser))
+        {
+            json_token Token = GetJSONToken(Parser);
+            if((Token.Type == Token_open_brace) || (Token.Type == Token_open_bracket))
+            {
+                ++Depth;
+            }
+            else if((Token.Type == Token_close_brace) || (Token.Type == Token_close_bracket))
+            {
+                --Depth;
+            }
+            else if(Token.Type == Token_error)
+            {
+                Error(Parser, Token, "Unexpected token in JSON");
+            }
+        }
+    }
+}
+
+// NOTE: Maps "x0"/"y0"/"x1"/"y1" onto the haversine_pair member order, or -1
+static int GetPairFieldIndex(json_token Label)
+{
+    int Result = -1;
+    buffer Name = Label.Value;
+
+    // NOTE: Two decoded bytes can take at most 12 escaped ones (\u0078\u0030), anything longer is some other label
+    u8 Decoded[12];
+    if(Label.Escaped)
+    {
+        if(Name.Count <= sizeof(Decoded))
+        {
+            Name = DecodeJSONString(Name, Decoded);
+        }
+        else
+        {
+            Name.Count = 0;
+        }
+    }
+
+    if(Name.Count == 2)
+    {
+        u8 Axis = Name.Data[0];
+        u8 Point = Name.Data[1];
+        if(((Axis == 'x') || (Axis == 'y')) && ((Point == '0') || (Point == '1')))
+        {
+            Result = (Axis == 'y') + 2*(Point == '1');
+        }
+    }
+
+    return Result;
+}
+
+static haversine_pair_stream BeginHaversinePairStream(buffer InputJSON, json_structural_indexer *Indexer = 0)
+{
+    haversine_pair_stream Stream = {};
+    Stream.Parser.Source = InputJSON;
+    Stream.Parser.Indexer = Indexer;
+
+    json_parser *Parser = &Stream.Parser;
+
+    json_token Open = GetJSONToken(Parser);
+    if(Open.Type == Token_open_brace)
+    {
+        // NOTE: Skip over top-level members until we hit "pairs": [
+        while(IsParsing(Parser) && !Stream.InPairsArray)
+        {
+            json_token Label = GetJSONToken(Parser);
+            json_token Colon = GetJSONToken(Parser);
+            if((Label.Type != Token_string_literal) || (Colon.Type != Token_colon))
+            {
+                Error(Parser, Label, "Expected field name in JSON");
+                break;
+            }
+
+            json_token Value = GetJSONToken(Parser);
+            if(IsJSONLabel(Label, "pairs") && (Value.Type == Token_open_bracket))
+            {
+                Stream.InPairsArray = true;
+            }
+            else
+            {
+                SkipJSONValue(Parser, Value);
+
+                json_token Comma = GetJSONToken(Parser);
+                if(Comma.Type != Token_comma)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        Error(Parser, Open, "Expected open brace at start of JSON");
+    }
+
+    Stream.Finished = !Stream.InPairsArray;
+
+    return Stream;
+}
+
+static b32 NextHaversinePair(haversine_pair_stream *Stream, haversine_pair *Pair)
+{
+    b32 Result = false;
+    json_parser *Parser = &Stream->Parser;
+
+    if(!Stream->Finished && IsParsing(Parser))
+    {
+        json_token Open = GetJSONToken(Parser);
+        if(Open.Type == Token_comma)
+        {
+            Open = GetJSONToken(Parser);
+        }
+
+        if(Open.Type == Token_open_brace)
+        {
+            f64 Values[4] = {};
+
+            while(IsParsing(Parser))
+            {
+                json_token Label = GetJSONToken(Parser);
+                if(Label.Type == Token_close_brace)
+                {
+                    break;
+                }
+
+                json_token Colon = GetJSONToken(Parser);
+                if((Label.Type != Token_string_literal) || (Colon.Type != Token_colon))
+                {
+                    Error(Parser, Label, "Expected field name in pair object");
+                    break;
+                }
+
+                json_token Value = GetJSONToken(Parser);
+                int FieldIndex = GetPairFieldIndex(Label);
+                if((FieldIndex >= 0) && (Value.Type == Token_number))
+                {
+                    Values[FieldIndex] = ConvertJSONValueToF64(Value.Value);
+                }
+                else
+                {
+                    SkipJSONValue(Parser, Value);
+                }
+
+                json_token Separator = GetJSONToken(Parser);
+                if(Separator.Type == Token_close_brace)
+                {
+                    break;
+                }
+                else if(Separator.Type != Token_comma)
+                {
+                    Error(Parser, Separator, "Unexpected token in pair object");
+                }
+            }
+
+            if(!Parser->HadError)
+            {
+                Pair->X0 = Values[0];
+                Pair->Y0 = Values[1];
+                Pair->X1 = Values[2];
+                Pair->Y1 = Values[3];
+                Result = true;
+            }
+        }
+        else if((Open.Type != Token_close_bracket) && !(Stream->IsChunk && (Open.Type == Token_end_of_stream)))
+        {
+            Error(Parser, Open, "Unexpected token in pairs array");
+        }
+    }
+
+    if(!Result)
+    {
+        Stream->Finished = true;
+    }
+
+    return Result;
+}
+
+static u64 ParseHaversinePairsStreaming(buffer InputJSON, u64 MaxPairCount, haversine_pair *Pairs,
+                                        json_structural_indexer *Indexer = 0)
+{
+    TimeBandwidth(__func__, InputJSON.Count);
+
+    u64 PairCount = 0;
+
+    haversine_pair_stream Stream = BeginHaversinePairStream(InputJSON, Indexer);
+    while((PairCount < MaxPairCount) && NextHaversinePair(&Stream, Pairs + PairCount))
+    {
+        ++PairCount;
+    }
+
+    return PairCount;
+}
@@ -0,0 +1,188 @@
+/* ========================================================================
+   Parallel haversine pair parser
+
+   The generator writes one pair object per line, so the input can be cut
+   into one chunk per thread without a full parse: each cut is moved
+   forward to the next '{' that opens a pair (the next {"x0"), and every
+   chunk after the first is then an independent run of pair objects.
+   Chunks are parsed with the streaming extractor into their own pair
+   arrays and stitched back together in input order, so the result
+   matches the serial parse.
+
+   NOTE: Cuts only land on pairs that start with "x0", which is what both
+   generators write; other pairs just stay in the chunk before them. This
+   does assume nothing outside the pairs array looks like a pair.
+   ======================================================================== */
+
+#include "thread_pool.cpp"
+
+struct pair_parse_chunk
+{
+    buffer Source;
+    json_index_isa IndexISA;
+
+    u64 MaxPairCount;
+    haversine_pair *Pairs;
+    u64 PairCount;
+    b32 HadError;
+};
+
+static u64 FindPairBoundary(buffer Source, u64 At)
+{
+    buffer X0 = CONSTANT_STRING("\"x0\"");
+
+    u64 Result = Source.Count;
+    while(At < Source.Count)
+    {
+        u8 *Brace = (u8 *)memchr(Source.Data + At, '{', Source.Count - At);
+        if(!Brace)
+        {
+            break;
+        }
+
+        u64 BraceAt = Brace - Source.Data;
+        u64 LabelAt = BraceAt + 1;
+        while(IsJSONWhitespace(Source, LabelAt))
+        {
+            ++LabelAt;
+        }
+
+        buffer Label = {X0.Count, Source.Data + LabelAt};
+        if(((Source.Count - LabelAt) >= X0.Count) && AreEqual(Label, X0))
+        {
+            Result = BraceAt;
+            break;
+        }
+
+        At = BraceAt + 1;
+    }
+
+    return Result;
+}
+
+static void ParsePairChunk(void *Data, u32 TaskIndex)
+{
+    pair_parse_chunk *Chunk = (pair_parse_chunk *)Data + TaskIndex;
+    TimeBandwidth("Parse chunk", Chunk->Source.Count);
+
+    // NOTE: Every chunk starts outside any string, so each one can be indexed on its own
+    json_structural_indexer IndexerStorage = {};
+    json_structural_indexer *Indexer = 0;
+    if(Chunk->IndexISA != IndexISA_None)
+    {
+        IndexerStorage = CreateStructuralIndexer(Chunk->Source, Chunk->IndexISA);
+        if(IndexerStorage.Positions)
+        {
+            Indexer = &IndexerStorage;
+        }
+    }
+
+    haversine_pair_stream Stream = {};
+    if(TaskIndex == 0)
+    {
+        // NOTE: The first chunk starts at the top of the file, so it finds "pairs" the normal way
+        Stream = BeginHaversinePairStream(Chunk->Source, Indexer);
+    }
+    else
+    {
+        Stream.Parser.Source = Chunk->Source;
+        Stream.Parser.Indexer = Indexer;
+        Stream.InPairsArray = true;
+    }
+    Stream.IsChunk = true;
+
+    while((Chunk->PairCount < Chunk->MaxPairCount) && NextHaversinePair(&Stream, Chunk->Pairs + Chunk->PairCount))
+    {
+        ++Chunk->PairCount;
+    }
+    Chunk->HadError = Stream.Parser.HadError;
+
+    FreeStructuralIndexer(&IndexerStorage);
+}
+
+static u64 ParseHaversinePairsParallel(thread_pool *Pool, buffer InputJSON, u64 MaxPairCount, haversine_pair *Pairs,
+                                       json_index_isa IndexISA = IndexISA_None)
+{
+    TimeBandwidth(__func__, InputJSON.Count);
+
+    u32 ChunkCount = Pool->ThreadCount;
+    buffer ChunkMemory = AllocateBuffer(ChunkCount*sizeof(pair_parse_chunk));
+    pair_parse_chunk *Chunks = (pair_parse_chunk *)ChunkMemory.Data;
+
+    u64 PairCount = 0;
+    if(Chunks)
+    {
+        b32 Allocated = true;
+
+        {
+            TimeBlock("Split chunks");
+
+            u64 ChunkStart = 0;
+            for(u32 ChunkIndex = 0; ChunkIndex < ChunkCount; ++ChunkIndex)
+            {
+                u64 ChunkEnd = InputJSON.Count;
+                if((ChunkIndex + 1) < ChunkCount)
+                {
+                    u64 Cut = (InputJSON.Count / ChunkCount) * (ChunkIndex + 1);
+                    ChunkEnd = FindPairBoundary(InputJSON, (Cut > ChunkStart) ? Cut : ChunkStart);
+                }
+
+                // NOTE: The chunk array comes straight from malloc, and PairCount is counted up from here
+                pair_parse_chunk *Chunk = Chunks + ChunkIndex;
+                *Chunk = {};
+                Chunk->Source.Data = InputJSON.Data + ChunkStart;
+                Chunk->Source.Count = ChunkEnd - ChunkStart;
+                Chunk->IndexISA = IndexISA;
+
+                // NOTE: Same bound the caller uses for the whole input (6 values of at least 4 bytes)
+                Chunk->MaxPairCount = Chunk->Source.Count / (6*4) + 1;
+                Chunk->Pairs = (haversine_pair *)malloc(Chunk->MaxPairCount*sizeof(haversine_pair));
+                Allocated = Allocated && Chunk->Pairs;
+
+                ChunkStart = ChunkEnd;
+            }
+        }
+
+        if(Allocated)
+        {
+            TimeBlock("Parse chunks");
+            RunTasks(Pool, ChunkCount, ParsePairChunk, Chunks);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Unable to allocate per-thread pair arrays\n");
+        }
+
+        {
+            TimeBlock("Stitch chunks");
+
+            b32 HadError = false;
+            for(u32 ChunkIndex = 0; ChunkIndex < ChunkCount; ++ChunkIndex)
+            {
+                pair_parse_chunk *Chunk = Chunks + ChunkIndex;
+                HadError = HadError || Chunk->HadError;
+
+                u64 CopyCount = Chunk->PairCount;
+                if(CopyCount > (MaxPairCount - PairCount))
+                {
+                    CopyCount = MaxPairCount - PairCount;
+                }
+
+                memcpy(Pairs + PairCount, Chunk->Pairs, CopyCount*sizeof(haversine_pair));
+                PairCount += CopyCount;
+
+                free(Chunk->Pairs);
+            }
+
+            // NOTE: A chunk that hit an error just stops, so the pairs from the other chunks don't add up to the input
+            if(HadError)
+            {
+                PairCount = 0;
+            }
+        }
+    }
+
+    FreeBuffer(&ChunkMemory);
+
+    return PairCount;
+}
@@ -0,0 +1,359 @@
+/* ========================================================================
+   JSON string literals: scanning, validation and escape decoding
+
+   ScanJSONString finds the closing quote 32 bytes at a time (two SSE2
+   compares per block), looking for the four kinds of byte that need
+   attention: the quote, a backslash, a raw control character (not allowed
+   in JSON strings) and anything >= 0x80 (the start of a UTF-8 sequence,
+   which is then validated on its own). Plain ASCII runs never leave the
+   SIMD loop.
+
+   Tokens keep pointing at the raw text in the source. Only strings that
+   actually contain escapes are decoded, by DecodeJSONString, into storage
+   the caller provides - decoding never makes a string longer, so the raw
+   length is always enough.
+   ======================================================================== */
+
+#include <emmintrin.h>
+
+inline u32 CountTrailingZeros32(u32 Value)
+{
+    // NOTE: Value is never 0 here
+#if _MSC_VER
+    unsigned long Index;
+    _BitScanForward(&Index, Value);
+    u32 Result = Index;
+#else
+    u32 Result = __builtin_ctz(Value);
+#endif
+    return Result;
+}
+
+inline u32 FindStringSpecials16(__m128i V)
+{
+    // NOTE: max(V, 0x1F) == 0x1F exactly when V <= 0x1F, i.e. a control character.
+    // Bytes >= 0x80 come straight out of the movemask's sign bits.
+    __m128i Special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('"')),
+                                                _mm_cmpeq_epi8(V, _mm_set1_epi8('\\'))),
+                                   _mm_cmpeq_epi8(_mm_max_epu8(V, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F)));
+    u32 Result = (u32)_mm_movemask_epi8(_mm_or_si128(Special, V));
+    return Result;
+}
+
+inline u32 FindStringSpecials32(u8 *Data)
+{
+    u32 Result = (FindStringSpecials16(_mm_loadu_si128((__m128i *)Data)) |
+                  (FindStringSpecials16(_mm_loadu_si128((__m128i *)(Data + 16))) << 16));
+    return Result;
+}
+
+static b32 ParseHex4(u8 *Data, u32 *Value)
+{
+    b32 Result = true;
+
+    u32 Accum = 0;
+    for(u32 Index = 0; Index < 4; ++Index)
+    {
+        u8 Char = Data[Index];
+        u32 Digit;
+        if((Char >= '0') && (Char <= '9'))
+        {
+            Digit = Char - '0';
+        }
+        else if(((Char | 0x20) >= 'a') && ((Char | 0x20) <= 'f'))
+        {
+            Digit = (Char | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            Result = false;
+            break;
+        }
+
+        Accum = (Accum << 4) | Digit;
+    }
+
+    *Value = Accum;
+
+    return Result;
+}
+
+// NOTE: Returns the length of the well-formed UTF-8 sequence starting at At, or 0 if it isn't one
+// (stray continuation byte, overlong form, UTF-16 surrogate, past U+10FFFF, or cut off)
+static u32 GetUTF8SequenceLength(buffer Source, u64 At)
+{
+    u8 Lead = Source.Data[At];
+
+    u32 Length = 0;
+    u8 SecondMin = 0x80;
+    u8 SecondMax = 0xBF;
+    if((Lead >= 0xC2) && (Lead <= 0xDF))
+    {
+        Length = 2;
+    }
+    else if((Lead >= 0xE0) && (Lead <= 0xEF))
+    {
+        Length = 3;
+        SecondMin = (Lead == 0xE0) ? 0xA0 : 0x80;
+        SecondMax = (Lead == 0xED) ? 0x9F : 0xBF;
+    }
+    else if((Lead >= 0xF0) && (Lead <= 0xF4))
+    {
+        Length = 4;
+        SecondMin = (Lead == 0xF0) ? 0x90 : 0x80;
+        SecondMax = (Lead == 0xF4) ? 0x8F : 0xBF;
+    }
+
+    u32 Result = 0;
+    if(Length && ((Source.Count - At) >= Length))
+    {
+        u8 Second = Source.Data[At + 1];
+        b32 Valid = (Second >= SecondMin) && (Second <= SecondMax);
+        for(u32 Index = 2; Index < Length; ++Index)
+        {
+            Valid &= ((Source.Data[At + Index] & 0xC0) == 0x80);
+        }
+
+        if(Valid)
+        {
+            Result = Length;
+        }
+    }
+
+    return Result;
+}
+
+// NOTE: At is just past the opening quote. Returns the position of the closing quote. Escaped is set if
+// the contents have any backslash escapes. If they aren't valid JSON, *Error gets a message and the
+// return value is where the problem is.
+inline u64 ScanJSONString(buffer Source, u64 At, b32 *EscapedResult, char const **ErrorResult)
+{
+    // NOTE: Inlined into both tokenizers, with the flags kept in locals so the loop never touches memory
+    b32 Escaped = false;
+    char const *Error = 0;
+
+    // NOTE: Most labels are only a few bytes. Walking those a byte at a time keeps the end of the string a
+    // predicted branch; the SIMD path would put a load-movemask-ctz chain in front of the next token.
+    u64 ShortEnd = ((Source.Count - At) > 16) ? (At + 16) : Source.Count;
+    while((At < ShortEnd) && (Source.Data[At] != '"') && (Source.Data[At] != '\\') &&
+          (Source.Data[At] >= 0x20) && (Source.Data[At] < 0x80))
+    {
+        ++At;
+    }
+
+    b32 Closed = (At < Source.Count) && (Source.Data[At] == '"');
+    while(!Closed && !Error)
+    {
+        if((At + 32) <= Source.Count)
+        {
+            u32 Mask = FindStringSpecials32(Source.Data + At);
+            if(!Mask)
+            {
+                At += 32;
+                continue;
+            }
+
+            At += CountTrailingZeros32(Mask);
+        }
+        else if(At >= Source.Count)
+        {
+            Error = "Unterminated string literal";
+            break;
+        }
+
+        u8 Val = Source.Data[At];
+        if(Val == '"')
+        {
+            Closed = true;
+        }
+        else if(Val == '\\')
+        {
+            Escaped = true;
+
+            u8 Escape = IsInBounds(Source, At + 1) ? Source.Data[At + 1] : 0;
+            if(Escape == 'u')
+            {
+                u32 CodeUnit;
+                if(((Source.Count - At) < 6) || !ParseHex4(Source.Data + At + 2, &CodeUnit))
+                {
+                    Error = "Expected four hex digits after \\u";
+                }
+                At += 6;
+            }
+            else if((Escape == '"') || (Escape == '\\') || (Escape == '/') || (Escape == 'b') ||
+                    (Escape == 'f') || (Escape == 'n') || (Escape == 'r') || (Escape == 't'))
+            {
+                At += 2;
+            }
+            else
+            {
+                Error = "Invalid escape in string literal";
+            }
+        }
+        else if(Val < 0x20)
+        {
+            Error = "Unescaped control character in string literal";
+        }
+        else if(Val >= 0x80)
+        {
+            u32 Length = GetUTF8SequenceLength(Source, At);
+            if(Length)
+            {
+                At += Length;
+            }
+            else
+            {
+                Error = "Invalid UTF-8 in string literal";
+            }
+        }
+        else
+        {
+            // NOTE: Only reached in the last partial block, which goes byte by byte
+            ++At;
+        }
+    }
+
+    if(At > Source.Count)
+    {
+        At = Source.Count;
+    }
+
+    *EscapedResult = Escaped;
+    *ErrorResult = Error;
+
+    return At;
+}
+
+static u32 EncodeUTF8(u32 CodePoint, u8 *Dest)
+{
+    u32 Result;
+    if(CodePoint < 0x80)
+    {
+        Dest[0] = (u8)CodePoint;
+        Result = 1;
+    }
+    else if(CodePoint < 0x800)
+    {
+        Dest[0] = (u8)(0xC0 | (CodePoint >> 6));
+        Dest[1] = (u8)(0x80 | (CodePoint & 0x3F));
+        Result = 2;
+    }
+    else if(CodePoint < 0x10000)
+    {
+        Dest[0] = (u8)(0xE0 | (CodePoint >> 12));
+        Dest[1] = (u8)(0x80 | ((CodePoint >> 6) & 0x3F));
+        Dest[2] = (u8)(0x80 | (CodePoint & 0x3F));
+        Result = 3;
+    }
+    else
+    {
+        Dest[0] = (u8)(0xF0 | (CodePoint >> 18));
+        Dest[1] = (u8)(0x80 | ((CodePoint >> 12) & 0x3F));
+        Dest[2] = (u8)(0x80 | ((CodePoint >> 6) & 0x3F));
+        Dest[3] = (u8)(0x80 | (CodePoint & 0x3F));
+        Result = 4;
+    }
+
+    return Result;
+}
+
+// NOTE: Raw is the contents of a string literal that ScanJSONString accepted. Dest needs Raw.Count bytes.
+// A \u escape for half of a surrogate pair without the other half becomes U+FFFD.
+static buffer DecodeJSONString(buffer Raw, u8 *Dest)
+{
+    buffer Result = {};
+    Result.Data = Dest;
+
+    u64 At = 0;
+    while(At < Raw.Count)
+    {
+        u8 *Backslash = (u8 *)memchr(Raw.Data + At, '\\', Raw.Count - At);
+        u64 RunEnd = Backslash ? (u64)(Backslash - Raw.Data) : Raw.Count;
+
+        memcpy(Dest + Result.Count, Raw.Data + At, RunEnd - At);
+        Result.Count += RunEnd - At;
+        At = RunEnd;
+
+        if((At + 1) < Raw.Count)
+        {
+            u8 Escape = Raw.Data[At + 1];
+            At += 2;
+
+            u8 Decoded = 0;
+            switch(Escape)
+            {
+                case 'b': {Decoded = '\b';} break;
+                case 'f': {Decoded = '\f';} break;
+                case 'n': {Decoded = '\n';} break;
+                case 'r': {Decoded = '\r';} break;
+                case 't': {Decoded = '\t';} break;
+
+                case 'u':
+                {
+                    u32 CodePoint = 0xFFFD;
+                    u32 CodeUnit = 0;
+                    if(((Raw.Count - At) >= 4) && ParseHex4(Raw.Data + At, &CodeUnit))
+                    {
+                        At += 4;
+                        if((CodeUnit & 0xF800) != 0xD800)
+                        {
+                            CodePoint = CodeUnit;
+                        }
+                        else if(CodeUnit < 0xDC00)
+                        {
+                            // NOTE: High surrogate, only valid with a \u low surrogate right after it
+                            u32 Low = 0;
+                            if(((Raw.Count - At) >= 6) && (Raw.Data[At] == '\\') && (Raw.Data[At + 1] == 'u') &&
+                               ParseHex4(Raw.Data + At + 2, &Low) && (Low >= 0xDC00) && (Low <= 0xDFFF))
+                            {
+                                CodePoint = 0x10000 + ((CodeUnit - 0xD800) << 10) + (Low - 0xDC00);
+                                At += 6;
+                            }
+                        }
+                    }
+
+                    Result.Count += EncodeUTF8(CodePoint, Dest + Result.Count);
+                    continue;
+                }
+
+                default: {Decoded = Escape;} break; // NOTE: \" \\ \/
+            }
+
+            Dest[Result.Count++] = Decoded;
+        }
+        else if(At < Raw.Count)
+        {
+            // NOTE: A lone trailing backslash can't get past ScanJSONString, but don't lose it if it does
+            Dest[Result.Count++] = Raw.Data[At++];
+        }
+    }
+
+    return Result;
+}
+
+// NOTE: Compares the contents of a string literal with Expected as it reads once decoded. Only escaped
+// strings pay for decoding, into a stack buffer unless they are unusually long.
+inline b32 IsJSONStringEqual(buffer Raw, b32 Escaped, buffer Expected)
+{
+    b32 Result = false;
+
+    if(!Escaped)
+    {
+        Result = AreEqual(Raw, Expected);
+    }
+    else if(Raw.Count >= Expected.Count) // NOTE: Decoding never makes a string longer
+    {
+        u8 Scratch[256];
+        u8 *Dest = (Raw.Count <= sizeof(Scratch)) ? Scratch : (u8 *)malloc(Raw.Count);
+        if(Dest)
+        {
+            Result = AreEqual(DecodeJSONString(Raw, Dest), Expected);
+            if(Dest != Scratch)
+            {
+                free(Dest);
+            }
+        }
+    }
+
+    return Result;
+}
@@ -0,0 +1,305 @@
+/* ========================================================================
+   SIMD structural indexer for the JSON tokenizer
+
+   Pass 1 classifies the input 64 bytes at a time (AVX2, or SSE2 where AVX2
+   is not available) into bitmasks, and turns them into a list of offsets:
+   structural characters outside strings, both quotes of every string, and
+   the first byte of every number/keyword. Pass 2 (GetIndexedJSONToken in
+   the parser) then hops from offset to offset instead of looking at every
+   byte.
+
+   The index is built in windows of INDEX_WINDOW_BYTES as the tokenizer
+   consumes it, so it stays cache-resident and doesn't grow with the input.
+   ======================================================================== */
+
+#include "cpu_features.cpp"
+
+#include <string.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+enum json_index_isa
+{
+    IndexISA_None,
+    IndexISA_SSE2,
+    IndexISA_AVX2,
+
+    IndexISA_Count,
+};
+
+struct json_block_masks
+{
+    u64 Quote;
+    u64 Backslash;
+    u64 Whitespace;
+    u64 Structural;
+};
+
+#define INDEX_BLOCK_BYTES 64
+#define INDEX_WINDOW_BYTES (16*1024)
+
+// NOTE: Worst case every byte in the window is an index entry
+#define INDEX_WINDOW_CAPACITY INDEX_WINDOW_BYTES
+
+struct json_structural_indexer
+{
+    buffer Source;
+    json_index_isa ISA;
+
+    u64 BlockAt; // NOTE: First byte not yet indexed
+
+    // NOTE: State carried from one 64-byte block to the next
+    u64 InStringCarry; // NOTE: All ones while inside a string
+    u64 EscapeCarry;   // NOTE: 1 if the last byte was an unescaped backslash
+    u64 ScalarCarry;   // NOTE: 1 if the last byte was part of a number/keyword
+
+    u64 *Positions;
+    u32 PositionCount;
+    u32 PositionRead;
+};
+
+inline char const *DescribeIndexISA(json_index_isa ISA)
+{
+    char const *Result;
+    switch(ISA)
+    {
+        case IndexISA_None: {Result = "scalar";} break;
+        case IndexISA_SSE2: {Result = "SSE2";} break;
+        case IndexISA_AVX2: {Result = "AVX2";} break;
+        default : {Result = "UNKNOWN";} break;
+    }
+
+    return Result;
+}
+
+inline u64 MoveMask128(__m128i A, __m128i B, __m128i C, __m128i D)
+{
+    u64 Result = ((u64)(u32)_mm_movemask_epi8(A) |
+                  ((u64)(u32)_mm_movemask_epi8(B) << 16) |
+                  ((u64)(u32)_mm_movemask_epi8(C) << 32) |
+                  ((u64)(u32)_mm_movemask_epi8(D) << 48));
+    return Result;
+}
+
+static json_block_masks ClassifyBlockSSE2(u8 *Data)
+{
+    __m128i In[4];
+    for(u32 Part = 0; Part < 4; ++Part)
+    {
+        In[Part] = _mm_loadu_si128((__m128i *)(Data + 16*Part));
+    }
+
+    __m128i Quote[4], Backslash[4], Whitespace[4], Structural[4];
+    for(u32 Part = 0; Part < 4; ++Part)
+    {
+        __m128i V = In[Part];
+        Quote[Part] = _mm_cmpeq_epi8(V, _mm_set1_epi8('"'));
+        Backslash[Part] = _mm_cmpeq_epi8(V, _mm_set1_epi8('\\'));
+        Whitespace[Part] = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')),
+                                                     _mm_cmpeq_epi8(V, _mm_set1_epi8('\t'))),
+                                        _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                                                     _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))));
+        Structural[Part] = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('{')),
+                                                                  _mm_cmpeq_epi8(V, _mm_set1_epi8('}'))),
+                                                     _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('[')),
+                                                                  _mm_cmpeq_epi8(V, _mm_set1_epi8(']')))),
+                                        _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(',')),
+                                                     _mm_cmpeq_epi8(V, _mm_set1_epi8(':'))));
+    }
+
+    json_block_masks Result;
+    Result.Quote = MoveMask128(Quote[0], Quote[1], Quote[2], Quote[3]);
+    Result.Backslash = MoveMask128(Backslash[0], Backslash[1], Backslash[2], Backslash[3]);
+    Result.Whitespace = MoveMask128(Whitespace[0], Whitespace[1], Whitespace[2], Whitespace[3]);
+    Result.Structural = MoveMask128(Structural[0], Structural[1], Structural[2], Structural[3]);
+    return Result;
+}
+
+TARGET_AVX2 inline u64 MoveMask256(__m256i Lo, __m256i Hi)
+{
+    u64 Result = ((u64)(u32)_mm256_movemask_epi8(Lo) |
+                  ((u64)(u32)_mm256_movemask_epi8(Hi) << 32));
+    return Result;
+}
+
+TARGET_AVX2 static json_block_masks ClassifyBlockAVX2(u8 *Data)
+{
+    __m256i In[2];
+    In[0] = _mm256_loadu_si256((__m256i *)Data);
+    In[1] = _mm256_loadu_si256((__m256i *)(Data + 32));
+
+    __m256i Quote[2], Backslash[2], Whitespace[2], Structural[2];
+    for(u32 Part = 0; Part < 2; ++Part)
+    {
+        __m256i V = In[Part];
+        Quote[Part] = _mm256_cmpeq_epi8(V, _mm256_set1_epi8('"'));
+        Backslash[Part] = _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\\'));
+        Whitespace[Part] = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(' ')),
+                                                           _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\t'))),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+                                                           _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r'))));
+        Structural[Part] = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('{')),
+                                                                           _mm256_cmpeq_epi8(V, _mm256_set1_epi8('}'))),
+                                                           _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8('[')),
+                                                                           _mm256_cmpeq_epi8(V, _mm256_set1_epi8(']')))),
+                                           _mm256_or_si256(_mm256_cmpeq_epi8(V, _mm256_set1_epi8(',')),
+                                                           _mm256_cmpeq_epi8(V, _mm256_set1_epi8(':'))));
+    }
+
+    json_block_masks Result;
+    Result.Quote = MoveMask256(Quote[0], Quote[1]);
+    Result.Backslash = MoveMask256(Backslash[0], Backslash[1]);
+    Result.Whitespace = MoveMask256(Whitespace[0], Whitespace[1]);
+    Result.Structural = MoveMask256(Structural[0], Structural[1]);
+    return Result;
+}
+
+inline u64 PrefixXor(u64 Bits)
+{
+    // NOTE: Bit N of the result is the XOR of bits 0..N of the input, i.e. it is
+    // set for every byte between an opening quote and its closing quote.
+    Bits ^= Bits << 1;
+    Bits ^= Bits << 2;
+    Bits ^= Bits << 4;
+    Bits ^= Bits << 8;
+    Bits ^= Bits << 16;
+    Bits ^= Bits << 32;
+    return Bits;
+}
+
+static void IndexBlock(json_structural_indexer *Indexer, u8 *Data, u64 ValidMask)
+{
+    json_block_masks Masks = (Indexer->ISA == IndexISA_AVX2) ? ClassifyBlockAVX2(Data) : ClassifyBlockSSE2(Data);
+
+    // NOTE: Backslashes are rare enough in our inputs that resolving which
+    // characters they escape one bit at a time is not worth vectorizing.
+    u64 Escaped = 0;
+    if(Masks.Backslash || Indexer->EscapeCarry)
+    {
+        b32 Escape = (b32)Indexer->EscapeCarry;
+        for(u32 Bit = 0; Bit < INDEX_BLOCK_BYTES; ++Bit)
+        {
+            u64 BitMask = 1ull << Bit;
+            if(Escape)
+            {
+                Escaped |= BitMask;
+                Escape = false;
+            }
+            else if(Masks.Backslash & BitMask)
+            {
+                Escape = true;
+            }
+        }
+        Indexer->EscapeCarry = Escape;
+    }
+
+    u64 Quote = Masks.Quote & ~Escaped & ValidMask;
+    u64 InString = PrefixXor(Quote) ^ Indexer->InStringCarry;
+    Indexer->InStringCarry = 0ull - (InString >> 63);
+
+    u64 Structural = Masks.Structural & ~InString;
+    u64 Scalar = ~(Masks.Whitespace | Masks.Structural | Quote | InString) & ValidMask;
+    u64 ScalarStart = Scalar & ~((Scalar << 1) | Indexer->ScalarCarry);
+    Indexer->ScalarCarry = Scalar >> 63;
+
+    u64 Bits = (Structural | Quote | ScalarStart) & ValidMask;
+    u64 BlockAt = Indexer->BlockAt;
+    u64 *Dest = Indexer->Positions + Indexer->PositionCount;
+    while(Bits)
+    {
+        *Dest++ = BlockAt + CountTrailingZeros64(Bits);
+        Bits &= Bits - 1;
+    }
+
+    Indexer->PositionCount = (u32)(Dest - Indexer->Positions);
+}
+
+static void RefillStructuralIndex(json_structural_indexer *Indexer)
+{
+    buffer Source = Indexer->Source;
+
+    u64 WindowEnd = Indexer->BlockAt + INDEX_WINDOW_BYTES;
+    if(WindowEnd > Source.Count)
+    {
+        WindowEnd = Source.Count;
+    }
+
+    TimeBandwidth("StructuralIndex", WindowEnd - Indexer->BlockAt);
+
+    Indexer->PositionCount = 0;
+    Indexer->PositionRead = 0;
+
+    while(Indexer->BlockAt + INDEX_BLOCK_BYTES <= WindowEnd)
+    {
+        IndexBlock(Indexer, Source.Data + Indexer->BlockAt, ~0ull);
+        Indexer->BlockAt += INDEX_BLOCK_BYTES;
+    }
+
+    if(Indexer->BlockAt < WindowEnd)
+    {
+        // NOTE: The final partial block is padded out with spaces so the loads stay in bounds
+        u8 Tail[INDEX_BLOCK_BYTES];
+        u64 TailCount = WindowEnd - Indexer->BlockAt;
+        memset(Tail, ' ', sizeof(Tail));
+        memcpy(Tail, Source.Data + Indexer->BlockAt, TailCount);
+
+        IndexBlock(Indexer, Tail, (1ull << TailCount) - 1);
+        Indexer->BlockAt = WindowEnd;
+    }
+}
+
+inline json_structural_indexer CreateStructuralIndexer(buffer Source, json_index_isa ISA = IndexISA_Count)
+{
+    json_structural_indexer Result = {};
+    Result.Source = Source;
+
+    cpu_features Features = GetCPUFeatures();
+    if((ISA == IndexISA_Count) || ((ISA == IndexISA_AVX2) && !Features.AVX2))
+    {
+        ISA = Features.AVX2 ? IndexISA_AVX2 : IndexISA_SSE2;
+    }
+    Result.ISA = ISA;
+
+    Result.Positions = (u64 *)malloc(INDEX_WINDOW_CAPACITY*sizeof(u64));
+    if(!Result.Positions)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate structural index.\n");
+        Result.ISA = IndexISA_None;
+    }
+
+    return Result;
+}
+
+inline void FreeStructuralIndexer(json_structural_indexer *Indexer)
+{
+    free(Indexer->Positions);
+    *Indexer = {};
+}
+
+// NOTE: Returns Source.Count once there are no more structural positions
+static u64 PeekStructuralPosition(json_structural_indexer *Indexer)
+{
+    while((Indexer->PositionRead == Indexer->PositionCount) && (Indexer->BlockAt < Indexer->Source.Count))
+    {
+        RefillStructuralIndex(Indexer);
+    }
+
+    u64 Result = Indexer->Source.Count;
+    if(Indexer->PositionRead < Indexer->PositionCount)
+    {
+        Result = Indexer->Positions[Indexer->PositionRead];
+    }
+
+    return Result;
+}
+
+static u64 NextStructuralPosition(json_structural_indexer *Indexer)
+{
+    u64 Result = PeekStructuralPosition(Indexer);
+    if(Indexer->PositionRead < Indexer->PositionCount)
+    {
+        ++Indexer->PositionRead;
+    }
+
+    return Result;
+}
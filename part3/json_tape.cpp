@@ -0,0 +1,338 @@
+/* ========================================================================
+   Tape representation for parsed JSON
+
+   Instead of a json_element tree, the parse is written out as one flat
+   array of u64 entries in document order. The type sits in the top 8
+   bits, the rest depends on the type:
+
+   - open brace/bracket: the index just past the matching close entry,
+     so skipping a whole object or array is a single load.
+   - close brace/bracket: the index of the matching open entry.
+   - string/number/keyword: 16-bit length above a 40-bit source offset.
+     A length of JSON_TAPE_LONG_LENGTH means the real length is in the
+     entry that follows. Strings with escapes are decoded into a string
+     area after the entries; offsets past the end of the source point
+     there.
+
+   Object members are the label (a string entry) followed by the value.
+   Walking siblings is a forward scan over adjacent entries, and the
+   whole tape lives in one reservation sized so it can never run out:
+   no entry is ever produced without at least one byte of input behind it.
+   ======================================================================== */
+
+#define JSON_TAPE_TYPE_SHIFT 56
+#define JSON_TAPE_LENGTH_SHIFT 40
+#define JSON_TAPE_OFFSET_MASK ((1ull << JSON_TAPE_LENGTH_SHIFT) - 1)
+#define JSON_TAPE_PAYLOAD_MASK ((1ull << JSON_TAPE_TYPE_SHIFT) - 1)
+#define JSON_TAPE_LONG_LENGTH 0xFFFF
+
+struct json_tape
+{
+    buffer Source;
+    u64 *Entries;
+    u64 EntryCount;
+    u64 MaxEntryCount;
+
+    u8 *Strings; // NOTE: Decoded escaped strings, at tape offsets Source.Count and up
+    u64 StringsUsed;
+
+    memory_arena Memory;
+};
+
+inline json_token_type GetTapeType(json_tape *Tape, u64 Index)
+{
+    json_token_type Result = (json_token_type)(Tape->Entries[Index] >> JSON_TAPE_TYPE_SHIFT);
+    return Result;
+}
+
+inline u64 GetTapePayload(json_tape *Tape, u64 Index)
+{
+    u64 Result = Tape->Entries[Index] & JSON_TAPE_PAYLOAD_MASK;
+    return Result;
+}
+
+static void PushTapeEntry(json_parser *Parser, json_tape *Tape, json_token_type Type, u64 Payload)
+{
+    if(Tape->EntryCount < Tape->MaxEntryCount)
+    {
+        Tape->Entries[Tape->EntryCount++] = ((u64)Type << JSON_TAPE_TYPE_SHIFT) | Payload;
+    }
+    else if(!Parser->HadError)
+    {
+        json_token Token = {};
+        Error(Parser, Token, "Out of space for JSON tape entries");
+    }
+}
+
+static void PushTapeScalar(json_parser *Parser, json_tape *Tape, json_token Token)
+{
+    u64 Offset = Token.Value.Data - Tape->Source.Data;
+    u64 Length = Token.Value.Count;
+    if(Token.Escaped)
+    {
+        buffer Decoded = DecodeJSONString(Token.Value, Tape->Strings + Tape->StringsUsed);
+        Offset = Tape->Source.Count + Tape->StringsUsed;
+        Length = Decoded.Count;
+        Tape->StringsUsed += Decoded.Count;
+    }
+
+    if(Length < JSON_TAPE_LONG_LENGTH)
+    {
+        PushTapeEntry(Parser, Tape, Token.Type, (Length << JSON_TAPE_LENGTH_SHIFT) | Offset);
+    }
+    else
+    {
+        PushTapeEntry(Parser, Tape, Token.Type, ((u64)JSON_TAPE_LONG_LENGTH << JSON_TAPE_LENGTH_SHIFT) | Offset);
+        PushTapeEntry(Parser, Tape, Token_count, Length);
+    }
+}
+
+static void ParseTapeList(json_parser *Parser, json_tape *Tape, json_token_type EndType, b32 HasLabels);
+static void ParseTapeValue(json_parser *Parser, json_tape *Tape, json_token Value)
+{
+    if((Value.Type == Token_open_bracket) || (Value.Type == Token_open_brace))
+    {
+        b32 IsObject = (Value.Type == Token_open_brace);
+        json_token_type CloseType = IsObject ? Token_close_brace : Token_close_bracket;
+
+        u64 OpenIndex = Tape->EntryCount;
+        PushTapeEntry(Parser, Tape, Value.Type, 0);
+        ParseTapeList(Parser, Tape, CloseType, IsObject);
+        PushTapeEntry(Parser, Tape, CloseType, OpenIndex);
+
+        if(!Parser->HadError)
+        {
+            Tape->Entries[OpenIndex] |= Tape->EntryCount;
+        }
+    }
+    else if((Value.Type == Token_string_literal) ||
+            (Value.Type == Token_true) ||
+            (Value.Type == Token_false) ||
+            (Value.Type == Token_null) ||
+            (Value.Type == Token_number))
+    {
+        PushTapeScalar(Parser, Tape, Value);
+    }
+    else
+    {
+        Error(Parser, Value, "Unexpected token in JSON");
+    }
+}
+
+static void ParseTapeList(json_parser *Parser, json_tape *Tape, json_token_type EndType, b32 HasLabels)
+{
+    while(IsParsing(Parser))
+    {
+        json_token Value = GetJSONToken(Parser);
+        if(Value.Type == EndType)
+        {
+            break;
+        }
+
+        if(HasLabels)
+        {
+            if(Value.Type == Token_string_literal)
+            {
+                PushTapeScalar(Parser, Tape, Value);
+
+                json_token Colon = GetJSONToken(Parser);
+                if(Colon.Type == Token_colon)
+                {
+                    Value = GetJSONToken(Parser);
+                }
+                else
+                {
+                    Error(Parser, Colon, "Expected colon after field name");
+                }
+            }
+            else
+            {
+                Error(Parser, Value, "Unexpected token in JSON");
+            }
+        }
+
+        ParseTapeValue(Parser, Tape, Value);
+
+        json_token Comma = GetJSONToken(Parser);
+        if(Comma.Type == EndType)
+        {
+            break;
+        }
+        else if(Comma.Type != Token_comma)
+        {
+            Error(Parser, Comma, "Unexpected token in JSON");
+        }
+    }
+}
+
+static void FreeJSONTape(json_tape *Tape)
+{
+    ReleaseArena(&Tape->Memory);
+    *Tape = {};
+}
+
+// NOTE: On failure the tape comes back empty
+static json_tape ParseJSONTape(buffer InputJSON, json_structural_indexer *Indexer = 0)
+{
+    TimeFunction;
+
+    json_tape Tape = {};
+    Tape.Source = InputJSON;
+
+    if((2*InputJSON.Count) <= JSON_TAPE_OFFSET_MASK)
+    {
+        // NOTE: Only reserved, pages get touched as the tape grows
+        Tape.MaxEntryCount = InputJSON.Count + 1;
+        Tape.Memory = ReserveArena(Tape.MaxEntryCount*sizeof(u64) + InputJSON.Count);
+        Tape.Entries = PushArray(&Tape.Memory, Tape.MaxEntryCount, u64);
+        Tape.Strings = PushArray(&Tape.Memory, InputJSON.Count, u8);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: JSON input too large for tape offsets\n");
+    }
+
+    if(Tape.Entries)
+    {
+        json_parser Parser = {};
+        Parser.Source = InputJSON;
+        Parser.Indexer = Indexer;
+
+        ParseTapeValue(&Parser, &Tape, GetJSONToken(&Parser));
+
+        if(Parser.HadError)
+        {
+            FreeJSONTape(&Tape);
+        }
+    }
+
+    return Tape;
+}
+
+// NOTE: Index of the entry after the value at Index, i.e. its next sibling (or the parent's close entry)
+static u64 GetNextTapeSibling(json_tape *Tape, u64 Index)
+{
+    u64 Result = Index + 1;
+
+    json_token_type Type = GetTapeType(Tape, Index);
+    if((Type == Token_open_brace) || (Type == Token_open_bracket))
+    {
+        Result = GetTapePayload(Tape, Index);
+    }
+    else if(((GetTapePayload(Tape, Index) >> JSON_TAPE_LENGTH_SHIFT)) == JSON_TAPE_LONG_LENGTH)
+    {
+        Result = Index + 2;
+    }
+
+    return Result;
+}
+
+// NOTE: The source text of a scalar entry (string contents without the quotes). Empty for containers.
+static buffer GetTapeValue(json_tape *Tape, u64 Index)
+{
+    buffer Result = {};
+
+    json_token_type Type = GetTapeType(Tape, Index);
+    if((Type != Token_open_brace) && (Type != Token_open_bracket) &&
+       (Type != Token_close_brace) && (Type != Token_close_bracket))
+    {
+        u64 Payload = GetTapePayload(Tape, Index);
+        u64 Offset = Payload & JSON_TAPE_OFFSET_MASK;
+        Result.Data = (Offset < Tape->Source.Count) ?
+            (Tape->Source.Data + Offset) :
+            (Tape->Strings + (Offset - Tape->Source.Count));
+        Result.Count = Payload >> JSON_TAPE_LENGTH_SHIFT;
+        if(Result.Count == JSON_TAPE_LONG_LENGTH)
+        {
+            Result.Count = GetTapePayload(Tape, Index + 1);
+        }
+    }
+
+    return Result;
+}
+
+// NOTE: Returns the index of the member's value, or 0 if there is none (0 is always the root, never a member)
+static u64 LookupTapeElement(json_tape *Tape, u64 Object, json_label_key *Key)
+{
+    u64 Result = 0;
+
+    if(Tape->EntryCount && (GetTapeType(Tape, Object) == Token_open_brace))
+    {
+        u64 Index = Object + 1;
+        while(GetTapeType(Tape, Index) != Token_close_brace)
+        {
+            u64 ValueIndex = GetNextTapeSibling(Tape, Index);
+
+            buffer Label = GetTapeValue(Tape, Index);
+            if(AreEqual(Label, Key->Name))
+            {
+                Result = ValueIndex;
+                break;
+            }
+
+            Index = GetNextTapeSibling(Tape, ValueIndex);
+        }
+    }
+
+    return Result;
+}
+
+inline u64 LookupTapeElement(json_tape *Tape, u64 Object, buffer ElementName)
+{
+    json_label_key Key = MakeLabelKey(ElementName);
+    u64 Result = LookupTapeElement(Tape, Object, &Key);
+    return Result;
+}
+
+static f64 ConvertTapeElementToF64(json_tape *Tape, u64 Object, json_label_key *Key)
+{
+    f64 Result = 0.0;
+
+    u64 Element = LookupTapeElement(Tape, Object, Key);
+    if(Element)
+    {
+        Result = ConvertJSONValueToF64(GetTapeValue(Tape, Element));
+    }
+
+    return Result;
+}
+
+static u64 ParseHaversinePairsTape(buffer InputJSON, u64 MaxPairCount, haversine_pair *Pairs,
+                                   json_structural_indexer *Indexer = 0)
+{
+    TimeFunction;
+
+    u64 PairCount = 0;
+
+    json_tape Tape = ParseJSONTape(InputJSON, Indexer);
+
+    u64 PairsArray = LookupTapeElement(&Tape, 0, CONSTANT_STRING("pairs"));
+    if(PairsArray && (GetTapeType(&Tape, PairsArray) == Token_open_bracket))
+    {
+        TimeBlock("Lookup and Convert");
+
+        json_label_key X0 = MakeLabelKey(CONSTANT_STRING("x0"));
+        json_label_key Y0 = MakeLabelKey(CONSTANT_STRING("y0"));
+        json_label_key X1 = MakeLabelKey(CONSTANT_STRING("x1"));
+        json_label_key Y1 = MakeLabelKey(CONSTANT_STRING("y1"));
+
+        for(u64 Element = PairsArray + 1;
+            (GetTapeType(&Tape, Element) != Token_close_bracket) && (PairCount < MaxPairCount);
+            Element = GetNextTapeSibling(&Tape, Element))
+        {
+            haversine_pair *Pair = Pairs + PairCount++;
+
+            Pair->X0 = ConvertTapeElementToF64(&Tape, Element, &X0);
+            Pair->Y0 = ConvertTapeElementToF64(&Tape, Element, &Y0);
+            Pair->X1 = ConvertTapeElementToF64(&Tape, Element, &X1);
+            Pair->Y1 = ConvertTapeElementToF64(&Tape, Element, &Y1);
+        }
+    }
+
+    {
+        TimeBlock("FreeJSONTape");
+        FreeJSONTape(&Tape);
+    }
+
+    return PairCount;
+}
@@ -14,6 +14,11 @@
    LISTING 94
    ======================================================================== */
 
+#include "memory_arena.cpp"
+#include "json_structural_index.cpp"
+#include "json_number.cpp"
+#include "json_string.cpp"
+
 enum json_token_type
 {
     Token_end_of_stream,
@@ -38,6 +43,17 @@ struct json_token
 {
     json_token_type Type;
     buffer Value;
+    b32 Escaped; // NOTE: String literal with backslash escapes - Value is still the raw text, see DecodeJSONString
+};
+
+// NOTE: Objects with more members than this get a hash index at parse time
+#define JSON_OBJECT_INDEX_THRESHOLD 8
+
+struct json_element;
+struct json_object_index
+{
+    u32 SlotMask;
+    json_element **Slots; // NOTE: SlotMask + 1 open-addressed entries, 0 is empty
 };
 
 struct json_element
@@ -45,8 +61,18 @@ struct json_element
     buffer Label;
     buffer Value;
     json_element *FirstSubElement;
+    json_object_index *Index;
     
     json_element *NextSibling;
+    u64 LabelPrefix; // NOTE: First 8 bytes of Label, zero padded, so most mismatches never touch the source
+};
+
+// NOTE: A label to look up, with everything the comparison needs worked out once
+struct json_label_key
+{
+    buffer Name;
+    u64 Prefix;
+    u64 Hash;
 };
 
 struct json_parser
@@ -54,6 +80,18 @@ struct json_parser
     buffer Source;
     u64 At;
     b32 HadError;
+    
+    memory_arena *Arena; // NOTE: When set, elements come from here instead of malloc
+    json_structural_indexer *Indexer; // NOTE: When set, tokens come from the structural index
+};
+
+enum json_allocation_type
+{
+    JSONAlloc_malloc,
+    JSONAlloc_Arena,
+    JSONAlloc_ArenaLargePages,
+    
+    JSONAlloc_Count,
 };
 
 static b32 IsJSONDigit(buffer Source, u64 At)
@@ -88,8 +126,12 @@ static b32 IsParsing(json_parser *Parser)
 
 static void Error(json_parser *Parser, json_token Token, char const *Message)
 {
+    // NOTE: Only the first error is reported, the tokens after it are just fallout
+    if(!Parser->HadError)
+    {
+        fprintf(stderr, "ERROR: \"%.*s\" - %s\n", (u32)Token.Value.Count, (char *)Token.Value.Data, Message);
+    }
     Parser->HadError = true;
-    fprintf(stderr, "ERROR: \"%.*s\" - %s\n", (u32)Token.Value.Count, (char *)Token.Value.Data, Message);
 }
 
 static void ParseKeyword(buffer Source, u64 *At, buffer KeywordRemaining, json_token_type Type, json_token *Result)
@@ -108,8 +150,191 @@ static void ParseKeyword(buffer Source, u64 *At, buffer KeywordRemaining, json_t
     }
 }
 
+// NOTE: At is just past the first character of the number, a '-' or a digit. Returns the end of the
+// number. If it doesn't follow the JSON grammar, *Error gets a message and the return value is where
+// the problem is.
+static u64 ScanJSONNumber(buffer Source, u64 At, char const **ErrorResult)
+{
+    char const *Error = 0;
+    u8 Val = Source.Data[At - 1];
+    
+    // NOTE(casey): Move past a leading negative sign if one exists
+    if(Val == '-')
+    {
+        if(IsJSONDigit(Source, At))
+        {
+            Val = Source.Data[At++];
+        }
+        else
+        {
+            Error = "Expected a digit after '-'";
+        }
+    }
+    
+    // NOTE(casey): If the leading digit wasn't 0, parse any digits before the decimal point
+    if(!Error && (Val != '0'))
+    {
+        while(IsJSONDigit(Source, At))
+        {
+            ++At;
+        }
+    }
+    
+    // NOTE(casey): If there is a decimal point, parse any digits after the decimal point
+    if(!Error && IsInBounds(Source, At) && (Source.Data[At] == '.'))
+    {
+        ++At;
+        if(!IsJSONDigit(Source, At))
+        {
+            Error = "Expected a digit after '.'";
+        }
+        
+        while(IsJSONDigit(Source, At))
+        {
+            ++At;
+        }
+    }
+    
+    // NOTE(casey): If it's in scientific notation, parse any digits after the "e"
+    if(!Error && IsInBounds(Source, At) && ((Source.Data[At] == 'e') || (Source.Data[At] == 'E')))
+    {
+        ++At;
+        
+        if(IsInBounds(Source, At) && ((Source.Data[At] == '+') || (Source.Data[At] == '-')))
+        {
+            ++At;
+        }
+        
+        if(!IsJSONDigit(Source, At))
+        {
+            Error = "Expected a digit in the exponent";
+        }
+        
+        while(IsJSONDigit(Source, At))
+        {
+            ++At;
+        }
+    }
+    
+    *ErrorResult = Error;
+    return At;
+}
+
+static json_token GetIndexedJSONToken(json_parser *Parser)
+{
+    json_token Result = {};
+    
+    buffer Source = Parser->Source;
+    json_structural_indexer *Indexer = Parser->Indexer;
+    
+    u64 At = NextStructuralPosition(Indexer);
+    if(IsInBounds(Source, At))
+    {
+        Result.Type = Token_error;
+        Result.Value.Count = 1;
+        Result.Value.Data = Source.Data + At;
+        u8 Val = Source.Data[At++];
+        switch(Val)
+        {
+            case '{': {Result.Type = Token_open_brace;} break;
+            case '[': {Result.Type = Token_open_bracket;} break;
+            case '}': {Result.Type = Token_close_brace;} break;
+            case ']': {Result.Type = Token_close_bracket;} break;
+            case ',': {Result.Type = Token_comma;} break;
+            case ':': {Result.Type = Token_colon;} break;
+            
+            case '"':
+            {
+                // NOTE: The closing quote is always the next index entry. The contents still get
+                // scanned, for escapes and to validate them.
+                u64 StringEnd = NextStructuralPosition(Indexer);
+                
+                char const *StringError = 0;
+                ScanJSONString(Source, At, &Result.Escaped, &StringError);
+                
+                Result.Type = Token_string_literal;
+                Result.Value.Data = Source.Data + At;
+                Result.Value.Count = StringEnd - At;
+                
+                if(StringError)
+                {
+                    Result.Type = Token_error;
+                    Error(Parser, Result, StringError);
+                }
+                
+                At = StringEnd;
+                if(IsInBounds(Source, At))
+                {
+                    ++At;
+                }
+            } break;
+            
+            default:
+            {
+                // NOTE: Numbers and keywords run up to the next index entry, minus any whitespace before it
+                u64 Start = At - 1;
+                u64 End = PeekStructuralPosition(Indexer);
+                while((End > At) && IsJSONWhitespace(Source, End - 1))
+                {
+                    --End;
+                }
+                
+                Result.Value.Count = End - Start;
+                
+                if((Val == '-') || ((Val >= '0') && (Val <= '9')))
+                {
+                    // NOTE: Same grammar as the byte tokenizer, and the run must hold nothing after the
+                    // number, or "1abc" and "1 2" would be one number here and an error there
+                    char const *NumberError = 0;
+                    u64 NumberEnd = ScanJSONNumber(Source, At, &NumberError);
+                    if(!NumberError && (NumberEnd != End))
+                    {
+                        NumberError = "Unexpected characters after a number";
+                    }
+                    
+                    if(NumberError)
+                    {
+                        Error(Parser, Result, NumberError);
+                    }
+                    else
+                    {
+                        Result.Type = Token_number;
+                    }
+                }
+                else
+                {
+                    buffer Keyword = Result.Value;
+                    if(AreEqual(Keyword, CONSTANT_STRING("true")))
+                    {
+                        Result.Type = Token_true;
+                    }
+                    else if(AreEqual(Keyword, CONSTANT_STRING("false")))
+                    {
+                        Result.Type = Token_false;
+                    }
+                    else if(AreEqual(Keyword, CONSTANT_STRING("null")))
+                    {
+                        Result.Type = Token_null;
+                    }
+                }
+                
+                At = End;
+            } break;
+        }
+    }
+    
+    Parser->At = At;
+    
+    return Result;
+}
+
 static json_token GetJSONToken(json_parser *Parser)
 {
+    if(Parser->Indexer)
+    {
+        return GetIndexedJSONToken(Parser);
+    }
+    
     json_token Result = {};
     
     buffer Source = Parser->Source;
@@ -156,22 +381,17 @@ static json_token GetJSONToken(json_parser *Parser)
                 
                 u64 StringStart = At;
                 
-                while(IsInBounds(Source, At) && (Source.Data[At] != '"'))
-                {
-                    if(IsInBounds(Source, (At + 1)) &&
-                       (Source.Data[At] == '\\') &&
-                       (Source.Data[At + 1] == '"'))
-                    {
-                        // NOTE(casey): Skip escaped quotation marks
-                        ++At;
-                    }
-                    
-                    ++At;
-                }
+                char const *StringError = 0;
+                At = ScanJSONString(Source, At, &Result.Escaped, &StringError);
                 
                 Result.Value.Data = Source.Data + StringStart;
                 Result.Value.Count = At - StringStart;
-                if(IsInBounds(Source, At))
+                if(StringError)
+                {
+                    Result.Type = Token_error;
+                    Error(Parser, Result, StringError);
+                }
+                else if(IsInBounds(Source, At))
                 {
                     ++At;
                 }
@@ -191,49 +411,16 @@ static json_token GetJSONToken(json_parser *Parser)
             {
                 u64 Start = At - 1;
                 Result.Type = Token_number;
-
-                // NOTE(casey): Move past a leading negative sign if one exists
-                if((Val == '-') && IsInBounds(Source, At))
-                {
-                    Val = Source.Data[At++];
-                }
                 
-                // NOTE(casey): If the leading digit wasn't 0, parse any digits before the decimal point
-                if(Val != '0')
-                {
-                    while(IsJSONDigit(Source, At))
-                    {
-                        ++At;
-                    }
-                }
+                char const *NumberError = 0;
+                At = ScanJSONNumber(Source, At, &NumberError);
                 
-                // NOTE(casey): If there is a decimal point, parse any digits after the decimal point
-                if(IsInBounds(Source, At) && (Source.Data[At] == '.'))
-                {
-                    ++At;
-                    while(IsJSONDigit(Source, At))
-                    {
-                        ++At;
-                    }
-                }
-                
-                // NOTE(casey): If it's in scientific notation, parse any digits after the "e"
-                if(IsInBounds(Source, At) && ((Source.Data[At] == 'e') || (Source.Data[At] == 'E')))
+                Result.Value.Count = At - Start;
+                if(NumberError)
                 {
-                    ++At;
-                    
-                    if(IsInBounds(Source, At) && ((Source.Data[At] == '+') || (Source.Data[At] == '-')))
-                    {
-                        ++At;
-                    }
-                    
-                    while(IsJSONDigit(Source, At))
-                    {
-                        ++At;
-                    }
+                    Result.Type = Token_error;
+                    Error(Parser, Result, NumberError);
                 }
-                
-                Result.Value.Count = At - Start;
             } break;
             
             default:
@@ -247,19 +434,124 @@ static json_token GetJSONToken(json_parser *Parser)
     return Result;
 }
 
-static json_element *ParseJSONList(json_parser *Parser, json_token_type EndType, b32 HasLabels);
-static json_element *ParseJSONElement(json_parser *Parser, buffer Label, json_token Value)
+static u64 GetLabelPrefix(buffer Label)
+{
+    // NOTE: Array elements have no label at all, and memcpy from a null pointer is undefined even for 0 bytes
+    u64 Result = 0;
+    if(Label.Data)
+    {
+        memcpy(&Result, Label.Data, (Label.Count < sizeof(Result)) ? Label.Count : sizeof(Result));
+    }
+    return Result;
+}
+
+static u64 HashLabel(buffer Label)
+{
+    u64 const Prime = 0x9E3779B97F4A7C15ull;
+    
+    u64 Result = Label.Count*Prime;
+    u64 At = 0;
+    for(; (At + 8) <= Label.Count; At += 8)
+    {
+        u64 Word;
+        memcpy(&Word, Label.Data + At, sizeof(Word));
+        Result = (Result ^ Word) * Prime;
+        Result ^= Result >> 29;
+    }
+    
+    if(At < Label.Count)
+    {
+        u64 Word = 0;
+        memcpy(&Word, Label.Data + At, Label.Count - At);
+        Result = (Result ^ Word) * Prime;
+        Result ^= Result >> 29;
+    }
+    
+    return Result;
+}
+
+static json_label_key MakeLabelKey(buffer Name)
+{
+    json_label_key Result = {};
+    Result.Name = Name;
+    Result.Prefix = GetLabelPrefix(Name);
+    Result.Hash = HashLabel(Name);
+    
+    return Result;
+}
+
+inline b32 LabelMatches(json_element *Element, json_label_key *Key)
+{
+    b32 Result = ((Element->Label.Count == Key->Name.Count) &&
+                  (Element->LabelPrefix == Key->Prefix) &&
+                  ((Key->Name.Count <= 8) ||
+                   (memcmp(Element->Label.Data + 8, Key->Name.Data + 8, Key->Name.Count - 8) == 0)));
+    return Result;
+}
+
+static void BuildObjectIndex(json_parser *Parser, json_element *Object, u32 MemberCount)
+{
+    // NOTE: Keep the table at most half full so probe runs stay short
+    u32 SlotCount = 1;
+    while(SlotCount < 2*MemberCount)
+    {
+        SlotCount *= 2;
+    }
+    
+    u64 Size = sizeof(json_object_index) + SlotCount*sizeof(json_element *);
+    json_object_index *Index = 0;
+    if(Parser->Arena)
+    {
+        Index = (json_object_index *)PushSize(Parser->Arena, Size, alignof(json_object_index));
+    }
+    else
+    {
+        Index = (json_object_index *)malloc(Size);
+    }
+    
+    if(Index)
+    {
+        Index->SlotMask = SlotCount - 1;
+        Index->Slots = (json_element **)(Index + 1);
+        memset(Index->Slots, 0, SlotCount*sizeof(json_element *));
+        
+        for(json_element *Member = Object->FirstSubElement; Member; Member = Member->NextSibling)
+        {
+            json_label_key Key = {Member->Label, Member->LabelPrefix, HashLabel(Member->Label)};
+            
+            // NOTE: A repeated label keeps its first slot, same as the linear search would find
+            u32 Slot = (u32)Key.Hash & Index->SlotMask;
+            while(Index->Slots[Slot] && !LabelMatches(Index->Slots[Slot], &Key))
+            {
+                Slot = (Slot + 1) & Index->SlotMask;
+            }
+            
+            if(!Index->Slots[Slot])
+            {
+                Index->Slots[Slot] = Member;
+            }
+        }
+        
+        Object->Index = Index;
+    }
+    
+    // NOTE: Without an index, lookups just fall back to the linear search
+}
+
+static json_element *ParseJSONList(json_parser *Parser, json_token_type EndType, b32 HasLabels, u32 *MemberCount);
+static json_element *ParseJSONElement(json_parser *Parser, json_token Label, json_token Value)
 {
     b32 Valid = true;
     
     json_element *SubElement = 0;
+    u32 MemberCount = 0;
     if(Value.Type == Token_open_bracket)
     {
-        SubElement = ParseJSONList(Parser, Token_close_bracket, false);
+        SubElement = ParseJSONList(Parser, Token_close_bracket, false, &MemberCount);
     }
     else if(Value.Type == Token_open_brace)
     {
-        SubElement = ParseJSONList(Parser, Token_close_brace, true);
+        SubElement = ParseJSONList(Parser, Token_close_brace, true, &MemberCount);
     }
     else if((Value.Type == Token_string_literal) ||
             (Value.Type == Token_true) ||
@@ -278,30 +570,58 @@ static json_element *ParseJSONElement(json_parser *Parser, buffer Label, json_to
     
     if(Valid)
     {
-        Result = (json_element *)malloc(sizeof(json_element));
-        Result->Label = Label;
-        Result->Value = Value.Value;
-        Result->FirstSubElement = SubElement;
-        Result->NextSibling = 0;
+        // NOTE: Strings with escapes are decoded into space right after the element, so they
+        // come and go with it
+        u64 LabelSize = Label.Escaped ? Label.Value.Count : 0;
+        u64 ValueSize = Value.Escaped ? Value.Value.Count : 0;
+        u64 ElementSize = sizeof(json_element) + LabelSize + ValueSize;
+        if(Parser->Arena)
+        {
+            Result = (json_element *)PushSize(Parser->Arena, ElementSize, alignof(json_element));
+        }
+        else
+        {
+            Result = (json_element *)malloc(ElementSize);
+        }
+        
+        if(Result)
+        {
+            u8 *Decoded = (u8 *)(Result + 1);
+            Result->Label = LabelSize ? DecodeJSONString(Label.Value, Decoded) : Label.Value;
+            Result->Value = ValueSize ? DecodeJSONString(Value.Value, Decoded + LabelSize) : Value.Value;
+            Result->FirstSubElement = SubElement;
+            Result->Index = 0;
+            Result->NextSibling = 0;
+            Result->LabelPrefix = GetLabelPrefix(Result->Label);
+            
+            if((Value.Type == Token_open_brace) && (MemberCount > JSON_OBJECT_INDEX_THRESHOLD))
+            {
+                BuildObjectIndex(Parser, Result, MemberCount);
+            }
+        }
+        else
+        {
+            Error(Parser, Value, "Out of memory for JSON elements");
+        }
     }
     
     return Result;
 }
 
-static json_element *ParseJSONList(json_parser *Parser, json_token_type EndType, b32 HasLabels)
+static json_element *ParseJSONList(json_parser *Parser, json_token_type EndType, b32 HasLabels, u32 *MemberCount)
 {
     json_element *FirstElement = {};
     json_element *LastElement = {};
     
     while(IsParsing(Parser))
     {
-        buffer Label = {};
+        json_token Label = {};
         json_token Value = GetJSONToken(Parser);
         if(HasLabels)
         {
             if(Value.Type == Token_string_literal)
             {
-                Label = Value.Value;
+                Label = Value;
                 
                 json_token Colon = GetJSONToken(Parser);
                 if(Colon.Type == Token_colon)
@@ -323,6 +643,7 @@ static json_element *ParseJSONList(json_parser *Parser, json_token_type EndType,
         if(Element)
         {
             LastElement = (LastElement ? LastElement->NextSibling : FirstElement) = Element;
+            ++*MemberCount;
         }
         else if(Value.Type == EndType)
         {
@@ -347,12 +668,34 @@ static json_element *ParseJSONList(json_parser *Parser, json_token_type EndType,
     return FirstElement;
 }
 
-static json_element *ParseJSON(buffer InputJSON)
+// NOTE: Block size for large-page arenas if they ever outgrow GetJSONArenaSize
+#define JSON_ARENA_GROW_SIZE (64ull*1024*1024)
+
+static u64 GetJSONArenaSize(buffer InputJSON)
+{
+    // NOTE: Every element needs at least one byte for its value and one for the
+    // separator after it, so this is a hard upper bound on the element count.
+    u64 MaxElementCount = (InputJSON.Count / 2) + 1;
+    u64 Result = MaxElementCount*sizeof(json_element);
+    
+    // NOTE: Object indexes use at most 4 slots per member, and a member takes at least 4 bytes ("":0,)
+    u64 MaxMemberCount = (InputJSON.Count / 4) + 1;
+    Result += MaxMemberCount*4*sizeof(json_element *) + MaxElementCount*sizeof(json_object_index);
+    
+    // NOTE: Decoded strings are never longer than their raw text, but an escaped string can be as
+    // short as 4 input bytes ("\n") and still cost 7 bytes of alignment padding after it
+    Result += 3*InputJSON.Count;
+    return Result;
+}
+
+static json_element *ParseJSON(buffer InputJSON, memory_arena *Arena = 0, json_structural_indexer *Indexer = 0)
 {
     TimeFunction;
     
     json_parser Parser = {};
     Parser.Source = InputJSON;
+    Parser.Arena = Arena;
+    Parser.Indexer = Indexer;
     
     json_element *Result = ParseJSONElement(&Parser, {}, GetJSONToken(&Parser));
     return Result;
@@ -366,22 +709,38 @@ static void FreeJSON(json_element *Element)
         Element = Element->NextSibling;
     
         FreeJSON(FreeElement->FirstSubElement);
+        free(FreeElement->Index);
         free(FreeElement);
     }
 }
 
-static json_element *LookupElement(json_element *Object, buffer ElementName)
+static json_element *LookupElement(json_element *Object, json_label_key *Key)
 {
     json_element *Result = 0;
     
     if(Object)
     {
-        for(json_element *Search = Object->FirstSubElement; Search; Search = Search->NextSibling)
+        json_object_index *Index = Object->Index;
+        if(Index)
         {
-            if(AreEqual(Search->Label, ElementName))
+            for(u32 Slot = (u32)Key->Hash & Index->SlotMask; Index->Slots[Slot]; Slot = (Slot + 1) & Index->SlotMask)
             {
-                Result = Search;
-                break;
+                if(LabelMatches(Index->Slots[Slot], Key))
+                {
+                    Result = Index->Slots[Slot];
+                    break;
+                }
+            }
+        }
+        else
+        {
+            for(json_element *Search = Object->FirstSubElement; Search; Search = Search->NextSibling)
+            {
+                if(LabelMatches(Search, Key))
+                {
+                    Result = Search;
+                    break;
+                }
             }
         }
     }
@@ -389,6 +748,13 @@ static json_element *LookupElement(json_element *Object, buffer ElementName)
     return Result;
 }
 
+static json_element *LookupElement(json_element *Object, buffer ElementName)
+{
+    json_label_key Key = MakeLabelKey(ElementName);
+    json_element *Result = LookupElement(Object, &Key);
+    return Result;
+}
+
 static f64 ConvertJSONSign(buffer Source, u64 *AtResult)
 {
     u64 At = *AtResult;
@@ -429,84 +795,128 @@ static f64 ConvertJSONNumber(buffer Source, u64 *AtResult)
     return Result;
 }
 
-static f64 ConvertElementToF64(json_element *Object, buffer ElementName)
+// NOTE: The original conversion: fast, but the f64 accumulation and pow() aren't correctly
+// rounded. ConvertJSONValueToF64 (json_number.cpp) replaced it; this stays for comparison.
+inline f64 ConvertJSONValueToF64Naive(buffer Source)
 {
-    f64 Result = 0.0;
+    u64 At = 0;
     
-    json_element *Element = LookupElement(Object, ElementName);
-    if(Element)
+    f64 Sign = ConvertJSONSign(Source, &At);
+    f64 Number = ConvertJSONNumber(Source, &At);
+    
+    if(IsInBounds(Source, At) && (Source.Data[At] == '.'))
     {
-        buffer Source = Element->Value;
-        u64 At = 0;
-        
-        f64 Sign = ConvertJSONSign(Source, &At);
-        f64 Number = ConvertJSONNumber(Source, &At);
-        
-        if(IsInBounds(Source, At) && (Source.Data[At] == '.'))
+        ++At;
+        f64 C = 1.0 / 10.0;
+        while(IsInBounds(Source, At))
         {
-            ++At;
-            f64 C = 1.0 / 10.0;
-            while(IsInBounds(Source, At))
+            u8 Char = Source.Data[At] - (u8)'0';
+            if(Char < 10)
             {
-                u8 Char = Source.Data[At] - (u8)'0';
-                if(Char < 10)
-                {
-                    Number = Number + C*(f64)Char;
-                    C *= 1.0 / 10.0;
-                    ++At;
-                }
-                else
-                {
-                    break;
-                }
+                Number = Number + C*(f64)Char;
+                C *= 1.0 / 10.0;
+                ++At;
+            }
+            else
+            {
+                break;
             }
         }
-        
-        if(IsInBounds(Source, At) && ((Source.Data[At] == 'e') || (Source.Data[At] == 'E')))
+    }
+    
+    if(IsInBounds(Source, At) && ((Source.Data[At] == 'e') || (Source.Data[At] == 'E')))
+    {
+        ++At;
+        if(IsInBounds(Source, At) && (Source.Data[At] == '+'))
         {
             ++At;
-            if(IsInBounds(Source, At) && (Source.Data[At] == '+'))
-            {
-                ++At;
-            }
-
-            f64 ExponentSign = ConvertJSONSign(Source, &At);
-            f64 Exponent = ExponentSign*ConvertJSONNumber(Source, &At);
-            Number *= pow(10.0, Exponent);
         }
-        
-        Result = Sign*Number;
+
+        f64 ExponentSign = ConvertJSONSign(Source, &At);
+        f64 Exponent = ExponentSign*ConvertJSONNumber(Source, &At);
+        Number *= pow(10.0, Exponent);
+    }
+    
+    f64 Result = Sign*Number;
+    return Result;
+}
+
+static f64 ConvertElementToF64(json_element *Object, json_label_key *Key)
+{
+    f64 Result = 0.0;
+    
+    json_element *Element = LookupElement(Object, Key);
+    if(Element)
+    {
+        Result = ConvertJSONValueToF64(Element->Value);
     }
     
     return Result;
 }
 
-static u64 ParseHaversinePairs(buffer InputJSON, u64 MaxPairCount, haversine_pair *Pairs)
+inline f64 ConvertElementToF64(json_element *Object, buffer ElementName)
+{
+    json_label_key Key = MakeLabelKey(ElementName);
+    f64 Result = ConvertElementToF64(Object, &Key);
+    return Result;
+}
+
+static u64 ParseHaversinePairs(buffer InputJSON, u64 MaxPairCount, haversine_pair *Pairs,
+                               json_allocation_type AllocType = JSONAlloc_malloc,
+                               json_structural_indexer *Indexer = 0)
 {
     TimeFunction;
     
     u64 PairCount = 0;
     
-    json_element *JSON = ParseJSON(InputJSON);
+    memory_arena Arena = {};
+    if(AllocType != JSONAlloc_malloc)
+    {
+        TimeBlock("ReserveArena");
+        if(AllocType == JSONAlloc_ArenaLargePages)
+        {
+            // NOTE: Same worst-case bound as regular pages, which ReserveArena rounds up to the large
+            // page size, so the parse never has to leave its first block. Growing in chunks is only a
+            // fallback in case the bound is ever wrong.
+            Arena = ReserveArena(GetJSONArenaSize(InputJSON), true, JSON_ARENA_GROW_SIZE);
+        }
+        else
+        {
+            Arena = ReserveArena(GetJSONArenaSize(InputJSON));
+        }
+    }
+    
+    json_element *JSON = ParseJSON(InputJSON, Arena.Base ? &Arena : 0, Indexer);
     
     json_element *PairsArray = LookupElement(JSON, CONSTANT_STRING("pairs"));
     if(PairsArray)
     {
         TimeBlock("Lookup and Convert");
         
+        json_label_key X0 = MakeLabelKey(CONSTANT_STRING("x0"));
+        json_label_key Y0 = MakeLabelKey(CONSTANT_STRING("y0"));
+        json_label_key X1 = MakeLabelKey(CONSTANT_STRING("x1"));
+        json_label_key Y1 = MakeLabelKey(CONSTANT_STRING("y1"));
+        
         for(json_element *Element = PairsArray->FirstSubElement;
             Element && (PairCount < MaxPairCount);
             Element = Element->NextSibling)
         {
             haversine_pair *Pair = Pairs + PairCount++;
             
-            Pair->X0 = ConvertElementToF64(Element, CONSTANT_STRING("x0"));
-            Pair->Y0 = ConvertElementToF64(Element, CONSTANT_STRING("y0"));
-            Pair->X1 = ConvertElementToF64(Element, CONSTANT_STRING("x1"));
-            Pair->Y1 = ConvertElementToF64(Element, CONSTANT_STRING("y1"));
+            Pair->X0 = ConvertElementToF64(Element, &X0);
+            Pair->Y0 = ConvertElementToF64(Element, &Y0);
+            Pair->X1 = ConvertElementToF64(Element, &X1);
+            Pair->Y1 = ConvertElementToF64(Element, &Y1);
         }
     }
    
+    if(Arena.Base)
+    {
+        TimeBlock("ReleaseArena");
+        ReleaseArena(&Arena);
+    }
+    else
     {
         TimeBlock("FreeJSON");
         FreeJSON(JSON);
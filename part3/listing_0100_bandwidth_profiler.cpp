@@ -16,6 +16,8 @@
 
 #include "listing_0074_platform_metrics.cpp"
 
+#include <string.h>
+
 #ifndef PROFILER
 #define PROFILER 0
 #endif
@@ -26,6 +28,24 @@
 
 #if PROFILER
 
+#include "profile_counters.cpp"
+
+// NOTE: Only for CalibrateProfilerOverhead. The basic tester, since it only needs ReadCPUTimer - so a
+// program built with PROFILER can't include another repetition tester.
+#include "listing_0103_repetition_tester.cpp"
+
+#define MAX_PROFILER_ANCHOR_COUNT 4096
+#define MAX_PROFILER_THREAD_COUNT 256
+
+// NOTE: A node's key is its parent node and anchor packed together, so both have to fit in 32 bits
+#define PROFILER_ANCHOR_BITS 12
+#define MAX_PROFILER_NODE_COUNT 4096
+#define PROFILER_NODE_SLOT_BITS 13 // NOTE: Twice as many slots as nodes, so probe runs stay short
+#define PROFILER_OVERFLOW_NODE (MAX_PROFILER_NODE_COUNT - 1)
+static_assert((MAX_PROFILER_ANCHOR_COUNT <= (1 << PROFILER_ANCHOR_BITS)) &&
+              (MAX_PROFILER_NODE_COUNT <= (1u << (32 - PROFILER_ANCHOR_BITS))), "Node keys don't fit in 32 bits");
+
+// NOTE: Per-anchor totals for the flat report, summed from the call tree when it is printed
 struct profile_anchor
 {
     u64 TSCElapsedExclusive; // NOTE(casey): Does NOT include children
@@ -33,58 +53,394 @@ struct profile_anchor
     u64 HitCount;
     u64 ProcessedByteCount;
     char const *Label;
+    
+    // NOTE: The same two with the calibrated profiler overhead taken out
+    f64 CorrectedTSCExclusive;
+    f64 CorrectedTSCInclusive;
+    
+    u64 Counters[ProfileCounter_Count]; // NOTE: Inclusive, like the byte count
+};
+
+// NOTE: What one profile block costs, split by where the cycles land: Inside is between the two timer
+// reads, so it shows up in the block's own time; Outside is the rest, which lands in its parent's.
+struct profiler_overhead
+{
+    b32 Calibrated;
+    f64 Inside;
+    f64 Outside;
+    f64 FlatBlock; // NOTE: Back-to-back blocks timed from outside, should come out close to Inside + Outside
+};
+static profiler_overhead GlobalProfilerOverhead;
+
+// NOTE: One call path. The same anchor reached from two different parents gets two nodes. Node 0 is
+// the root (no block open). Once the table is full, new paths all land in PROFILER_OVERFLOW_NODE.
+struct profile_node
+{
+    u64 TSCElapsedExclusive;
+    u64 TSCElapsedInclusive; // NOTE: A node can never be open twice at once, so this can't double count
+    u64 HitCount;
+    u64 ProcessedByteCount;
+    char const *Label;
+    
+    u32 Parent;
+    u32 AnchorIndex;
+    
+    u64 Counters[ProfileCounter_Count]; // NOTE: Hardware counter deltas, inclusive of children
 };
-static profile_anchor GlobalProfilerAnchors[4096];
-static u32 GlobalProfilerParent;
+
+struct profile_node_slot
+{
+    u32 Key; // NOTE: 0 means empty, which no real key is since anchor indices start at 1
+    u32 Node;
+};
+
+// NOTE: One finished block, for the trace. The label comes from the thread's node at dump time.
+struct profile_trace_event
+{
+    u64 StartTSC;
+    u64 EndTSC;
+    u32 NodeIndex;
+};
+
+// NOTE: Every thread times into its own call tree, so a profile block never writes anything another
+// thread touches. The trees are only combined when the profile is printed.
+struct profiler_thread
+{
+    profile_node Nodes[MAX_PROFILER_NODE_COUNT];
+    profile_node_slot NodeSlots[1 << PROFILER_NODE_SLOT_BITS];
+    u32 LastNodeIndex;
+    u32 CurrentNode;
+    
+    char const *Name;
+    u32 NameIndex;
+    u32 Slot;
+    
+    // NOTE: Only allocated while tracing. A ring, so once TraceEventCount passes TraceMask + 1
+    // the oldest events have been overwritten.
+    profile_trace_event *TraceEvents;
+    u64 TraceEventCount;
+    u64 TraceMask;
+    
+    profile_counter_set *CounterSet; // NOTE: Only opened while counting
+};
+static profiler_thread *GlobalProfilerThreads[MAX_PROFILER_THREAD_COUNT];
+static u32 volatile GlobalProfilerThreadCount;
+static profiler_thread GlobalProfilerOverflowThread; // NOTE: Shared by any threads past the limit, so racy
+static thread_local profiler_thread *ThreadProfiler;
+
+static char const *GlobalProfilerTraceFileName;
+static u64 GlobalProfilerTraceCapacity; // NOTE: Events per thread, a power of two; 0 when not tracing
+
+static b32 GlobalProfilerCountersEnabled;
+static u32 GlobalProfilerCounterMask; // NOTE: 1 << profile_counter for each event the calling thread of EnableProfileCounters got
+static b32 GlobalProfilerCountersUseRead; // NOTE: No rdpmc for the calling thread, every block start and end is a read() call
+
+static void OpenThreadProfileCounters(profiler_thread *Thread)
+{
+    if(GlobalProfilerCountersEnabled && !Thread->CounterSet)
+    {
+        profile_counter_set *Set = (profile_counter_set *)calloc(1, sizeof(profile_counter_set));
+        if(Set && OpenProfileCounters(Set))
+        {
+            Thread->CounterSet = Set;
+        }
+        else
+        {
+            free(Set);
+        }
+    }
+}
+
+static void CloseThreadProfileCounters(profiler_thread *Thread)
+{
+    if(Thread->CounterSet)
+    {
+        CloseProfileCounters(Thread->CounterSet);
+        free(Thread->CounterSet);
+        Thread->CounterSet = 0;
+    }
+}
+
+static void AllocateProfileTrace(profiler_thread *Thread)
+{
+    if(GlobalProfilerTraceCapacity && !Thread->TraceEvents)
+    {
+        // NOTE: Touched up front so a block never takes a page fault writing its event
+        u64 Size = GlobalProfilerTraceCapacity*sizeof(profile_trace_event);
+        Thread->TraceEvents = (profile_trace_event *)malloc(Size);
+        if(Thread->TraceEvents)
+        {
+            memset(Thread->TraceEvents, 0, Size);
+            Thread->TraceMask = GlobalProfilerTraceCapacity - 1;
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Unable to allocate profile trace for a thread, it won't be traced\n");
+        }
+    }
+}
+
+// NOTE: Call once at the start of a thread to give it a name in the report. Threads that don't are
+// registered (unnamed) the first time they open a profile block.
+static profiler_thread *RegisterProfilerThread(char const *Name, u32 NameIndex = 0)
+{
+    profiler_thread *Result = ThreadProfiler;
+    if(!Result)
+    {
+#if _WIN32
+        u32 Slot = (u32)InterlockedIncrement((LONG volatile *)&GlobalProfilerThreadCount) - 1;
+#else
+        u32 Slot = __atomic_fetch_add(&GlobalProfilerThreadCount, 1, __ATOMIC_ACQ_REL);
+#endif
+        if(Slot < MAX_PROFILER_THREAD_COUNT)
+        {
+            Result = (profiler_thread *)calloc(1, sizeof(profiler_thread));
+        }
+        
+        if(Result)
+        {
+            Result->Name = Name;
+            Result->NameIndex = Name ? NameIndex : Slot;
+            Result->Slot = Slot;
+            AllocateProfileTrace(Result);
+            OpenThreadProfileCounters(Result);
+            GlobalProfilerThreads[Slot] = Result;
+        }
+        else
+        {
+            Result = &GlobalProfilerOverflowThread;
+        }
+        
+        ThreadProfiler = Result;
+    }
+    
+    return Result;
+}
+
+// NOTE: Call at the end of a registered thread. Its tables stay around for the report, only what it
+// holds open for counting is let go.
+static void ReleaseProfilerThread(void)
+{
+    profiler_thread *Thread = ThreadProfiler;
+    if(Thread && (Thread != &GlobalProfilerOverflowThread))
+    {
+        CloseThreadProfileCounters(Thread);
+    }
+}
+
+static u32 AddProfileNode(profiler_thread *Thread, profile_node_slot *Slot, u32 Key, u32 Parent, u32 AnchorIndex)
+{
+    u32 Result = PROFILER_OVERFLOW_NODE;
+    if((Thread->LastNodeIndex + 1) < PROFILER_OVERFLOW_NODE)
+    {
+        Result = ++Thread->LastNodeIndex;
+        Thread->Nodes[Result].Parent = Parent;
+        Thread->Nodes[Result].AnchorIndex = AnchorIndex;
+        
+        Slot->Key = Key;
+        Slot->Node = Result;
+    }
+    
+    return Result;
+}
+
+// NOTE: The node for AnchorIndex opened under Parent, created the first time that path is seen
+inline u32 GetProfileNode(profiler_thread *Thread, u32 Parent, u32 AnchorIndex)
+{
+    u32 Key = (Parent << PROFILER_ANCHOR_BITS) | AnchorIndex;
+    u32 SlotMask = ArrayCount(Thread->NodeSlots) - 1;
+    u32 SlotIndex = (Key*2654435761u) >> (32 - PROFILER_NODE_SLOT_BITS);
+    
+    u32 Result;
+    for(;;)
+    {
+        profile_node_slot *Slot = Thread->NodeSlots + SlotIndex;
+        if(Slot->Key == Key)
+        {
+            Result = Slot->Node;
+            break;
+        }
+        else if(!Slot->Key)
+        {
+            Result = AddProfileNode(Thread, Slot, Key, Parent, AnchorIndex);
+            break;
+        }
+        
+        SlotIndex = (SlotIndex + 1) & SlotMask;
+    }
+    
+    return Result;
+}
 
 struct profile_block
 {
-    profile_block(char const *Label_, u32 AnchorIndex_, u64 ByteCount)
+    profile_block(char const *Label_, u32 AnchorIndex, u64 ByteCount)
     {
-        ParentIndex = GlobalProfilerParent;
+        Thread = ThreadProfiler;
+        if(!Thread)
+        {
+            Thread = RegisterProfilerThread(0);
+        }
         
-        AnchorIndex = AnchorIndex_;
+        ParentIndex = Thread->CurrentNode;
+        NodeIndex = GetProfileNode(Thread, ParentIndex, AnchorIndex);
         Label = Label_;
 
-        profile_anchor *Anchor = GlobalProfilerAnchors + AnchorIndex;
-        OldTSCElapsedInclusive = Anchor->TSCElapsedInclusive;
-        Anchor->ProcessedByteCount += ByteCount;
+        Thread->Nodes[NodeIndex].ProcessedByteCount += ByteCount;
+        
+        Thread->CurrentNode = NodeIndex;
+        
+        // NOTE: Read outside the timed span, so the calibration counts it as overhead in the parent
+        if(Thread->CounterSet)
+        {
+            ReadProfileCounters(Thread->CounterSet, StartCounters);
+        }
         
-        GlobalProfilerParent = AnchorIndex;
         StartTSC = READ_BLOCK_TIMER();
     }
     
     ~profile_block(void)
     {
         u64 Elapsed = READ_BLOCK_TIMER() - StartTSC;
-        GlobalProfilerParent = ParentIndex;
+        Thread->CurrentNode = ParentIndex;
     
-        profile_anchor *Parent = GlobalProfilerAnchors + ParentIndex;
-        profile_anchor *Anchor = GlobalProfilerAnchors + AnchorIndex;
+        profile_node *Parent = Thread->Nodes + ParentIndex;
+        profile_node *Node = Thread->Nodes + NodeIndex;
         
         Parent->TSCElapsedExclusive -= Elapsed;
-        Anchor->TSCElapsedExclusive += Elapsed;
-        Anchor->TSCElapsedInclusive = OldTSCElapsedInclusive + Elapsed;
-        ++Anchor->HitCount;
+        Node->TSCElapsedExclusive += Elapsed;
+        Node->TSCElapsedInclusive += Elapsed;
+        ++Node->HitCount;
         
         /* NOTE(casey): This write happens every time solely because there is no
            straightforward way in C++ to have the same ease-of-use. In a better programming
            language, it would be simple to have the anchor points gathered and labeled at compile
            time, and this repetative write would be eliminated. */
-        Anchor->Label = Label;
+        Node->Label = Label;
+        
+        if(Thread->TraceEvents)
+        {
+            profile_trace_event *Event = Thread->TraceEvents + (Thread->TraceEventCount++ & Thread->TraceMask);
+            Event->StartTSC = StartTSC;
+            Event->EndTSC = StartTSC + Elapsed;
+            Event->NodeIndex = NodeIndex;
+        }
+        
+        profile_counter_set *Set = Thread->CounterSet;
+        if(Set)
+        {
+            u64 EndCounters[ProfileCounter_Count];
+            ReadProfileCounters(Set, EndCounters);
+            for(u32 EventIndex = 0; EventIndex < Set->EventCount; ++EventIndex)
+            {
+                u32 Counter = Set->Counters[EventIndex];
+                Node->Counters[Counter] += EndCounters[Counter] - StartCounters[Counter];
+            }
+        }
     }
     
+    profiler_thread *Thread;
     char const *Label;
-    u64 OldTSCElapsedInclusive;
     u64 StartTSC;
     u32 ParentIndex;
-    u32 AnchorIndex;
+    u32 NodeIndex;
+    u64 StartCounters[ProfileCounter_Count];
 };
 
+// NOTE: Times empty blocks on a private table with the repetition tester: each test is a run of flat
+// blocks timed from outside, then a parent around the same number of empty children. The tester keeps
+// going until its minimum stops improving, and the fastest block times the profiler recorded along the
+// way are kept with it. Flat blocks give the cost inside a block, the parent gives what each child
+// costs in all, and Outside is the difference. Only raw timings are minimized - a minimum of a
+// difference would chase the noise in either side.
+// The table traces and counts exactly like the calling thread, so those costs are calibrated too.
+static void CalibrateProfilerOverhead(void)
+{
+    u32 const BlocksPerTest = 64;
+    
+    profiler_thread *Calibration = (profiler_thread *)calloc(1, sizeof(profiler_thread));
+    if(Calibration)
+    {
+        profiler_thread *Saved = ThreadProfiler;
+        ThreadProfiler = Calibration;
+        
+        // NOTE: Same thread, so the counters (if any) can be borrowed. The trace ring gets a copy of its own.
+        Calibration->CounterSet = Saved ? Saved->CounterSet : 0;
+        if(Saved && Saved->TraceEvents)
+        {
+            AllocateProfileTrace(Calibration);
+        }
+        
+        // NOTE: Fixed anchor indices, they are only ever seen in this table
+        u32 FlatAnchor = 1;
+        u32 ParentAnchor = 2;
+        u32 ChildAnchor = 3;
+        
+        u64 MinFlatInclusive = ~0ull;
+        u64 MinParentInclusive = ~0ull;
+        
+        // NOTE: Estimating the frequency takes 100ms, so only the first calibration pays for it
+        static u64 CPUTimerFreq = EstimateCPUTimerFreq();
+        
+        repetition_tester Tester = {};
+        NewTestWave(&Tester, 0, CPUTimerFreq, 1);
+        Tester.PrintNewMinimums = false;
+        Tester.TryForTime = Tester.CPUTimerFreq / 20; // NOTE: A new minimum restarts this, so 50ms without one
+        (void)&CountBytes; // NOTE: Empty blocks process nothing, the target byte count stays 0
+        
+        printf("Profiler calibration (%u empty blocks per test):\n", BlocksPerTest);
+        while(IsTesting(&Tester))
+        {
+            for(u32 NodeIndex = 1; NodeIndex <= Calibration->LastNodeIndex; ++NodeIndex)
+            {
+                profile_node *Node = Calibration->Nodes + NodeIndex;
+                Node->TSCElapsedExclusive = Node->TSCElapsedInclusive = Node->HitCount = 0;
+            }
+            
+            BeginTime(&Tester);
+            for(u32 BlockIndex = 0; BlockIndex < BlocksPerTest; ++BlockIndex)
+            {
+                profile_block Block("Calibration", FlatAnchor, 0);
+            }
+            EndTime(&Tester);
+            
+            {
+                profile_block Parent("Calibration parent", ParentAnchor, 0);
+                for(u32 BlockIndex = 0; BlockIndex < BlocksPerTest; ++BlockIndex)
+                {
+                    profile_block Child("Calibration child", ChildAnchor, 0);
+                }
+            }
+            
+            u64 FlatInclusive = Calibration->Nodes[GetProfileNode(Calibration, 0, FlatAnchor)].TSCElapsedInclusive;
+            u64 ParentInclusive = Calibration->Nodes[GetProfileNode(Calibration, 0, ParentAnchor)].TSCElapsedInclusive;
+            MinFlatInclusive = (FlatInclusive < MinFlatInclusive) ? FlatInclusive : MinFlatInclusive;
+            MinParentInclusive = (ParentInclusive < MinParentInclusive) ? ParentInclusive : MinParentInclusive;
+        }
+        
+        if(Tester.Mode == TestMode_Completed)
+        {
+            // NOTE: The parent's inclusive time is its own Inside plus Inside + Outside for every child
+            f64 Inside = (f64)MinFlatInclusive / (f64)BlocksPerTest;
+            f64 Outside = ((f64)MinParentInclusive - Inside) / (f64)BlocksPerTest - Inside;
+            
+            GlobalProfilerOverhead.Calibrated = true;
+            GlobalProfilerOverhead.Inside = Inside;
+            GlobalProfilerOverhead.Outside = (Outside > 0) ? Outside : 0;
+            // NOTE: The tester reads ReadCPUTimer, which is the block timer unless READ_BLOCK_TIMER says otherwise
+            GlobalProfilerOverhead.FlatBlock = (f64)Tester.Results.MinTime / (f64)BlocksPerTest;
+        }
+        
+        ThreadProfiler = Saved;
+        free(Calibration->TraceEvents);
+        free(Calibration);
+    }
+}
+
 #define NameConcat2(A, B) A##B
 #define NameConcat(A, B) NameConcat2(A, B)
 #define TimeBandwidth(Name, ByteCount) profile_block NameConcat(Block, __LINE__)(Name, __COUNTER__ + 1, ByteCount)
-#define ProfilerEndOfCompilationUnit static_assert(__COUNTER__ < ArrayCount(GlobalProfilerAnchors), "Number of profile points exceeds size of profiler::Anchors array")
+#define ProfilerEndOfCompilationUnit static_assert(__COUNTER__ < MAX_PROFILER_ANCHOR_COUNT, "Number of profile points exceeds MAX_PROFILER_ANCHOR_COUNT")
 
 static void PrintTimeElapsed(u64 TotalTSCElapsed, u64 TimerFreq, profile_anchor *Anchor)
 {
@@ -97,6 +453,51 @@ static void PrintTimeElapsed(u64 TotalTSCElapsed, u64 TimerFreq, profile_anchor
     }
     printf(")");
     
+    if(GlobalProfilerCounterMask)
+    {
+        u32 Mask = GlobalProfilerCounterMask;
+        u64 *Counters = Anchor->Counters;
+        
+        u32 IPCMask = (1 << ProfileCounter_Cycles) | (1 << ProfileCounter_Instructions);
+        if(((Mask & IPCMask) == IPCMask) && Counters[ProfileCounter_Cycles])
+        {
+            printf("  IPC %.2f", (f64)Counters[ProfileCounter_Instructions] / (f64)Counters[ProfileCounter_Cycles]);
+        }
+        
+        // NOTE: Misses per byte where the block counts bytes, otherwise per thousand instructions
+        f64 Divisor = (f64)Anchor->ProcessedByteCount;
+        char const *Unit = "/byte";
+        if(!Anchor->ProcessedByteCount && (Mask & (1 << ProfileCounter_Instructions)))
+        {
+            Divisor = (f64)Counters[ProfileCounter_Instructions] / 1000.0;
+            Unit = "/kinst";
+        }
+        
+        if(Divisor > 0)
+        {
+            for(u32 Counter = ProfileCounter_L1DMisses; Counter < ProfileCounter_Count; ++Counter)
+            {
+                if(Mask & (1 << Counter))
+                {
+                    printf("  %s%s %.4f", DescribeProfileCounter((profile_counter)Counter), Unit,
+                           (f64)Counters[Counter] / Divisor);
+                }
+            }
+        }
+    }
+    
+    if(GlobalProfilerOverhead.Calibrated)
+    {
+        f64 CorrectedPercent = 100.0 * (Anchor->CorrectedTSCExclusive / (f64)TotalTSCElapsed);
+        printf("  corrected %.0f (%.2f%%", Anchor->CorrectedTSCExclusive, CorrectedPercent);
+        if(Anchor->TSCElapsedInclusive != Anchor->TSCElapsedExclusive)
+        {
+            f64 CorrectedPercentWithChildren = 100.0 * (Anchor->CorrectedTSCInclusive / (f64)TotalTSCElapsed);
+            printf(", %.2f%% w/children", CorrectedPercentWithChildren);
+        }
+        printf(")");
+    }
+    
     if(Anchor->ProcessedByteCount)
     {
         f64 Megabyte = 1024.0f*1024.0f;
@@ -113,14 +514,376 @@ static void PrintTimeElapsed(u64 TotalTSCElapsed, u64 TimerFreq, profile_anchor
     printf("\n");
 }
 
+static char const *GetProfileNodeLabel(profiler_thread *Thread, u32 NodeIndex)
+{
+    char const *Result = Thread->Nodes[NodeIndex].Label;
+    if(NodeIndex == PROFILER_OVERFLOW_NODE)
+    {
+        Result = "(call tree full, other paths)";
+    }
+    else if(!Result)
+    {
+        Result = "?";
+    }
+    
+    return Result;
+}
+
+static void PrintProfilerThreadName(profiler_thread *Thread)
+{
+    if(Thread == &GlobalProfilerOverflowThread)
+    {
+        printf("  (threads past %u):\n", MAX_PROFILER_THREAD_COUNT);
+    }
+    else
+    {
+        printf("  %s %u:\n", Thread->Name ? Thread->Name : "thread", Thread->NameIndex);
+    }
+}
+
+static b32 HasAnchorData(profiler_thread *Thread)
+{
+    b32 Result = false;
+    for(u32 NodeIndex = 1; NodeIndex < MAX_PROFILER_NODE_COUNT; ++NodeIndex)
+    {
+        if(Thread->Nodes[NodeIndex].TSCElapsedInclusive)
+        {
+            Result = true;
+            break;
+        }
+    }
+    
+    return Result;
+}
+
+// NOTE: How many blocks were opened directly inside each node, and anywhere below it
+static void CountProfileNodeChildHits(profiler_thread *Thread, u64 *ChildHits, u64 *DescendantHits)
+{
+    memset(ChildHits, 0, MAX_PROFILER_NODE_COUNT*sizeof(u64));
+    memset(DescendantHits, 0, MAX_PROFILER_NODE_COUNT*sizeof(u64));
+    
+    // NOTE: A node is always created after its parent, so walking back to front sees every child first
+    for(u32 NodeIndex = MAX_PROFILER_NODE_COUNT - 1; NodeIndex > 0; --NodeIndex)
+    {
+        profile_node *Node = Thread->Nodes + NodeIndex;
+        ChildHits[Node->Parent] += Node->HitCount;
+        DescendantHits[Node->Parent] += Node->HitCount + DescendantHits[NodeIndex];
+    }
+}
+
+static profile_anchor GetProfileNodeTotals(profiler_thread *Thread, u32 NodeIndex, u64 *ChildHits, u64 *DescendantHits)
+{
+    profile_node *Node = Thread->Nodes + NodeIndex;
+    
+    profile_anchor Result = {};
+    Result.TSCElapsedExclusive = Node->TSCElapsedExclusive;
+    Result.TSCElapsedInclusive = Node->TSCElapsedInclusive;
+    Result.HitCount = Node->HitCount;
+    Result.ProcessedByteCount = Node->ProcessedByteCount;
+    Result.Label = GetProfileNodeLabel(Thread, NodeIndex);
+    memcpy(Result.Counters, Node->Counters, sizeof(Result.Counters));
+    
+    // NOTE: Each hit leaves its inside cost in this node; each child leaves its outside cost here too, and
+    // inclusive time also holds every descendant's full cost
+    profiler_overhead *Overhead = &GlobalProfilerOverhead;
+    f64 Exclusive = (f64)Result.TSCElapsedExclusive - Overhead->Inside*(f64)Node->HitCount -
+        Overhead->Outside*(f64)ChildHits[NodeIndex];
+    f64 Inclusive = (f64)Result.TSCElapsedInclusive - Overhead->Inside*(f64)Node->HitCount -
+        (Overhead->Inside + Overhead->Outside)*(f64)DescendantHits[NodeIndex];
+    
+    if(NodeIndex == PROFILER_OVERFLOW_NODE)
+    {
+        // NOTE: Overflowed paths nest inside each other in this one node, so only its exclusive time means anything
+        Result.TSCElapsedInclusive = Result.TSCElapsedExclusive;
+        Inclusive = Exclusive;
+    }
+    
+    Result.CorrectedTSCExclusive = (Exclusive > 0) ? Exclusive : 0;
+    Result.CorrectedTSCInclusive = (Inclusive > 0) ? Inclusive : 0;
+    
+    return Result;
+}
+
+static void AccumulateAnchorTotals(profiler_thread *Thread, profile_anchor *Totals)
+{
+    static u64 ChildHits[MAX_PROFILER_NODE_COUNT];
+    static u64 DescendantHits[MAX_PROFILER_NODE_COUNT];
+    CountProfileNodeChildHits(Thread, ChildHits, DescendantHits);
+    
+    for(u32 NodeIndex = 1; NodeIndex < MAX_PROFILER_NODE_COUNT; ++NodeIndex)
+    {
+        profile_node *Node = Thread->Nodes + NodeIndex;
+        if(Node->HitCount)
+        {
+            profile_anchor Path = GetProfileNodeTotals(Thread, NodeIndex, ChildHits, DescendantHits);
+            
+            profile_anchor *Total = Totals + Node->AnchorIndex;
+            Total->TSCElapsedExclusive += Path.TSCElapsedExclusive;
+            Total->CorrectedTSCExclusive += Path.CorrectedTSCExclusive;
+            Total->HitCount += Path.HitCount;
+            Total->ProcessedByteCount += Path.ProcessedByteCount;
+            Total->Label = Path.Label;
+            
+            // NOTE: Under a recursive call of the same anchor, the outermost call's inclusive time
+            // already covers this one
+            b32 Recursive = false;
+            for(u32 Ancestor = Node->Parent; Ancestor; Ancestor = Thread->Nodes[Ancestor].Parent)
+            {
+                if(Thread->Nodes[Ancestor].AnchorIndex == Node->AnchorIndex)
+                {
+                    Recursive = true;
+                    break;
+                }
+            }
+            
+            if(!Recursive)
+            {
+                Total->TSCElapsedInclusive += Path.TSCElapsedInclusive;
+                Total->CorrectedTSCInclusive += Path.CorrectedTSCInclusive;
+                for(u32 Counter = 0; Counter < ProfileCounter_Count; ++Counter)
+                {
+                    Total->Counters[Counter] += Path.Counters[Counter];
+                }
+            }
+        }
+    }
+}
+
+static void PrintAnchorTotals(u64 TotalCPUElapsed, u64 TimerFreq, profile_anchor *Totals, char const *Indent)
+{
+    for(u32 AnchorIndex = 0; AnchorIndex < MAX_PROFILER_ANCHOR_COUNT; ++AnchorIndex)
+    {
+        profile_anchor *Total = Totals + AnchorIndex;
+        if(Total->TSCElapsedInclusive)
+        {
+            printf("%s", Indent);
+            PrintTimeElapsed(TotalCPUElapsed, TimerFreq, Total);
+        }
+    }
+}
+
+struct profile_tree_links
+{
+    u32 FirstChild[MAX_PROFILER_NODE_COUNT];
+    u32 NextSibling[MAX_PROFILER_NODE_COUNT];
+    u64 ChildHits[MAX_PROFILER_NODE_COUNT];
+    u64 DescendantHits[MAX_PROFILER_NODE_COUNT];
+};
+
+static void PrintProfileNodeChildren(u64 TotalCPUElapsed, u64 TimerFreq, profiler_thread *Thread,
+                                     profile_tree_links *Links, u32 NodeIndex, u32 Depth)
+{
+    for(u32 Child = Links->FirstChild[NodeIndex]; Child; Child = Links->NextSibling[Child])
+    {
+        if(Thread->Nodes[Child].TSCElapsedInclusive)
+        {
+            profile_anchor Path = GetProfileNodeTotals(Thread, Child, Links->ChildHits, Links->DescendantHits);
+            
+            printf("%*s", 2*Depth, "");
+            PrintTimeElapsed(TotalCPUElapsed, TimerFreq, &Path);
+        }
+        
+        PrintProfileNodeChildren(TotalCPUElapsed, TimerFreq, Thread, Links, Child, Depth + 1);
+    }
+}
+
+static void PrintProfileCallTree(u64 TotalCPUElapsed, u64 TimerFreq, profiler_thread *Thread, u32 Depth)
+{
+    static profile_tree_links Links;
+    CountProfileNodeChildHits(Thread, Links.ChildHits, Links.DescendantHits);
+    
+    // NOTE: Linked back to front, so children come out in the order their paths were first seen
+    u32 *FirstChild = Links.FirstChild;
+    u32 *NextSibling = Links.NextSibling;
+    memset(FirstChild, 0, sizeof(Links.FirstChild));
+    for(u32 NodeIndex = MAX_PROFILER_NODE_COUNT - 1; NodeIndex > 0; --NodeIndex)
+    {
+        u32 Parent = Thread->Nodes[NodeIndex].Parent;
+        NextSibling[NodeIndex] = FirstChild[Parent];
+        FirstChild[Parent] = NodeIndex;
+    }
+    
+    PrintProfileNodeChildren(TotalCPUElapsed, TimerFreq, Thread, &Links, 0, Depth);
+}
+
+// NOTE: Must not race with profile blocks still running on other threads, so call it once they are done
 static void PrintAnchorData(u64 TotalCPUElapsed, u64 TimerFreq)
 {
-    for(u32 AnchorIndex = 0; AnchorIndex < ArrayCount(GlobalProfilerAnchors); ++AnchorIndex)
+    u32 ThreadCount = GlobalProfilerThreadCount;
+    if(ThreadCount > MAX_PROFILER_THREAD_COUNT)
+    {
+        ThreadCount = MAX_PROFILER_THREAD_COUNT;
+    }
+    
+    profiler_thread *Threads[MAX_PROFILER_THREAD_COUNT + 1];
+    u32 ActiveThreadCount = 0;
+    for(u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ++ThreadIndex)
+    {
+        profiler_thread *Thread = GlobalProfilerThreads[ThreadIndex];
+        if(Thread && HasAnchorData(Thread))
+        {
+            Threads[ActiveThreadCount++] = Thread;
+        }
+    }
+    
+    if(HasAnchorData(&GlobalProfilerOverflowThread))
+    {
+        Threads[ActiveThreadCount++] = &GlobalProfilerOverflowThread;
+    }
+    
+    if(ActiveThreadCount > 1)
+    {
+        printf("(summed over %u threads, so percentages can add up past 100%%)\n", ActiveThreadCount);
+    }
+    
+    static profile_anchor Totals[MAX_PROFILER_ANCHOR_COUNT];
+    memset(Totals, 0, sizeof(Totals));
+    for(u32 ThreadIndex = 0; ThreadIndex < ActiveThreadCount; ++ThreadIndex)
+    {
+        AccumulateAnchorTotals(Threads[ThreadIndex], Totals);
+    }
+    
+    profiler_overhead *Overhead = &GlobalProfilerOverhead;
+    if(Overhead->Calibrated)
+    {
+        u64 BlockCount = 0;
+        for(u32 AnchorIndex = 0; AnchorIndex < MAX_PROFILER_ANCHOR_COUNT; ++AnchorIndex)
+        {
+            BlockCount += Totals[AnchorIndex].HitCount;
+        }
+        
+        f64 PerBlock = Overhead->Inside + Overhead->Outside;
+        f64 OverheadPercent = 100.0 * (PerBlock*(f64)BlockCount / (f64)TotalCPUElapsed);
+        printf("Profiler overhead: %.1f cycles/block (%.1f inside, %.1f outside; %.1f back to back), "
+               "%llu blocks, %.2f%% of total\n",
+               PerBlock, Overhead->Inside, Overhead->Outside, Overhead->FlatBlock, BlockCount, OverheadPercent);
+        
+        // NOTE: The two are measured independently, so a big gap means the calibration ran into noise
+        f64 Gap = fabs(PerBlock - Overhead->FlatBlock);
+        if(Gap > 0.25*Overhead->FlatBlock)
+        {
+            fprintf(stderr, "WARNING: Profiler overhead calibration is unreliable (%.1f inside + outside vs. %.1f back to back), "
+                    "corrected times may be off\n", PerBlock, Overhead->FlatBlock);
+        }
+        
+        if(GlobalProfilerCountersUseRead)
+        {
+            printf("NOTE: Counters were read with read(), a system call at every block start and end. The overhead above "
+                   "includes it and is taken out of the times, but the counts still include its user-mode side.\n");
+        }
+    }
+    
+    PrintAnchorTotals(TotalCPUElapsed, TimerFreq, Totals, "");
+    
+    if(ActiveThreadCount > 1)
+    {
+        printf("\nPer thread:\n");
+        for(u32 ThreadIndex = 0; ThreadIndex < ActiveThreadCount; ++ThreadIndex)
+        {
+            profiler_thread *Thread = Threads[ThreadIndex];
+            PrintProfilerThreadName(Thread);
+            
+            memset(Totals, 0, sizeof(Totals));
+            AccumulateAnchorTotals(Thread, Totals);
+            PrintAnchorTotals(TotalCPUElapsed, TimerFreq, Totals, "  ");
+        }
+    }
+    
+    printf("\nCall tree:\n");
+    for(u32 ThreadIndex = 0; ThreadIndex < ActiveThreadCount; ++ThreadIndex)
+    {
+        profiler_thread *Thread = Threads[ThreadIndex];
+        if(ActiveThreadCount > 1)
+        {
+            PrintProfilerThreadName(Thread);
+        }
+        PrintProfileCallTree(TotalCPUElapsed, TimerFreq, Thread, (ActiveThreadCount > 1) ? 1 : 0);
+    }
+}
+
+static void WriteTraceString(FILE *Out, char const *String)
+{
+    fputc('"', Out);
+    for(char const *At = String; *At; ++At)
     {
-        profile_anchor *Anchor = GlobalProfilerAnchors + AnchorIndex;
-        if(Anchor->TSCElapsedInclusive)
+        if((*At == '"') || (*At == '\\'))
         {
-            PrintTimeElapsed(TotalCPUElapsed, TimerFreq, Anchor);
+            fputc('\\', Out);
+        }
+        fputc(*At, Out);
+    }
+    fputc('"', Out);
+}
+
+static void WriteProfileTrace(u64 StartTSC, u64 TimerFreq)
+{
+    if(GlobalProfilerTraceFileName && TimerFreq)
+    {
+        FILE *Out = fopen(GlobalProfilerTraceFileName, "wb");
+        if(Out)
+        {
+            // NOTE: Chrome trace timestamps are in microseconds
+            f64 MicrosecondsPerTick = 1000000.0 / (f64)TimerFreq;
+            
+            u64 WrittenCount = 0;
+            u64 DroppedCount = 0;
+            char const *Separator = "";
+            
+            fprintf(Out, "{\"traceEvents\":[\n");
+            
+            u32 ThreadCount = GlobalProfilerThreadCount;
+            if(ThreadCount > MAX_PROFILER_THREAD_COUNT)
+            {
+                ThreadCount = MAX_PROFILER_THREAD_COUNT;
+            }
+            
+            for(u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ++ThreadIndex)
+            {
+                profiler_thread *Thread = GlobalProfilerThreads[ThreadIndex];
+                if(Thread && Thread->TraceEvents && Thread->TraceEventCount)
+                {
+                    char Name[64];
+                    snprintf(Name, sizeof(Name), "%s %u", Thread->Name ? Thread->Name : "thread", Thread->NameIndex);
+                    fprintf(Out, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":",
+                            Separator, Thread->Slot);
+                    WriteTraceString(Out, Name);
+                    fprintf(Out, "}}");
+                    Separator = ",\n";
+                    
+                    u64 Capacity = Thread->TraceMask + 1;
+                    u64 First = 0;
+                    if(Thread->TraceEventCount > Capacity)
+                    {
+                        First = Thread->TraceEventCount - Capacity;
+                        DroppedCount += First;
+                    }
+                    
+                    for(u64 EventIndex = First; EventIndex < Thread->TraceEventCount; ++EventIndex)
+                    {
+                        profile_trace_event *Event = Thread->TraceEvents + (EventIndex & Thread->TraceMask);
+                        fprintf(Out, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"name\":", Separator, Thread->Slot);
+                        WriteTraceString(Out, GetProfileNodeLabel(Thread, Event->NodeIndex));
+                        fprintf(Out, ",\"ts\":%.3f,\"dur\":%.3f}",
+                                (f64)(int64_t)(Event->StartTSC - StartTSC)*MicrosecondsPerTick,
+                                (f64)(Event->EndTSC - Event->StartTSC)*MicrosecondsPerTick);
+                        ++WrittenCount;
+                    }
+                }
+            }
+            
+            fprintf(Out, "\n]}\n");
+            fclose(Out);
+            
+            printf("Trace: %llu events written to %s", WrittenCount, GlobalProfilerTraceFileName);
+            if(DroppedCount)
+            {
+                printf(" (%llu oldest dropped, the ring holds %llu per thread)", DroppedCount, GlobalProfilerTraceCapacity);
+            }
+            printf("\n");
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Unable to open \"%s\" for the profile trace.\n", GlobalProfilerTraceFileName);
         }
     }
 }
@@ -129,6 +892,12 @@ static void PrintAnchorData(u64 TotalCPUElapsed, u64 TimerFreq)
 
 #define TimeBandwidth(...)
 #define PrintAnchorData(...)
+#define RegisterProfilerThread(...)
+#define ReleaseProfilerThread(...)
+#define EnableProfileTrace(...)
+#define CalibrateProfilerOverhead(...)
+#define EnableProfileCounters(...) 0
+#define WriteProfileTrace(...)
 #define ProfilerEndOfCompilationUnit
 
 #endif
@@ -175,9 +944,78 @@ static u64 EstimateBlockTimerFreq(void)
 
 static void BeginProfile(void)
 {
+    RegisterProfilerThread("main");
+    CalibrateProfilerOverhead();
     GlobalProfiler.StartTSC = READ_BLOCK_TIMER();
 }
 
+#if PROFILER
+
+// NOTE: Blocks just got more expensive, so measure them again, and keep that out of the total
+inline void RecalibrateProfilerOverhead(void)
+{
+    CalibrateProfilerOverhead();
+    if(GlobalProfiler.StartTSC)
+    {
+        GlobalProfiler.StartTSC = READ_BLOCK_TIMER();
+    }
+}
+
+// NOTE: Also record every block's start and end, into a ring of EventCapacity events per thread, and
+// write them as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) when the profile is printed.
+// Threads registered before this is called aren't traced, except the calling one.
+inline void EnableProfileTrace(char const *FileName, u64 EventCapacity = 1 << 16)
+{
+    u64 Capacity = 1;
+    while(Capacity < EventCapacity)
+    {
+        Capacity <<= 1;
+    }
+    
+    GlobalProfilerTraceFileName = FileName;
+    GlobalProfilerTraceCapacity = Capacity;
+    
+    AllocateProfileTrace(RegisterProfilerThread(0));
+    
+    RecalibrateProfilerOverhead();
+}
+
+// NOTE: Also attribute hardware counter deltas (see profile_counters.cpp) to every block. Threads
+// registered before this is called don't count, except the calling one. Returns false if the counters
+// couldn't be opened, in which case profiling goes on without them.
+inline b32 EnableProfileCounters(void)
+{
+    GlobalProfilerCountersEnabled = true;
+    
+    profiler_thread *Thread = RegisterProfilerThread(0);
+    OpenThreadProfileCounters(Thread);
+    
+    b32 Result = (Thread->CounterSet != 0);
+    if(Result)
+    {
+        profile_counter_set *Set = Thread->CounterSet;
+        printf("Performance counters:");
+        for(u32 EventIndex = 0; EventIndex < Set->EventCount; ++EventIndex)
+        {
+            GlobalProfilerCounterMask |= (1 << Set->Counters[EventIndex]);
+            printf(" %s", DescribeProfileCounter((profile_counter)Set->Counters[EventIndex]));
+        }
+        printf(" (read with %s)\n", Set->UseRDPMC ? "rdpmc" : "read()");
+        GlobalProfilerCountersUseRead = !Set->UseRDPMC;
+        
+        RecalibrateProfilerOverhead();
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Unable to open hardware performance counters (no PMU, or perf_event_paranoid too high)\n");
+        GlobalProfilerCountersEnabled = false;
+    }
+    
+    return Result;
+}
+
+#endif
+
 static void EndAndPrintProfile()
 {
     GlobalProfiler.EndTSC = READ_BLOCK_TIMER();
@@ -191,4 +1029,6 @@ static void EndAndPrintProfile()
     }
     
     PrintAnchorData(TotalTSCElapsed, TimerFreq);
+    WriteProfileTrace(GlobalProfiler.StartTSC, TimerFreq);
+    ReleaseProfilerThread();
 }
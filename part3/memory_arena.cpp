@@ -0,0 +1,274 @@
+/* ========================================================================
+   Linear arena for bulk allocations (json_element trees, pair arrays, ...)
+
+   The whole range is reserved up front and pages are only committed as the
+   arena grows, so reserving a generous worst-case size costs nothing until
+   it is actually touched. Everything is released at once in ReleaseArena.
+
+   Large pages break that: they are committed (and pinned) as soon as they
+   are mapped, so a worst-case reservation costs its full size. An arena
+   reserved with a GrowSize starts smaller and chains on another block of
+   at least that size whenever a push doesn't fit.
+   ======================================================================== */
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// NOTE: Stored at the start of each chained block, describing the block before it
+struct memory_arena_block
+{
+    u8 *Base;
+    u64 Reserved;
+    u64 Committed;
+    u64 Used;
+    b32 LargePages;
+
+    memory_arena_block *Prev;
+};
+
+struct memory_arena
+{
+    u8 *Base;
+    u64 Reserved;
+    u64 Committed;
+    u64 Used;
+    b32 LargePages;
+
+    // NOTE: Zero means the arena never grows past its first block
+    u64 GrowSize;
+    b32 GrowLargePages;
+    memory_arena_block *PrevBlock;
+};
+
+// NOTE: Windows has to commit as it goes (committing the whole reservation
+// would count against the commit limit), so commit in reasonably big steps.
+#define ARENA_COMMIT_GRANULARITY (64ull*1024*1024)
+
+#define ARENA_HUGE_PAGE_SIZE (2ull*1024*1024)
+
+inline u64 AlignPow2(u64 Value, u64 Alignment)
+{
+    u64 Result = (Value + Alignment - 1) & ~(Alignment - 1);
+    return Result;
+}
+
+static memory_arena ReserveArena(u64 Size, b32 UseLargePages = false, u64 GrowSize = 0)
+{
+    memory_arena Result = {};
+
+#if _WIN32
+    if(UseLargePages)
+    {
+        // NOTE: Large pages must be committed in full at allocation time and
+        // need SeLockMemoryPrivilege, so this only succeeds for modest sizes on
+        // machines set up for it. Otherwise we fall back to regular pages.
+        u64 LargePageSize = GetLargePageMinimum();
+        if(LargePageSize)
+        {
+            u64 AllocSize = AlignPow2(Size, LargePageSize);
+            Result.Base = (u8 *)VirtualAlloc(0, AllocSize, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE);
+            if(Result.Base)
+            {
+                Result.Reserved = Result.Committed = AllocSize;
+                Result.LargePages = true;
+            }
+        }
+    }
+
+    if(!Result.Base)
+    {
+        u64 AllocSize = AlignPow2(Size, ARENA_COMMIT_GRANULARITY);
+        Result.Base = (u8 *)VirtualAlloc(0, AllocSize, MEM_RESERVE, PAGE_NOACCESS);
+        if(Result.Base)
+        {
+            Result.Reserved = AllocSize;
+        }
+    }
+#else
+    int Flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE;
+
+    if(UseLargePages)
+    {
+        // NOTE: MAP_HUGETLB only works if the hugetlbfs pool has been set up
+        // (vm.nr_hugepages), so if that fails, fall back to transparent huge pages.
+        // MAP_NORESERVE must not be used here - the mapping would succeed and
+        // then SIGBUS on first touch once the pool runs dry.
+        u64 AllocSize = AlignPow2(Size, ARENA_HUGE_PAGE_SIZE);
+        void *Data = mmap(0, AllocSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(Data != MAP_FAILED)
+        {
+            Result.Base = (u8 *)Data;
+            Result.Reserved = AllocSize;
+            Result.LargePages = true;
+        }
+    }
+
+    if(!Result.Base)
+    {
+        u64 AllocSize = AlignPow2(Size, ARENA_HUGE_PAGE_SIZE);
+        void *Data = mmap(0, AllocSize, PROT_READ|PROT_WRITE, Flags, -1, 0);
+        if(Data != MAP_FAILED)
+        {
+            Result.Base = (u8 *)Data;
+            Result.Reserved = AllocSize;
+
+            if(UseLargePages)
+            {
+                Result.LargePages = (madvise(Data, AllocSize, MADV_HUGEPAGE) == 0);
+            }
+        }
+    }
+
+    // NOTE: Linux commits lazily on first touch, so the whole range counts as committed
+    Result.Committed = Result.Reserved;
+#endif
+
+    if(!Result.Base)
+    {
+        fprintf(stderr, "ERROR: Unable to reserve %llu bytes for arena.\n", Size);
+    }
+
+    Result.GrowSize = GrowSize;
+    Result.GrowLargePages = UseLargePages;
+
+    return Result;
+}
+
+// NOTE: Makes sure everything below End is committed
+static b32 CommitArena(memory_arena *Arena, u64 End)
+{
+    b32 Result = true;
+
+#if _WIN32
+    if(End > Arena->Committed)
+    {
+        u64 CommitEnd = AlignPow2(End, ARENA_COMMIT_GRANULARITY);
+        if(CommitEnd > Arena->Reserved)
+        {
+            CommitEnd = Arena->Reserved;
+        }
+
+        // NOTE: This fails once the system commit limit is hit, and then the pages aren't usable
+        Result = (VirtualAlloc(Arena->Base + Arena->Committed, CommitEnd - Arena->Committed, MEM_COMMIT, PAGE_READWRITE) != 0);
+        if(Result)
+        {
+            Arena->Committed = CommitEnd;
+        }
+    }
+#else
+    (void)Arena;
+    (void)End;
+#endif
+
+    return Result;
+}
+
+// NOTE: Frees the current block and steps back to the one before it
+static void FreeArenaBlock(memory_arena *Arena)
+{
+    // NOTE: The link lives in the block being freed, so copy it out first
+    memory_arena_block Link = {};
+    if(Arena->PrevBlock)
+    {
+        Link = *Arena->PrevBlock;
+    }
+
+    if(Arena->Base)
+    {
+#if _WIN32
+        VirtualFree(Arena->Base, 0, MEM_RELEASE);
+#else
+        munmap(Arena->Base, Arena->Reserved);
+#endif
+    }
+
+    Arena->Base = Link.Base;
+    Arena->Reserved = Link.Reserved;
+    Arena->Committed = Link.Committed;
+    Arena->Used = Link.Used;
+    Arena->LargePages = Link.LargePages;
+    Arena->PrevBlock = Link.Prev;
+}
+
+static b32 GrowArena(memory_arena *Arena, u64 MinimumSize)
+{
+    u64 BlockSize = sizeof(memory_arena_block) + MinimumSize;
+    if(BlockSize < Arena->GrowSize)
+    {
+        BlockSize = Arena->GrowSize;
+    }
+
+    memory_arena Block = ReserveArena(BlockSize, Arena->GrowLargePages);
+
+    b32 Result = (Block.Base && CommitArena(&Block, sizeof(memory_arena_block)));
+    if(Result)
+    {
+        memory_arena_block *Link = (memory_arena_block *)Block.Base;
+        Link->Base = Arena->Base;
+        Link->Reserved = Arena->Reserved;
+        Link->Committed = Arena->Committed;
+        Link->Used = Arena->Used;
+        Link->LargePages = Arena->LargePages;
+        Link->Prev = Arena->PrevBlock;
+
+        Block.GrowSize = Arena->GrowSize;
+        Block.GrowLargePages = Arena->GrowLargePages;
+        Block.Used = sizeof(memory_arena_block);
+        Block.PrevBlock = Link;
+        *Arena = Block;
+    }
+    else
+    {
+        FreeArenaBlock(&Block);
+    }
+
+    return Result;
+}
+
+static void *PushSize(memory_arena *Arena, u64 Size, u64 Alignment = 8)
+{
+    void *Result = 0;
+
+    u64 Start = AlignPow2(Arena->Used, Alignment);
+    u64 End = Start + Size;
+    if((End > Arena->Reserved) && Arena->GrowSize && Arena->Base &&
+       GrowArena(Arena, Size + Alignment))
+    {
+        Start = AlignPow2(Arena->Used, Alignment);
+        End = Start + Size;
+    }
+
+    if((End <= Arena->Reserved) && CommitArena(Arena, End))
+    {
+        Result = Arena->Base + Start;
+        Arena->Used = End;
+    }
+
+    return Result;
+}
+
+#define PushStruct(Arena, type) (type *)PushSize((Arena), sizeof(type), alignof(type))
+#define PushArray(Arena, Count, type) (type *)PushSize((Arena), (Count)*sizeof(type), alignof(type))
+
+inline void ResetArena(memory_arena *Arena)
+{
+    while(Arena->PrevBlock)
+    {
+        FreeArenaBlock(Arena);
+    }
+
+    Arena->Used = 0;
+}
+
+static void ReleaseArena(memory_arena *Arena)
+{
+    while(Arena->Base)
+    {
+        FreeArenaBlock(Arena);
+    }
+
+    *Arena = {};
+}
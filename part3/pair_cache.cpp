@@ -0,0 +1,290 @@
+/* ========================================================================
+   Binary pair cache
+
+   After a JSON file has been parsed once, its pairs can be written next to
+   it as a flat binary file: a 64-byte header followed by the four SoA
+   columns (X0, Y0, X1, Y1), each padded to HAVERSINE_SOA_LANES. Later runs
+   map that file read-only and point a haversine_pair_soa straight at the
+   columns, so no parsing and no copying happens at all.
+
+   A cache is only used if the JSON's size and modification time match
+   what the header recorded and the column data hashes to the stored
+   checksum. The JSON itself is never read on a hit - that is the whole
+   point - so an edit that keeps both the size and the modification time
+   goes unnoticed. Anything else (including a different version) is
+   treated as stale and rebuilt.
+   ======================================================================== */
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PAIR_CACHE_MAGIC 0x43505648 // NOTE: "HVPC" in a little-endian file
+#define PAIR_CACHE_VERSION 2
+
+struct pair_cache_header
+{
+    u32 Magic;
+    u32 Version;
+
+    u64 SourceSize;
+    u64 SourceModifyTime;
+    u64 Reserved;
+
+    u64 PairCount;
+    u64 PaddedCount; // NOTE: Each column holds this many f64s
+    u64 DataOffset; // NOTE: Columns start here, back to back, X0 first
+    u64 DataHash;
+};
+static_assert(sizeof(pair_cache_header) == HAVERSINE_SOA_ALIGNMENT, "Pair cache header must keep the columns aligned");
+
+struct pair_cache
+{
+    haversine_pair_soa Pairs; // NOTE: Points into the mapping, never freed with FreeHaversineSoA
+    u64 SourceSize;
+
+    void *View;
+    u64 ViewSize;
+#if _WIN32
+    HANDLE File;
+    HANDLE Mapping;
+#endif
+};
+
+struct source_file_info
+{
+    b32 Valid;
+    u64 Size;
+    u64 ModifyTime;
+};
+
+// NOTE: Four independent multiply-xor lanes, so the hash keeps up with the memory system
+static u64 HashBytes(u8 *Data, u64 Count)
+{
+    u64 const Prime = 0x9E3779B97F4A7C15ull;
+    u64 Lanes[4] = {Count, Prime, ~Count, ~Prime};
+
+    u64 At = 0;
+    for(; (At + 32) <= Count; At += 32)
+    {
+        for(u32 LaneIndex = 0; LaneIndex < 4; ++LaneIndex)
+        {
+            u64 Word;
+            memcpy(&Word, Data + At + 8*LaneIndex, sizeof(Word));
+            Lanes[LaneIndex] = (Lanes[LaneIndex] ^ Word) * Prime;
+            Lanes[LaneIndex] ^= Lanes[LaneIndex] >> 29;
+        }
+    }
+
+    u64 Result = Lanes[0] ^ (Lanes[1] * 3) ^ (Lanes[2] * 5) ^ (Lanes[3] * 7);
+    for(; At < Count; ++At)
+    {
+        Result = (Result ^ Data[At]) * Prime;
+    }
+    Result ^= Result >> 32;
+
+    return Result;
+}
+
+static source_file_info GetSourceFileInfo(char *FileName)
+{
+    source_file_info Result = {};
+
+#if _WIN32
+    struct __stat64 Stat;
+    if(_stat64(FileName, &Stat) == 0)
+    {
+        Result.Valid = true;
+        Result.Size = Stat.st_size;
+        Result.ModifyTime = Stat.st_mtime;
+    }
+#else
+    struct stat Stat;
+    if(stat(FileName, &Stat) == 0)
+    {
+        Result.Valid = true;
+        Result.Size = Stat.st_size;
+        Result.ModifyTime = (u64)Stat.st_mtim.tv_sec*1000000000ull + Stat.st_mtim.tv_nsec;
+    }
+#endif
+
+    return Result;
+}
+
+static void UnmapPairCache(pair_cache *Cache)
+{
+#if _WIN32
+    if(Cache->View) UnmapViewOfFile(Cache->View);
+    if(Cache->Mapping) CloseHandle(Cache->Mapping);
+    if(Cache->File && (Cache->File != INVALID_HANDLE_VALUE)) CloseHandle(Cache->File);
+#else
+    if(Cache->View) munmap(Cache->View, Cache->ViewSize);
+#endif
+
+    *Cache = {};
+}
+
+static b32 MapPairCacheFile(char *CacheFileName, pair_cache *Cache)
+{
+#if _WIN32
+    Cache->File = CreateFileA(CacheFileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(Cache->File != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER Size;
+        if(GetFileSizeEx(Cache->File, &Size) && Size.QuadPart)
+        {
+            Cache->ViewSize = Size.QuadPart;
+            Cache->Mapping = CreateFileMappingA(Cache->File, 0, PAGE_READONLY, 0, 0, 0);
+            if(Cache->Mapping)
+            {
+                Cache->View = MapViewOfFile(Cache->Mapping, FILE_MAP_READ, 0, 0, 0);
+            }
+        }
+    }
+#else
+    int File = open(CacheFileName, O_RDONLY);
+    if(File >= 0)
+    {
+        struct stat Stat;
+        if((fstat(File, &Stat) == 0) && Stat.st_size)
+        {
+            Cache->ViewSize = Stat.st_size;
+            void *View = mmap(0, Cache->ViewSize, PROT_READ, MAP_PRIVATE, File, 0);
+            if(View != MAP_FAILED)
+            {
+                Cache->View = View;
+            }
+        }
+
+        // NOTE: The mapping keeps the file alive on its own
+        close(File);
+    }
+#endif
+
+    b32 Result = (Cache->View != 0);
+    return Result;
+}
+
+// NOTE: Returns a cache with Pairs.X0 == 0 if there is no usable cache file
+static pair_cache LoadPairCache(char *CacheFileName, char *SourceFileName)
+{
+    TimeFunction;
+
+    pair_cache Result = {};
+
+    char const *Stale = 0;
+    if(MapPairCacheFile(CacheFileName, &Result))
+    {
+        pair_cache_header *Header = (pair_cache_header *)Result.View;
+        source_file_info Source = GetSourceFileInfo(SourceFileName);
+
+        u64 ColumnSize = 0;
+        b32 Fits = false;
+        if(Result.ViewSize >= sizeof(pair_cache_header))
+        {
+            ColumnSize = Header->PaddedCount*sizeof(f64);
+            Fits = (Header->DataOffset >= sizeof(pair_cache_header)) &&
+                ((Header->DataOffset % HAVERSINE_SOA_ALIGNMENT) == 0) &&
+                (Header->PaddedCount >= Header->PairCount) &&
+                (Header->PaddedCount <= (Result.ViewSize / (4*sizeof(f64)))) &&
+                ((Header->DataOffset + 4*ColumnSize) <= Result.ViewSize);
+        }
+
+        if(!Fits || (Header->Magic != PAIR_CACHE_MAGIC))
+        {
+            Stale = "not a pair cache";
+        }
+        else if(Header->Version != PAIR_CACHE_VERSION)
+        {
+            Stale = "different version";
+        }
+        else if(!Source.Valid || (Header->SourceSize != Source.Size) || (Header->SourceModifyTime != Source.ModifyTime))
+        {
+            Stale = "JSON size or modification time changed";
+        }
+        else
+        {
+            TimeBandwidth("Hash cache", 4*ColumnSize);
+
+            u8 *Data = (u8 *)Result.View + Header->DataOffset;
+            if(Header->DataHash != HashBytes(Data, 4*ColumnSize))
+            {
+                Stale = "checksum mismatch";
+            }
+            else
+            {
+                haversine_pair_soa *Pairs = &Result.Pairs;
+                Pairs->Count = Header->PairCount;
+                Pairs->PaddedCount = Header->PaddedCount;
+                Pairs->X0 = (f64 *)(Data + 0*ColumnSize);
+                Pairs->Y0 = (f64 *)(Data + 1*ColumnSize);
+                Pairs->X1 = (f64 *)(Data + 2*ColumnSize);
+                Pairs->Y1 = (f64 *)(Data + 3*ColumnSize);
+                Result.SourceSize = Header->SourceSize;
+            }
+        }
+    }
+    else
+    {
+        Stale = "no cache file";
+    }
+
+    if(Stale)
+    {
+        fprintf(stdout, "Pair cache: %s (%s)\n", Stale, CacheFileName);
+        UnmapPairCache(&Result);
+    }
+    else
+    {
+        fprintf(stdout, "Pair cache: loaded %llu pairs from %s\n", Result.Pairs.Count, CacheFileName);
+    }
+
+    return Result;
+}
+
+// NOTE: Pairs must come from AllocateHaversineSoA, which keeps the four columns back to back
+static b32 WritePairCache(char *CacheFileName, char *SourceFileName, haversine_pair_soa *Pairs)
+{
+    u64 ColumnsSize = 4*Pairs->PaddedCount*sizeof(f64);
+    TimeBandwidth(__func__, ColumnsSize);
+
+    b32 Result = false;
+
+    source_file_info Source = GetSourceFileInfo(SourceFileName);
+    if(Source.Valid && Pairs->X0)
+    {
+        pair_cache_header Header = {};
+        Header.Magic = PAIR_CACHE_MAGIC;
+        Header.Version = PAIR_CACHE_VERSION;
+        Header.SourceSize = Source.Size;
+        Header.SourceModifyTime = Source.ModifyTime;
+        Header.PairCount = Pairs->Count;
+        Header.PaddedCount = Pairs->PaddedCount;
+        Header.DataOffset = sizeof(Header);
+        Header.DataHash = HashBytes((u8 *)Pairs->X0, ColumnsSize);
+
+        FILE *File = fopen(CacheFileName, "wb");
+        if(File)
+        {
+            Result = ((fwrite(&Header, sizeof(Header), 1, File) == 1) &&
+                      (!ColumnsSize || (fwrite(Pairs->X0, ColumnsSize, 1, File) == 1)));
+            Result = (fclose(File) == 0) && Result;
+        }
+
+        if(Result)
+        {
+            fprintf(stdout, "Pair cache: wrote %llu pairs to %s\n", Pairs->Count, CacheFileName);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Unable to write pair cache \"%s\".\n", CacheFileName);
+            remove(CacheFileName);
+        }
+    }
+
+    return Result;
+}
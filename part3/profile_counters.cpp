@@ -0,0 +1,234 @@
+/* ========================================================================
+   Hardware performance counters for the profiler
+
+   Each profiled thread opens one perf_event group (cycles, instructions,
+   L1D/LLC read misses, branch misses, dTLB read misses) counting only
+   itself in user mode, and maps every event's page. Counters are read
+   with a seqlock loop around one rdpmc per event, with no system call,
+   whenever the kernel allows user-space rdpmc (cap_user_rdpmc on every
+   event's page). Otherwise, or when built with PROFILE_COUNTERS_RDPMC 0,
+   they fall back to a single read() of the whole group, which is a
+   system call per read and so much more expensive per block.
+
+   Events the CPU or kernel won't open are skipped and report nothing;
+   the rest still count. Only Linux is supported - elsewhere, and in VMs
+   without a virtual PMU, OpenProfileCounters just fails.
+   ======================================================================== */
+
+#if !_WIN32
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#endif
+
+#ifndef PROFILE_COUNTERS_RDPMC
+#define PROFILE_COUNTERS_RDPMC 1
+#endif
+
+enum profile_counter
+{
+    ProfileCounter_Cycles,
+    ProfileCounter_Instructions,
+    ProfileCounter_L1DMisses,
+    ProfileCounter_LLCMisses,
+    ProfileCounter_BranchMisses,
+    ProfileCounter_DTLBMisses,
+
+    ProfileCounter_Count,
+};
+
+struct profile_counter_set
+{
+    u32 EventCount;
+    u32 Counters[ProfileCounter_Count]; // NOTE: Which profile_counter each open event is, in group order
+    b32 UseRDPMC;
+
+#if !_WIN32
+    int Fds[ProfileCounter_Count];
+    perf_event_mmap_page *Pages[ProfileCounter_Count];
+#endif
+};
+
+static char const *DescribeProfileCounter(profile_counter Counter)
+{
+    char const *Result;
+    switch(Counter)
+    {
+        case ProfileCounter_Cycles: {Result = "cycles";} break;
+        case ProfileCounter_Instructions: {Result = "instructions";} break;
+        case ProfileCounter_L1DMisses: {Result = "L1D";} break;
+        case ProfileCounter_LLCMisses: {Result = "LLC";} break;
+        case ProfileCounter_BranchMisses: {Result = "branch";} break;
+        case ProfileCounter_DTLBMisses: {Result = "dTLB";} break;
+        default : {Result = "UNKNOWN";} break;
+    }
+
+    return Result;
+}
+
+#if !_WIN32
+
+static void GetProfileCounterEvent(profile_counter Counter, u32 *Type, u64 *Config)
+{
+    u64 ReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    switch(Counter)
+    {
+        case ProfileCounter_Cycles: {*Type = PERF_TYPE_HARDWARE; *Config = PERF_COUNT_HW_CPU_CYCLES;} break;
+        case ProfileCounter_Instructions: {*Type = PERF_TYPE_HARDWARE; *Config = PERF_COUNT_HW_INSTRUCTIONS;} break;
+        case ProfileCounter_L1DMisses: {*Type = PERF_TYPE_HW_CACHE; *Config = PERF_COUNT_HW_CACHE_L1D | ReadMiss;} break;
+        case ProfileCounter_LLCMisses: {*Type = PERF_TYPE_HW_CACHE; *Config = PERF_COUNT_HW_CACHE_LL | ReadMiss;} break;
+        case ProfileCounter_BranchMisses: {*Type = PERF_TYPE_HARDWARE; *Config = PERF_COUNT_HW_BRANCH_MISSES;} break;
+        case ProfileCounter_DTLBMisses: {*Type = PERF_TYPE_HW_CACHE; *Config = PERF_COUNT_HW_CACHE_DTLB | ReadMiss;} break;
+        default: {*Type = PERF_TYPE_HARDWARE; *Config = PERF_COUNT_HW_CPU_CYCLES;} break;
+    }
+}
+
+// NOTE: Opens the group for the calling thread. Returns false if not even the leader would open.
+static b32 OpenProfileCounters(profile_counter_set *Set)
+{
+    *Set = {};
+
+    long PageSize = sysconf(_SC_PAGESIZE);
+    int Leader = -1;
+    b32 AllMapped = true;
+    for(u32 Counter = 0; Counter < ProfileCounter_Count; ++Counter)
+    {
+        perf_event_attr Attr = {};
+        Attr.size = sizeof(Attr);
+        u32 Type;
+        u64 Config;
+        GetProfileCounterEvent((profile_counter)Counter, &Type, &Config);
+        Attr.type = Type;
+        Attr.config = Config;
+        Attr.read_format = PERF_FORMAT_GROUP;
+        Attr.exclude_kernel = 1;
+        Attr.exclude_hv = 1;
+
+        // NOTE: Pinned so the group is never multiplexed; counts that were scaled would be useless per block
+        Attr.pinned = (Leader < 0);
+
+        int Fd = (int)syscall(__NR_perf_event_open, &Attr, 0, -1, Leader, 0);
+        if(Fd >= 0)
+        {
+            if(Leader < 0)
+            {
+                Leader = Fd;
+            }
+
+            void *Page = mmap(0, PageSize, PROT_READ, MAP_SHARED, Fd, 0);
+            if(Page == MAP_FAILED)
+            {
+                Page = 0;
+                AllMapped = false;
+            }
+
+            Set->Fds[Set->EventCount] = Fd;
+            Set->Pages[Set->EventCount] = (perf_event_mmap_page *)Page;
+            Set->Counters[Set->EventCount] = Counter;
+            ++Set->EventCount;
+        }
+    }
+
+    Set->UseRDPMC = PROFILE_COUNTERS_RDPMC && (Set->EventCount > 0) && AllMapped;
+    for(u32 EventIndex = 0; EventIndex < Set->EventCount; ++EventIndex)
+    {
+        if(Set->Pages[EventIndex] && !Set->Pages[EventIndex]->cap_user_rdpmc)
+        {
+            Set->UseRDPMC = false;
+        }
+    }
+
+    b32 Result = (Set->EventCount > 0);
+    return Result;
+}
+
+static void CloseProfileCounters(profile_counter_set *Set)
+{
+    long PageSize = sysconf(_SC_PAGESIZE);
+    for(u32 EventIndex = 0; EventIndex < Set->EventCount; ++EventIndex)
+    {
+        if(Set->Pages[EventIndex])
+        {
+            munmap(Set->Pages[EventIndex], PageSize);
+        }
+        close(Set->Fds[EventIndex]);
+    }
+
+    *Set = {};
+}
+
+inline u64 ReadProfileCounterRDPMC(perf_event_mmap_page *Page)
+{
+    // NOTE: The kernel bumps lock around every update, so retry until a read didn't straddle one.
+    // Index 0 means the event isn't on a hardware counter right now and offset is the whole count.
+    u64 Result;
+    u32 Sequence;
+    do
+    {
+        Sequence = Page->lock;
+        __asm__ __volatile__("" ::: "memory");
+
+        u32 Index = Page->index;
+        Result = Page->offset;
+        if(Index)
+        {
+            u32 Width = Page->pmc_width;
+            u64 Value = __rdpmc(Index - 1);
+            Value <<= 64 - Width;
+            Result += (u64)((int64_t)Value >> (64 - Width));
+        }
+
+        __asm__ __volatile__("" ::: "memory");
+    } while(Page->lock != Sequence);
+
+    return Result;
+}
+
+// NOTE: Only the entries for the set's open events are written
+inline void ReadProfileCounters(profile_counter_set *Set, u64 *Values)
+{
+    if(Set->UseRDPMC)
+    {
+        for(u32 EventIndex = 0; EventIndex < Set->EventCount; ++EventIndex)
+        {
+            Values[Set->Counters[EventIndex]] = ReadProfileCounterRDPMC(Set->Pages[EventIndex]);
+        }
+    }
+    else
+    {
+        for(u32 EventIndex = 0; EventIndex < Set->EventCount; ++EventIndex)
+        {
+            Values[Set->Counters[EventIndex]] = 0;
+        }
+
+        u64 Group[1 + ProfileCounter_Count] = {};
+        if(read(Set->Fds[0], Group, sizeof(Group)) > 0)
+        {
+            for(u32 EventIndex = 0; (EventIndex < Group[0]) && (EventIndex < Set->EventCount); ++EventIndex)
+            {
+                Values[Set->Counters[EventIndex]] = Group[1 + EventIndex];
+            }
+        }
+    }
+}
+
+#else
+
+static b32 OpenProfileCounters(profile_counter_set *Set)
+{
+    *Set = {};
+    return false;
+}
+
+static void CloseProfileCounters(profile_counter_set *Set)
+{
+}
+
+inline void ReadProfileCounters(profile_counter_set *Set, u64 *Values)
+{
+}
+
+#endif
@@ -0,0 +1,290 @@
+/* ========================================================================
+   Minimal thread pool
+
+   Worker threads are started once and then sleep until RunTasks hands them
+   a batch. A batch is just a function and a task count; every thread
+   (including the caller's) pulls task indices off a shared counter until
+   the batch is exhausted, and RunTasks returns once all of them finished.
+
+   Workers register with the profiler in listing 100 as "worker 1", "worker
+   2", ... when they start, so task functions can open profile blocks like
+   any other code; the report breaks them down per thread.
+   ======================================================================== */
+
+#ifndef THREAD_POOL_CPP
+#define THREAD_POOL_CPP
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef void thread_task_function(void *Data, u32 TaskIndex);
+
+#define MAX_POOL_THREAD_COUNT 256
+
+struct thread_pool
+{
+    u32 ThreadCount; // NOTE: Includes the thread that calls RunTasks
+    b32 Quit;
+
+    thread_task_function *Function;
+    void *Data;
+    u32 TaskCount;
+    u32 volatile NextTask;
+    u32 volatile CompletedTaskCount;
+    u64 Generation;
+    u32 BusyWorkerCount; // NOTE: Workers inside DoPoolTasks; the batch can't be replaced until this is 0
+    u32 volatile StartedWorkerCount;
+
+#if _WIN32
+    HANDLE Threads[MAX_POOL_THREAD_COUNT];
+    SRWLOCK Lock;
+    CONDITION_VARIABLE WorkReady;
+    CONDITION_VARIABLE WorkDone;
+#else
+    pthread_t Threads[MAX_POOL_THREAD_COUNT];
+    pthread_mutex_t Lock;
+    pthread_cond_t WorkReady;
+    pthread_cond_t WorkDone;
+#endif
+};
+
+#if _WIN32
+
+inline u32 AtomicIncrementU32(u32 volatile *Value)
+{
+    // NOTE: Returns the value from before the increment
+    u32 Result = (u32)InterlockedIncrement((LONG volatile *)Value) - 1;
+    return Result;
+}
+
+static u32 GetProcessorCount(void)
+{
+    SYSTEM_INFO Info;
+    GetSystemInfo(&Info);
+    return Info.dwNumberOfProcessors;
+}
+
+static void LockPool(thread_pool *Pool) {AcquireSRWLockExclusive(&Pool->Lock);}
+static void UnlockPool(thread_pool *Pool) {ReleaseSRWLockExclusive(&Pool->Lock);}
+static void WaitForWork(thread_pool *Pool) {SleepConditionVariableSRW(&Pool->WorkReady, &Pool->Lock, INFINITE, 0);}
+static void WaitForDone(thread_pool *Pool) {SleepConditionVariableSRW(&Pool->WorkDone, &Pool->Lock, INFINITE, 0);}
+static void SignalWork(thread_pool *Pool) {WakeAllConditionVariable(&Pool->WorkReady);}
+static void SignalDone(thread_pool *Pool) {WakeAllConditionVariable(&Pool->WorkDone);}
+
+#else
+
+inline u32 AtomicIncrementU32(u32 volatile *Value)
+{
+    // NOTE: Returns the value from before the increment
+    u32 Result = __atomic_fetch_add(Value, 1, __ATOMIC_ACQ_REL);
+    return Result;
+}
+
+static u32 GetProcessorCount(void)
+{
+    long Count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (Count > 0) ? (u32)Count : 1;
+}
+
+static void LockPool(thread_pool *Pool) {pthread_mutex_lock(&Pool->Lock);}
+static void UnlockPool(thread_pool *Pool) {pthread_mutex_unlock(&Pool->Lock);}
+static void WaitForWork(thread_pool *Pool) {pthread_cond_wait(&Pool->WorkReady, &Pool->Lock);}
+static void WaitForDone(thread_pool *Pool) {pthread_cond_wait(&Pool->WorkDone, &Pool->Lock);}
+static void SignalWork(thread_pool *Pool) {pthread_cond_broadcast(&Pool->WorkReady);}
+static void SignalDone(thread_pool *Pool) {pthread_cond_broadcast(&Pool->WorkDone);}
+
+#endif
+
+// NOTE: Pulls tasks off the current batch until there are none left
+static void DoPoolTasks(thread_pool *Pool)
+{
+    for(;;)
+    {
+        u32 TaskIndex = AtomicIncrementU32(&Pool->NextTask);
+        if(TaskIndex >= Pool->TaskCount)
+        {
+            break;
+        }
+
+        Pool->Function(Pool->Data, TaskIndex);
+
+        if((AtomicIncrementU32(&Pool->CompletedTaskCount) + 1) == Pool->TaskCount)
+        {
+            LockPool(Pool);
+            SignalDone(Pool);
+            UnlockPool(Pool);
+        }
+    }
+}
+
+static void PoolWorkerLoop(thread_pool *Pool)
+{
+    RegisterProfilerThread("worker", AtomicIncrementU32(&Pool->StartedWorkerCount) + 1);
+
+    u64 SeenGeneration = 0;
+    for(;;)
+    {
+        LockPool(Pool);
+        while(!Pool->Quit && (Pool->Generation == SeenGeneration))
+        {
+            WaitForWork(Pool);
+        }
+        b32 Quit = Pool->Quit;
+        SeenGeneration = Pool->Generation;
+        if(!Quit)
+        {
+            ++Pool->BusyWorkerCount;
+        }
+        UnlockPool(Pool);
+
+        if(Quit)
+        {
+            break;
+        }
+
+        DoPoolTasks(Pool);
+
+        LockPool(Pool);
+        if(--Pool->BusyWorkerCount == 0)
+        {
+            SignalDone(Pool);
+        }
+        UnlockPool(Pool);
+    }
+
+    ReleaseProfilerThread();
+}
+
+#if _WIN32
+static DWORD WINAPI PoolWorkerThread(LPVOID Param)
+{
+    PoolWorkerLoop((thread_pool *)Param);
+    return 0;
+}
+#else
+static void *PoolWorkerThread(void *Param)
+{
+    PoolWorkerLoop((thread_pool *)Param);
+    return 0;
+}
+#endif
+
+// NOTE: ThreadCount 0 means one thread per logical processor. The pool is
+// heap-allocated because the workers hold on to its address.
+static thread_pool *CreateThreadPool(u32 ThreadCount)
+{
+    if(ThreadCount == 0)
+    {
+        ThreadCount = GetProcessorCount();
+    }
+
+    if(ThreadCount > MAX_POOL_THREAD_COUNT)
+    {
+        ThreadCount = MAX_POOL_THREAD_COUNT;
+    }
+
+    thread_pool *Pool = (thread_pool *)calloc(1, sizeof(thread_pool));
+    if(Pool)
+    {
+        Pool->ThreadCount = 1;
+
+#if _WIN32
+        InitializeSRWLock(&Pool->Lock);
+        InitializeConditionVariable(&Pool->WorkReady);
+        InitializeConditionVariable(&Pool->WorkDone);
+#else
+        pthread_mutex_init(&Pool->Lock, 0);
+        pthread_cond_init(&Pool->WorkReady, 0);
+        pthread_cond_init(&Pool->WorkDone, 0);
+#endif
+
+        // NOTE: Slot 0 is the calling thread, so only ThreadCount - 1 workers are started
+        for(u32 ThreadIndex = 1; ThreadIndex < ThreadCount; ++ThreadIndex)
+        {
+#if _WIN32
+            HANDLE Thread = CreateThread(0, 0, PoolWorkerThread, Pool, 0, 0);
+            b32 Started = (Thread != 0);
+#else
+            pthread_t Thread;
+            b32 Started = (pthread_create(&Thread, 0, PoolWorkerThread, Pool) == 0);
+#endif
+            if(!Started)
+            {
+                fprintf(stderr, "ERROR: Unable to start worker thread %u, continuing with %u.\n", ThreadIndex, Pool->ThreadCount);
+                break;
+            }
+
+            Pool->Threads[Pool->ThreadCount++] = Thread;
+        }
+    }
+
+    return Pool;
+}
+
+static void RunTasks(thread_pool *Pool, u32 TaskCount, thread_task_function *Function, void *Data)
+{
+    if(TaskCount)
+    {
+        LockPool(Pool);
+
+        // NOTE: A worker that woke up late for the previous batch may still be
+        // looking at it, so wait for it to leave before swapping the batch out.
+        while(Pool->BusyWorkerCount)
+        {
+            WaitForDone(Pool);
+        }
+
+        Pool->Function = Function;
+        Pool->Data = Data;
+        Pool->TaskCount = TaskCount;
+        Pool->NextTask = 0;
+        Pool->CompletedTaskCount = 0;
+        ++Pool->Generation;
+        SignalWork(Pool);
+        UnlockPool(Pool);
+
+        DoPoolTasks(Pool);
+
+        LockPool(Pool);
+        while(Pool->CompletedTaskCount != Pool->TaskCount)
+        {
+            WaitForDone(Pool);
+        }
+        UnlockPool(Pool);
+    }
+}
+
+static void FreeThreadPool(thread_pool *Pool)
+{
+    if(Pool)
+    {
+        LockPool(Pool);
+        Pool->Quit = true;
+        SignalWork(Pool);
+        UnlockPool(Pool);
+
+        for(u32 ThreadIndex = 1; ThreadIndex < Pool->ThreadCount; ++ThreadIndex)
+        {
+#if _WIN32
+            WaitForSingleObject(Pool->Threads[ThreadIndex], INFINITE);
+            CloseHandle(Pool->Threads[ThreadIndex]);
+#else
+            pthread_join(Pool->Threads[ThreadIndex], 0);
+#endif
+        }
+
+#if !_WIN32
+        pthread_mutex_destroy(&Pool->Lock);
+        pthread_cond_destroy(&Pool->WorkReady);
+        pthread_cond_destroy(&Pool->WorkDone);
+#endif
+
+        free(Pool);
+    }
+}
+
+#endif